@@ -1,14 +1,26 @@
 #include "FormulaAST.h"
 
+#include "aggregate_kernels.h"
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std::literals;
 
 namespace ASTImpl {
 
@@ -67,343 +79,958 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
-class Expr {
+namespace {
+
+// Размер первого блока арены, достаточный для типичной короткой формулы
+constexpr size_t AST_ARENA_INITIAL_SIZE = 256;
+
+// Глубина стека, до которой стековая машина обходится буфером
+// в автоматической памяти
+constexpr size_t INLINE_STACK_SIZE = 32;
+
+char GetOperationSign(OpCode code) {
+    switch (code) {
+        case OpCode::Add:
+        case OpCode::UnaryPlus:
+            return '+';
+        case OpCode::Subtract:
+        case OpCode::UnaryMinus:
+            return '-';
+        case OpCode::Multiply:
+            return '*';
+        case OpCode::Divide:
+            return '/';
+        default:
+            // have to do this because VC++ has a buggy warning
+            assert(false);
+            return '?';
+    }
+}
+
+ExprPrecedence GetPrecedence(OpCode code) {
+    switch (code) {
+        case OpCode::Add:
+            return EP_ADD;
+        case OpCode::Subtract:
+            return EP_SUB;
+        case OpCode::Multiply:
+            return EP_MUL;
+        case OpCode::Divide:
+            return EP_DIV;
+        case OpCode::UnaryPlus:
+        case OpCode::UnaryMinus:
+            return EP_UNARY;
+        default:
+            return EP_ATOM;
+    }
+}
+
+std::string PrintNumber(double value) {
+    std::ostringstream out;
+    out << value;
+    return out.str();
+}
+
+// Позиция ячейки, заданной смещением offset относительно anchor
+Position Shift(Position offset, Position anchor) {
+    return { offset.row + anchor.row, offset.col + anchor.col };
+}
+
+std::string PrintCell(Position cell) {
+    if (!cell.IsValid()) {
+        std::ostringstream out;
+        out << FormulaError::Category::Ref;
+        return out.str();
+    }
+    return cell.ToString();
+}
+
+// Ошибки вычисления передаются по стеку машины как значения, без исключений:
+// ошибка кодируется тихим NaN, младшие биты мантиссы которого хранят ее
+// категорию. Числа формул NaN не бывают, а арифметика порождает NaN только
+// вместе с бесконечностью, которая сама означает ошибку, поэтому любой NaN
+// на стеке - ошибка
+constexpr std::uint64_t ERROR_BITS = 0x7FF8'0000'0000'0000;
+
+double MakeError(FormulaError::Category category) {
+    const std::uint64_t bits = ERROR_BITS | (static_cast<std::uint64_t>(category) + 1);
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+bool IsError(double value) {
+    return std::isnan(value);
+}
+
+FormulaError::Category GetErrorCategory(double value) {
+    std::uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    switch (bits & 0xFF) {
+        case static_cast<std::uint64_t>(FormulaError::Category::Ref) + 1:
+            return FormulaError::Category::Ref;
+        case static_cast<std::uint64_t>(FormulaError::Category::Div0) + 1:
+            return FormulaError::Category::Div0;
+        default:
+            return FormulaError::Category::Value;
+    }
+}
+
+// Результат арифметической операции над lhs и rhs. Конечный результат
+// означает, что ни один операнд не был ошибкой; иначе передается ошибка
+// операнда, а бесконечность (деление на ноль, переполнение) дает #DIV/0!
+double CheckResult(double lhs, double rhs, double result) {
+    if (std::isfinite(result)) {
+        return result;
+    }
+    if (IsError(lhs)) {
+        return lhs;
+    }
+    if (IsError(rhs)) {
+        return rhs;
+    }
+    return MakeError(FormulaError::Category::Div0);
+}
+
+// Частное lhs / rhs. Делитель проверяется раньше делимого, как при
+// вычислении по дереву: сначала ошибка делителя, затем деление на ноль
+// и только потом ошибка делимого
+double Divide(double lhs, double rhs) {
+    if (IsError(rhs)) {
+        return rhs;
+    }
+    if (rhs == 0.0) {
+        return MakeError(FormulaError::Category::Div0);
+    }
+    return CheckResult(lhs, rhs, lhs / rhs);
+}
+
+// Число или ошибка в представлении стековой машины
+double ToStackValue(const CellInterface::NumericValue& value) {
+    if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    }
+    return MakeError(std::get<FormulaError>(value).GetCategory());
+}
+
+// Значение ячейки, на которую ссылается формула, или ошибка
+double LoadCell(const SheetInterface& sheet, Position cell) {
+    if (!cell.IsValid()) {
+        return MakeError(FormulaError::Category::Ref);
+    }
+
+    return ToStackValue(sheet.GetNumericValue(cell));
+}
+
+// Имена агрегатных функций в порядке перечисления Function
+constexpr std::string_view FUNCTION_NAMES[] = { "SUM"sv, "AVERAGE"sv, "MIN"sv, "MAX"sv, "COUNT"sv };
+
+std::optional<Function> FindFunction(std::string_view name) {
+    for (size_t i = 0; i < std::size(FUNCTION_NAMES); ++i) {
+        if (FUNCTION_NAMES[i] == name) {
+            return static_cast<Function>(i);
+        }
+    }
+    return std::nullopt;
+}
+
+// Текст вызова агрегатной функции, например SUM(A1:A10,C1)
+std::string PrintCall(const Program& program, const FunctionCall& call, Position anchor) {
+    std::string text(FUNCTION_NAMES[static_cast<size_t>(call.function)]);
+    text += '(';
+    for (std::uint32_t i = 0; i < call.range_count; ++i) {
+        const Range& range = program.ranges[call.first_range + i];
+        if (i > 0) {
+            text += ',';
+        }
+        text += PrintCell(Shift(range.first, anchor));
+        if (!(range.first == range.last)) {
+            text += ':' + PrintCell(Shift(range.last, anchor));
+        }
+    }
+    text += ')';
+    return text;
+}
+
+// Накапливает значения аргументов агрегатной функции. Непрерывные участки
+// чисел обрабатываются векторными ядрами, остальные ячейки - по одной.
+// Ячейка, значение которой не является числом, дает ошибку #VALUE!,
+// кроме функции COUNT, которая считает только числа
+class Aggregator final : public RangeVisitor {
 public:
-    virtual ~Expr() = default;
-    virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(const SheetInterface& /*sheet*/) const = 0;
+    explicit Aggregator(Function function)
+        : function_(function) {
+    }
 
-    // higher is tighter
-    virtual ExprPrecedence GetPrecedence() const = 0;
+    void VisitNumbers(const double* values, size_t count) override {
+        // После первой ошибки значения не нужны
+        if (IsError(error_)) {
+            return;
+        }
 
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
-                      bool right_child = false) const {
-        auto precedence = GetPrecedence();
-        auto mask = right_child ? PR_RIGHT : PR_LEFT;
-        bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
-        if (parens_needed) {
-            out << '(';
+        switch (function_) {
+            case Function::Sum:
+            case Function::Average:
+                sum_ += SumValues(values, count);
+                break;
+            case Function::Min:
+                min_ = std::min(min_, MinValue(values, count));
+                break;
+            case Function::Max:
+                max_ = std::max(max_, MaxValue(values, count));
+                break;
+            case Function::Count:
+                break;
         }
+        count_ += count;
+    }
 
-        DoPrintFormula(out, precedence);
+    void VisitCell(const CellInterface& cell) override {
+        const double value = ToStackValue(cell.GetNumericValue());
+        if (!IsError(value)) {
+            VisitNumbers(&value, 1);
+        } else if (function_ != Function::Count && !IsError(error_)) {
+            error_ = value;
+        }
+    }
 
-        if (parens_needed) {
-            out << ')';
+    // Значение функции или ошибка; MIN и MAX без значений равны нулю,
+    // AVERAGE без значений - ошибка деления на ноль
+    double GetResult() const {
+        if (IsError(error_)) {
+            return error_;
         }
+
+        switch (function_) {
+            case Function::Sum:
+                return CheckResult(0.0, 0.0, sum_);
+            case Function::Average:
+                return CheckResult(0.0, 0.0, sum_ / static_cast<double>(count_));
+            case Function::Min:
+                return count_ == 0 ? 0.0 : min_;
+            case Function::Max:
+                return count_ == 0 ? 0.0 : max_;
+            case Function::Count:
+                break;
+        }
+        return static_cast<double>(count_);
     }
+
+private:
+    Function function_;
+    double sum_ = 0.0;
+    double min_ = std::numeric_limits<double>::infinity();
+    double max_ = -std::numeric_limits<double>::infinity();
+    size_t count_ = 0;
+    double error_ = 0.0; // Первая ошибка среди значений
 };
 
-namespace {
-class BinaryOpExpr final : public Expr {
+// Значение агрегатной функции, ссылки аргументов которой отсчитываются от anchor
+double Aggregate(const SheetInterface& sheet, const Program& program, const FunctionCall& call,
+                 Position anchor) {
+    Aggregator aggregator(call.function);
+    for (std::uint32_t i = 0; i < call.range_count; ++i) {
+        const Range& offsets = program.ranges[call.first_range + i];
+        const Range range = { Shift(offsets.first, anchor), Shift(offsets.last, anchor) };
+        if (!range.IsValid()) {
+            return MakeError(FormulaError::Category::Ref);
+        }
+        sheet.VisitRange(range, aggregator);
+    }
+    return aggregator.GetResult();
+}
+
+// Оптимизатор байт-кода. Восстанавливает по обратной польской записи
+// дерево выражения, упрощая каждый узел при его создании, и заново
+// генерирует по дереву байт-код:
+// * подвыражения из одних чисел заменяются их значением, если при
+//   вычислении не возникает ошибки (иначе она возникнет при выполнении);
+// * удаляются унарный плюс и операции с нейтральным элементом: x*1, 1*x,
+//   x/1, а также x+(-0), (-0)+x и x-(+0). Сложение с +0 и вычитание -0
+//   превращают -0 в +0, поэтому удаляются, только если x - константа,
+//   отличная от -0;
+// * двойное отрицание сокращается;
+// * повторные ссылки на ячейку не загружают ее значение заново.
+// Вызовы агрегатных функций переносятся без изменений
+class Optimizer {
 public:
-    enum Type : char {
-        Add = '+',
-        Subtract = '-',
-        Multiply = '*',
-        Divide = '/',
+    explicit Optimizer(const Program& source)
+        : source_(source) {
+    }
+
+    Program Run(std::pmr::memory_resource* resource) {
+        std::vector<size_t> stack;
+        for (const Instruction& instr : source_.code) {
+            switch (instr.code) {
+                case OpCode::PushNumber:
+                    stack.push_back(AddNumber(source_.numbers[instr.operand]));
+                    break;
+                case OpCode::LoadCell:
+                case OpCode::ReloadCell:
+                    stack.push_back(AddNode({ OpCode::LoadCell, 0.0,
+                                              source_.cells[instr.operand] }));
+                    break;
+                case OpCode::Aggregate:
+                    stack.push_back(AddNode({ OpCode::Aggregate, 0.0, Position::NONE,
+                                              0, 0, instr.operand }));
+                    break;
+                case OpCode::UnaryPlus:
+                    break;
+                case OpCode::UnaryMinus:
+                    stack.back() = Negate(stack.back());
+                    break;
+                default: {
+                    const size_t rhs = stack.back();
+                    stack.pop_back();
+                    stack.back() = Binary(instr.code, stack.back(), rhs);
+                }
+            }
+        }
+
+        Program result(resource);
+        result.code.reserve(nodes_.size());
+        size_t depth = 0;
+        Emit(stack.back(), result, depth);
+        return result;
+    }
+
+private:
+    struct Node {
+        OpCode code;
+        double number = 0.0;
+        Position cell = Position::NONE;
+        size_t lhs = 0;
+        size_t rhs = 0;
+        std::uint32_t call = 0; // Индекс вызова функции в исходной программе
     };
 
-public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
-        : type_(type)
-        , lhs_(std::move(lhs))
-        , rhs_(std::move(rhs)) {
-    }
-
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        lhs_->Print(out);
-        out << ' ';
-        rhs_->Print(out);
-        out << ')';
-    }
-
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
-        out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
-    }
-
-    ExprPrecedence GetPrecedence() const override {
-        switch (type_) {
-            case Add:
-                return EP_ADD;
-            case Subtract:
-                return EP_SUB;
-            case Multiply:
-                return EP_MUL;
-            case Divide:
-                return EP_DIV;
-            default:
-                // have to do this because VC++ has a buggy warning
-                assert(false);
-                return static_cast<ExprPrecedence>(INT_MAX);
+    size_t AddNode(Node node) {
+        nodes_.push_back(node);
+        return nodes_.size() - 1;
+    }
+
+    size_t AddNumber(double value) {
+        return AddNode({ OpCode::PushNumber, value });
+    }
+
+    bool IsNumber(size_t node, double value) const {
+        return nodes_[node].code == OpCode::PushNumber && nodes_[node].number == value;
+    }
+    // Нуль со знаком negative: -0 при true, +0 при false
+    bool IsZero(size_t node, bool negative) const {
+        return IsNumber(node, 0.0) && std::signbit(nodes_[node].number) == negative;
+    }
+    // Значение узла заведомо не -0: константа, отличная от -0
+    bool IsNeverNegativeZero(size_t node) const {
+        return nodes_[node].code == OpCode::PushNumber && !IsZero(node, true);
+    }
+
+    size_t Negate(size_t operand) {
+        const Node& node = nodes_[operand];
+        if (node.code == OpCode::PushNumber) {
+            return AddNumber(-node.number);
+        }
+        if (node.code == OpCode::UnaryMinus) {
+            return node.lhs;
         }
+        return AddNode({ OpCode::UnaryMinus, 0.0, Position::NONE, operand });
     }
 
-    double Evaluate(const SheetInterface& sheet) const override {
-        double result = 0.0;
+    size_t Binary(OpCode code, size_t lhs, size_t rhs) {
+        if (nodes_[lhs].code == OpCode::PushNumber && nodes_[rhs].code == OpCode::PushNumber) {
+            if (const auto value = Fold(code, nodes_[lhs].number, nodes_[rhs].number)) {
+                return AddNumber(*value);
+            }
+        }
 
-        switch (type_) {
-            case Add:
-                result = lhs_->Evaluate(sheet) + rhs_->Evaluate(sheet);
+        switch (code) {
+            case OpCode::Add:
+                // -0 + 0 = +0: нуль отбрасывается, если сумма равна
+                // операнду и при операнде -0
+                if (IsZero(rhs, true) || (IsZero(rhs, false) && IsNeverNegativeZero(lhs))) {
+                    return lhs;
+                }
+                if (IsZero(lhs, true) || (IsZero(lhs, false) && IsNeverNegativeZero(rhs))) {
+                    return rhs;
+                }
                 break;
-            case Subtract:
-                result = lhs_->Evaluate(sheet) - rhs_->Evaluate(sheet);
+            case OpCode::Subtract:
+                if (IsZero(rhs, false) || (IsZero(rhs, true) && IsNeverNegativeZero(lhs))) {
+                    return lhs;
+                }
                 break;
-            case Multiply:
-                result = lhs_->Evaluate(sheet) * rhs_->Evaluate(sheet);
+            case OpCode::Multiply:
+                if (IsNumber(rhs, 1.0)) {
+                    return lhs;
+                }
+                if (IsNumber(lhs, 1.0)) {
+                    return rhs;
+                }
                 break;
-            case Divide:
-                if (rhs_->Evaluate(sheet) == 0.0) {
-                    throw FormulaError(FormulaError::Category::Div0);
+            case OpCode::Divide:
+                if (IsNumber(rhs, 1.0)) {
+                    return lhs;
                 }
+                break;
+            default:
+                break;
+        }
 
-                result = lhs_->Evaluate(sheet) / rhs_->Evaluate(sheet);
+        return AddNode({ code, 0.0, Position::NONE, lhs, rhs });
+    }
+
+    // Значение операции над числами или nullopt, если она дает ошибку
+    static std::optional<double> Fold(OpCode code, double lhs, double rhs) {
+        double result = 0.0;
+        switch (code) {
+            case OpCode::Add:
+                result = lhs + rhs;
+                break;
+            case OpCode::Subtract:
+                result = lhs - rhs;
+                break;
+            case OpCode::Multiply:
+                result = lhs * rhs;
                 break;
+            case OpCode::Divide:
+                if (rhs == 0.0) {
+                    return std::nullopt;
+                }
+                result = lhs / rhs;
+                break;
+            default:
+                assert(false);
         }
 
         if (std::isinf(result)) {
-            throw FormulaError(FormulaError::Category::Div0);
+            return std::nullopt;
         }
-
         return result;
     }
 
-private:
-    Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
+    void Emit(size_t index, Program& program, size_t& depth) {
+        const Node& node = nodes_[index];
+        switch (node.code) {
+            case OpCode::PushNumber:
+                program.numbers.push_back(node.number);
+                program.code.push_back({ OpCode::PushNumber,
+                    static_cast<std::uint32_t>(program.numbers.size() - 1) });
+                program.stack_size = std::max(program.stack_size, ++depth);
+                return;
+            case OpCode::LoadCell: {
+                const auto [it, inserted] = cell_slots_.emplace(
+                    CellKey(node.cell), static_cast<std::uint32_t>(program.cells.size()));
+                if (inserted) {
+                    program.cells.push_back(node.cell);
+                    program.code.push_back({ OpCode::LoadCell, it->second });
+                } else {
+                    program.code.push_back({ OpCode::ReloadCell, it->second });
+                }
+                program.stack_size = std::max(program.stack_size, ++depth);
+                return;
+            }
+            case OpCode::Aggregate: {
+                const FunctionCall& call = source_.calls[node.call];
+                const auto ranges = source_.ranges.begin() + call.first_range;
+                program.calls.push_back({ call.function,
+                    static_cast<std::uint32_t>(program.ranges.size()), call.range_count });
+                program.ranges.insert(program.ranges.end(), ranges, ranges + call.range_count);
+                program.code.push_back({ OpCode::Aggregate,
+                    static_cast<std::uint32_t>(program.calls.size() - 1) });
+                program.stack_size = std::max(program.stack_size, ++depth);
+                return;
+            }
+            case OpCode::UnaryMinus:
+                Emit(node.lhs, program, depth);
+                program.code.push_back({ OpCode::UnaryMinus });
+                return;
+            default:
+                Emit(node.lhs, program, depth);
+                Emit(node.rhs, program, depth);
+                program.code.push_back({ node.code });
+                --depth;
+        }
+    }
+
+    // Ключ ячейки в таблице слотов; ссылка может быть и недопустимой
+    static std::uint64_t CellKey(Position cell) {
+        return static_cast<std::uint64_t>(static_cast<std::uint32_t>(cell.row)) << 32
+               | static_cast<std::uint32_t>(cell.col);
+    }
+
+    const Program& source_;
+    std::vector<Node> nodes_;
+    // Слоты загруженных ячеек: повторная ссылка перечитывает слот
+    std::unordered_map<std::uint64_t, std::uint32_t> cell_slots_;
 };
 
-class UnaryOpExpr final : public Expr {
-public:
-    enum Type : char {
-        UnaryPlus = '+',
-        UnaryMinus = '-',
-    };
+// Число из текста литерала NUMBER
+double ParseNumber(std::string_view text) {
+    double value = 0;
+    const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (error == std::errc::result_out_of_range) {
+        // Исчезающе малые числа допустимы и округляются, переполнение - нет
+        value = std::strtod(std::string(text).c_str(), nullptr);
+        if (std::isinf(value)) {
+            throw ParsingError("Invalid number: " + std::string(text));
+        }
+    } else if (error != std::errc() || end != text.data() + text.size()) {
+        throw ParsingError("Invalid number: " + std::string(text));
+    }
+    return value;
+}
 
+// Собирает байт-код формулы из команд, поступающих
+// в порядке обратной польской записи
+class ProgramBuilder {
 public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
-        : type_(type)
-        , operand_(std::move(operand)) {
+    explicit ProgramBuilder(std::pmr::memory_resource& arena)
+        : program_(&arena)
+        , cells_(&arena) {
+    }
+
+    Program MoveProgram() {
+        assert(depth_ == 1);
+        return std::move(program_);
+    }
+
+    std::pmr::forward_list<Position> MoveCells() {
+        return std::move(cells_);
     }
 
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        operand_->Print(out);
-        out << ')';
+    void AddNumber(double value) {
+        program_.numbers.push_back(value);
+        Emit(OpCode::PushNumber, program_.numbers.size() - 1);
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
+    void AddCell(std::string_view text) {
+        const Position value = ParsePosition(text);
+
+        cells_.push_front(value);
+        program_.cells.push_back(value);
+        Emit(OpCode::LoadCell, program_.cells.size() - 1);
     }
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_UNARY;
+    // Аргумент функции: диапазон с углами first и last
+    // (для одной ячейки они совпадают)
+    void AddRange(std::string_view first, std::string_view last) {
+        program_.ranges.push_back(Range::FromCorners(ParsePosition(first), ParsePosition(last)));
     }
 
-    double Evaluate(const SheetInterface& sheet) const override {
-        return type_ == Type::UnaryPlus
-            ? operand_->Evaluate(sheet)
-            : operand_->Evaluate(sheet) * (-1.0);
+    // Вызов функции над range_count последними добавленными диапазонами
+    void AddFunction(Function function, size_t range_count) {
+        assert(range_count > 0 && range_count <= program_.ranges.size());
+        program_.calls.push_back({ function,
+            static_cast<std::uint32_t>(program_.ranges.size() - range_count),
+            static_cast<std::uint32_t>(range_count) });
+        Emit(OpCode::Aggregate, program_.calls.size() - 1);
+    }
+
+    void AddOperation(OpCode code) {
+        assert(depth_ >= (GetPrecedence(code) == EP_UNARY ? 1u : 2u));
+        Emit(code);
     }
 
 private:
-    Type type_;
-    std::unique_ptr<Expr> operand_;
+    static Position ParsePosition(std::string_view text) {
+        const Position value = Position::FromString(text);
+        if (!value.IsValid()) {
+            throw FormulaException("Invalid position: " + std::string(text));
+        }
+        return value;
+    }
+
+    void Emit(OpCode code, size_t operand = 0) {
+        program_.code.push_back({ code, static_cast<std::uint32_t>(operand) });
+
+        // Операнды увеличивают глубину стека, бинарные операции уменьшают
+        if (GetPrecedence(code) == EP_ATOM) {
+            program_.stack_size = std::max(program_.stack_size, ++depth_);
+        } else if (GetPrecedence(code) != EP_UNARY) {
+            --depth_;
+        }
+    }
+
+    Program program_;
+    size_t depth_ = 0;
+    std::pmr::forward_list<Position> cells_;
 };
 
-class CellExpr final : public Expr {
+// Строит байт-код по мере обхода дерева разбора ANTLR: обработчики выхода
+// из узлов вызываются в порядке обратной польской записи
+class ParseASTListener final : public FormulaBaseListener {
 public:
-    explicit CellExpr(const Position* cell)
-        : cell_(cell) {
+    explicit ParseASTListener(std::pmr::memory_resource& arena)
+        : builder_(arena) {
     }
 
-    void Print(std::ostream& out) const override {
-        if (!cell_->IsValid()) {
-            out << FormulaError::Category::Ref;
+    ProgramBuilder& GetBuilder() {
+        return builder_;
+    }
+
+public:
+    void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
+        if (ctx->SUB()) {
+            builder_.AddOperation(OpCode::UnaryMinus);
         } else {
-            out << cell_->ToString();
+            assert(ctx->ADD() != nullptr);
+            builder_.AddOperation(OpCode::UnaryPlus);
         }
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+    void exitLiteral(FormulaParser::LiteralContext* ctx) override {
+        builder_.AddNumber(ParseNumber(ctx->NUMBER()->getSymbol()->getText()));
     }
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_ATOM;
+    void exitCell(FormulaParser::CellContext* ctx) override {
+        builder_.AddCell(ctx->CELL()->getSymbol()->getText());
     }
 
-    double Evaluate(const SheetInterface& sheet) const override {
-        // Если позиция невалидна - выбрасываем исключение
-        if (!cell_->IsValid()) {
-            throw FormulaError(FormulaError::Category::Ref);
+    void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
+        OpCode code;
+        if (ctx->ADD()) {
+            code = OpCode::Add;
+        } else if (ctx->SUB()) {
+            code = OpCode::Subtract;
+        } else if (ctx->MUL()) {
+            code = OpCode::Multiply;
+        } else {
+            assert(ctx->DIV() != nullptr);
+            code = OpCode::Divide;
         }
 
-        const CellInterface* cell_ptr = sheet.GetCell(*cell_);
-
-        // Если индекс указывает на пустую ячейку - возвращаем 0.0
-        if (cell_ptr == nullptr
-            || cell_ptr->GetText().empty())
-        {
-            return 0.0;
-        }
+        builder_.AddOperation(code);
+    }
 
-        const auto value = cell_ptr->GetValue();
-        
-        // Если value содержит объект типа FormulaError - 
-        // выбрасываем исключение
-        if (std::holds_alternative<FormulaError>(value)) {
-            throw FormulaError(FormulaError::Category::Value);
-        }
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        const auto function = FindFunction(ctx->FUNCTION()->getSymbol()->getText());
+        assert(function.has_value());
 
-        // Если формула содержит тип double - возвращаем его
-        if (std::holds_alternative<double>(value)) {
-            return std::get<double>(value);
+        const auto ranges = ctx->range();
+        for (auto* range : ranges) {
+            const auto cells = range->CELL();
+            builder_.AddRange(cells.front()->getSymbol()->getText(),
+                              cells.back()->getSymbol()->getText());
         }
+        builder_.AddFunction(*function, ranges.size());
+    }
 
-        // В остальных случаях value содержит текст
-        // Пробуем преобразовать его к типу double
-        try {
-            size_t chars_processed = 0;
-            double result = std::stod(std::get<std::string>(value), &chars_processed);
-
-            // Если количество конвертированных символов не равно количеству 
-            // символов строки изначальной строки - выбрасываем исключение
-            if (chars_processed != std::get<std::string>(value).size()) {
-                throw FormulaError(FormulaError::Category::Value);
-            }
-
-            return result;
-        }
-        // Если неуспешно - выбрасываем исключение 
-        catch(...) {
-            throw FormulaError(FormulaError::Category::Value);
-        }
+    void visitErrorNode(antlr4::tree::ErrorNode* node) override {
+        throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
     }
 
 private:
-    const Position* cell_;
+    ProgramBuilder builder_;
+};
+
+enum class Token {
+    Number,
+    Cell,
+    Function,
+    Add,
+    Sub,
+    Mul,
+    Div,
+    LeftParen,
+    RightParen,
+    Colon,
+    Comma,
+    End,
 };
 
-class NumberExpr final : public Expr {
+// Лексический анализатор грамматики Formula.g4. Лексемы - представления
+// исходного текста, память не выделяется
+class Lexer {
 public:
-    explicit NumberExpr(double value)
-        : value_(value) {
+    explicit Lexer(std::string_view text)
+        : text_(text) {
+        Next();
     }
 
-    void Print(std::ostream& out) const override {
-        out << value_;
+    Token GetToken() const {
+        return token_;
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        out << value_;
+    std::string_view GetText() const {
+        return token_text_;
     }
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_ATOM;
+    // Смещение текущей лексемы от начала текста
+    size_t GetOffset() const {
+        return pos_ - token_text_.size();
     }
 
-    double Evaluate(const SheetInterface& /*sheet*/) const override {
-        return value_;
-    }
+    void Next() {
+        while (pos_ < text_.size()
+            && (text_[pos_] == ' ' || text_[pos_] == '\t'
+                || text_[pos_] == '\n' || text_[pos_] == '\r'))
+        {
+            ++pos_;
+        }
 
-private:
-    double value_;
-};
+        if (pos_ == text_.size()) {
+            token_ = Token::End;
+            token_text_ = text_.substr(pos_);
+            return;
+        }
 
-class ParseASTListener final : public FormulaBaseListener {
-public:
-    std::unique_ptr<Expr> MoveRoot() {
-        assert(args_.size() == 1);
-        auto root = std::move(args_.front());
-        args_.clear();
+        size_t length = 1;
+        switch (text_[pos_]) {
+            case '+':
+                token_ = Token::Add;
+                break;
+            case '-':
+                token_ = Token::Sub;
+                break;
+            case '*':
+                token_ = Token::Mul;
+                break;
+            case '/':
+                token_ = Token::Div;
+                break;
+            case '(':
+                token_ = Token::LeftParen;
+                break;
+            case ')':
+                token_ = Token::RightParen;
+                break;
+            case ':':
+                token_ = Token::Colon;
+                break;
+            case ',':
+                token_ = Token::Comma;
+                break;
+            default:
+                if (IsLetter(text_[pos_])) {
+                    size_t letters = 1;
+                    while (pos_ + letters < text_.size() && IsLetter(text_[pos_ + letters])) {
+                        ++letters;
+                    }
+                    // Буквы без цифр - имя функции, с цифрами - ссылка на ячейку
+                    const size_t digits = CountDigits(pos_ + letters);
+                    if (digits == 0 && FindFunction(text_.substr(pos_, letters))) {
+                        token_ = Token::Function;
+                    } else if (digits == 0) {
+                        throw ParsingError("Error when lexing: token recognition error at: '"
+                            + std::string(text_.substr(pos_, letters + 1)) + "'");
+                    } else {
+                        token_ = Token::Cell;
+                    }
+                    length = letters + digits;
+                } else if (length = MatchNumber(pos_); length > 0) {
+                    token_ = Token::Number;
+                } else {
+                    throw ParsingError("Error when lexing: token recognition error at: '"
+                        + std::string(1, text_[pos_]) + "'");
+                }
+        }
 
-        return root;
+        token_text_ = text_.substr(pos_, length);
+        pos_ += length;
     }
 
-    std::forward_list<Position> MoveCells() {
-        return std::move(cells_);
+private:
+    static bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
     }
 
-public:
-    void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
-        assert(args_.size() >= 1);
+    static bool IsLetter(char c) {
+        return c >= 'A' && c <= 'Z';
+    }
 
-        auto operand = std::move(args_.back());
+    // Длина последовательности цифр, начинающейся с pos
+    size_t CountDigits(size_t pos) const {
+        size_t end = pos;
+        while (end < text_.size() && IsDigit(text_[end])) {
+            ++end;
+        }
+        return end - pos;
+    }
 
-        UnaryOpExpr::Type type;
-        if (ctx->SUB()) {
-            type = UnaryOpExpr::UnaryMinus;
-        } else {
-            assert(ctx->ADD() != nullptr);
-            type = UnaryOpExpr::UnaryPlus;
+    // Длина литерала NUMBER, начинающегося с pos, или 0
+    size_t MatchNumber(size_t pos) const {
+        size_t end = pos + CountDigits(pos);
+        if (end < text_.size() && text_[end] == '.' && CountDigits(end + 1) > 0) {
+            end += 1 + CountDigits(end + 1);
+        } else if (end == pos) {
+            return 0;
+        }
+
+        if (end < text_.size() && (text_[end] == 'e' || text_[end] == 'E')) {
+            size_t exponent = end + 1;
+            if (exponent < text_.size() && (text_[exponent] == '+' || text_[exponent] == '-')) {
+                ++exponent;
+            }
+            if (const size_t digits = CountDigits(exponent); digits > 0) {
+                end = exponent + digits;
+            }
         }
 
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-        args_.back() = std::move(node);
+        return end - pos;
     }
 
-    void exitLiteral(FormulaParser::LiteralContext* ctx) override {
-        double value = 0;
-        auto valueStr = ctx->NUMBER()->getSymbol()->getText();
-        std::istringstream in(valueStr);
-        in >> value;
-        if (!in) {
-            throw ParsingError("Invalid number: " + valueStr);
-        }
+    std::string_view text_;
+    size_t pos_ = 0;
+    Token token_ = Token::End;
+    std::string_view token_text_;
+};
 
-        auto node = std::make_unique<NumberExpr>(value);
-        args_.push_back(std::move(node));
+// Разбор грамматики Formula.g4 рекурсивным спуском с приоритетами операций
+// (Пратт). Работает непосредственно с текстом формулы и не выделяет памяти,
+// кроме байт-кода и списка ячеек в арене формулы
+class NativeParser {
+public:
+    NativeParser(std::string_view text, std::pmr::memory_resource& arena)
+        : lexer_(text)
+        , builder_(arena) {
     }
 
-    void exitCell(FormulaParser::CellContext* ctx) override {
-        auto value_str = ctx->CELL()->getSymbol()->getText();
-        auto value = Position::FromString(value_str);
-        if (!value.IsValid()) {
-            throw FormulaException("Invalid position: " + value_str);
+    ProgramBuilder& Parse() {
+        ParseExpr(0);
+        if (lexer_.GetToken() != Token::End) {
+            ThrowUnexpectedToken();
         }
+        return builder_;
+    }
 
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
-        args_.push_back(std::move(node));
+private:
+    // Сила связывания: унарные операции связывают сильнее бинарных,
+    // умножение и деление - сильнее сложения и вычитания
+    static constexpr int ADDITIVE_POWER = 1;
+    static constexpr int MULTIPLICATIVE_POWER = 2;
+    static constexpr int UNARY_POWER = 3;
+
+    [[noreturn]] void ThrowUnexpectedToken() const {
+        throw ParsingError("Error when parsing: "
+            + (lexer_.GetToken() == Token::End ? "<EOF>"s : std::string(lexer_.GetText())));
     }
 
-    void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
-        assert(args_.size() >= 2);
+    // Разбирает выражение, операции которого связывают сильнее min_power
+    void ParseExpr(int min_power) {
+        ParsePrefix();
+
+        while (true) {
+            OpCode code;
+            int power = 0;
+            switch (lexer_.GetToken()) {
+                case Token::Add:
+                    code = OpCode::Add;
+                    power = ADDITIVE_POWER;
+                    break;
+                case Token::Sub:
+                    code = OpCode::Subtract;
+                    power = ADDITIVE_POWER;
+                    break;
+                case Token::Mul:
+                    code = OpCode::Multiply;
+                    power = MULTIPLICATIVE_POWER;
+                    break;
+                case Token::Div:
+                    code = OpCode::Divide;
+                    power = MULTIPLICATIVE_POWER;
+                    break;
+                default:
+                    return;
+            }
 
-        auto rhs = std::move(args_.back());
-        args_.pop_back();
+            // Бинарные операции левоассоциативны
+            if (power <= min_power) {
+                return;
+            }
 
-        auto lhs = std::move(args_.back());
+            lexer_.Next();
+            ParseExpr(power);
+            builder_.AddOperation(code);
+        }
+    }
 
-        BinaryOpExpr::Type type;
-        if (ctx->ADD()) {
-            type = BinaryOpExpr::Add;
-        } else if (ctx->SUB()) {
-            type = BinaryOpExpr::Subtract;
-        } else if (ctx->MUL()) {
-            type = BinaryOpExpr::Multiply;
-        } else {
-            assert(ctx->DIV() != nullptr);
-            type = BinaryOpExpr::Divide;
+    void ParsePrefix() {
+        switch (lexer_.GetToken()) {
+            case Token::Number:
+                builder_.AddNumber(ParseNumber(lexer_.GetText()));
+                lexer_.Next();
+                return;
+            case Token::Cell:
+                builder_.AddCell(lexer_.GetText());
+                lexer_.Next();
+                return;
+            case Token::Function:
+                ParseCall();
+                return;
+            case Token::Add:
+            case Token::Sub: {
+                const OpCode code = lexer_.GetToken() == Token::Add
+                    ? OpCode::UnaryPlus
+                    : OpCode::UnaryMinus;
+                lexer_.Next();
+                ParseExpr(UNARY_POWER);
+                builder_.AddOperation(code);
+                return;
+            }
+            case Token::LeftParen:
+                lexer_.Next();
+                ParseExpr(0);
+                if (lexer_.GetToken() != Token::RightParen) {
+                    ThrowUnexpectedToken();
+                }
+                lexer_.Next();
+                return;
+            default:
+                ThrowUnexpectedToken();
         }
+    }
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-        args_.back() = std::move(node);
+    // Вызов функции: FUNCTION '(' range (',' range)* ')'
+    void ParseCall() {
+        const Function function = *FindFunction(lexer_.GetText());
+        lexer_.Next();
+        Expect(Token::LeftParen);
+
+        size_t range_count = 0;
+        while (true) {
+            ParseRange();
+            ++range_count;
+            if (lexer_.GetToken() != Token::Comma) {
+                break;
+            }
+            lexer_.Next();
+        }
+
+        Expect(Token::RightParen);
+        builder_.AddFunction(function, range_count);
     }
 
-    void visitErrorNode(antlr4::tree::ErrorNode* node) override {
-        throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
+    // Аргумент функции: CELL (':' CELL)?
+    void ParseRange() {
+        if (lexer_.GetToken() != Token::Cell) {
+            ThrowUnexpectedToken();
+        }
+        const std::string_view first = lexer_.GetText();
+        std::string_view last = first;
+        lexer_.Next();
+
+        if (lexer_.GetToken() == Token::Colon) {
+            lexer_.Next();
+            if (lexer_.GetToken() != Token::Cell) {
+                ThrowUnexpectedToken();
+            }
+            last = lexer_.GetText();
+            lexer_.Next();
+        }
+
+        builder_.AddRange(first, last);
     }
 
-private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    // Пропускает лексему token или сообщает об ошибке, если текущая лексема другая
+    void Expect(Token token) {
+        if (lexer_.GetToken() != token) {
+            ThrowUnexpectedToken();
+        }
+        lexer_.Next();
+    }
+
+    Lexer lexer_;
+    ProgramBuilder builder_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -419,9 +1046,14 @@ public:
 }  // namespace
 }  // namespace ASTImpl
 
-FormulaAST ParseFormulaAST(std::istream& in) {
+namespace {
+
+FormulaAST ParseWithAntlr(std::istream& in, std::pmr::memory_resource* resource) {
     using namespace antlr4;
 
+    auto arena = MakePooled<std::pmr::monotonic_buffer_resource>(
+        resource, ASTImpl::AST_ARENA_INITIAL_SIZE, resource);
+
     ANTLRInputStream input(in);
 
     FormulaLexer lexer(&input);
@@ -437,39 +1069,383 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     parser.removeErrorListeners();
 
     tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
+    ASTImpl::ParseASTListener listener(*arena);
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    auto program = listener.GetBuilder().MoveProgram();
+    auto cells = listener.GetBuilder().MoveCells();
+    return FormulaAST(std::move(arena), std::move(program), std::move(cells));
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+FormulaAST ParseNative(std::string_view text, std::pmr::memory_resource* resource) {
+    auto arena = MakePooled<std::pmr::monotonic_buffer_resource>(
+        resource, ASTImpl::AST_ARENA_INITIAL_SIZE, resource);
+
+    ASTImpl::NativeParser parser(text, *arena);
+    ASTImpl::ProgramBuilder& builder = parser.Parse();
+    auto program = builder.MoveProgram();
+    auto cells = builder.MoveCells();
+    return FormulaAST(std::move(arena), std::move(program), std::move(cells));
+}
+
+}  // namespace
+
+FormulaAST ParseFormulaAST(std::istream& in, std::pmr::memory_resource* resource,
+                           FormulaParserKind parser) {
+    if (parser == FormulaParserKind::Antlr) {
+        return ParseWithAntlr(in, resource);
+    }
+
+    const std::string text(std::istreambuf_iterator<char>(in), {});
+    return ParseNative(text, resource);
+}
+
+FormulaAST ParseFormulaAST(const std::string& in_str, std::pmr::memory_resource* resource,
+                           FormulaParserKind parser) {
+    if (parser == FormulaParserKind::Antlr) {
+        std::istringstream in(in_str);
+        return ParseWithAntlr(in, resource);
+    }
+
+    return ParseNative(in_str, resource);
 }
 
-void FormulaAST::PrintCells(std::ostream& out) const {
+void FormulaAST::PrintCells(std::ostream& out, Position anchor) const {
     for (auto cell : cells_) {
-        out << cell.ToString() << ' ';
+        out << ASTImpl::Shift(cell, anchor).ToString() << ' ';
     }
 }
 
-void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+/**
+ * Печатает формулу в префиксной записи со скобками вокруг каждой операции
+*/
+void FormulaAST::Print(std::ostream& out, Position anchor) const {
+    using namespace ASTImpl;
+
+    std::vector<std::string> stack;
+    for (const Instruction& instr : program_.code) {
+        switch (instr.code) {
+            case OpCode::PushNumber:
+                stack.push_back(PrintNumber(program_.numbers[instr.operand]));
+                break;
+            case OpCode::LoadCell:
+            case OpCode::ReloadCell:
+                stack.push_back(PrintCell(Shift(program_.cells[instr.operand], anchor)));
+                break;
+            case OpCode::Aggregate:
+                stack.push_back(PrintCall(program_, program_.calls[instr.operand], anchor));
+                break;
+            case OpCode::UnaryPlus:
+            case OpCode::UnaryMinus:
+                stack.back() = "("s + GetOperationSign(instr.code) + ' ' + stack.back() + ')';
+                break;
+            default: {
+                std::string rhs = std::move(stack.back());
+                stack.pop_back();
+                stack.back() = "("s + GetOperationSign(instr.code) + ' ' + stack.back()
+                    + ' ' + rhs + ')';
+            }
+        }
+    }
+
+    out << stack.back();
+}
+
+/**
+ * Печатает формулу в инфиксной записи без лишних скобок
+*/
+void FormulaAST::PrintFormula(std::ostream& out, Position anchor) const {
+    using namespace ASTImpl;
+
+    // Текст подвыражения и приоритет его корневой операции
+    struct Operand {
+        std::string text;
+        ExprPrecedence precedence;
+    };
+
+    // Текст операнда, при необходимости заключенный в скобки
+    const auto wrap = [](Operand& child, ExprPrecedence parent_precedence, bool right_child) {
+        auto mask = right_child ? PR_RIGHT : PR_LEFT;
+        if (PRECEDENCE_RULES[parent_precedence][child.precedence] & mask) {
+            return '(' + std::move(child.text) + ')';
+        }
+        return std::move(child.text);
+    };
+
+    std::vector<Operand> stack;
+    for (const Instruction& instr : program_.code) {
+        const ExprPrecedence precedence = GetPrecedence(instr.code);
+        switch (instr.code) {
+            case OpCode::PushNumber:
+                stack.push_back({ PrintNumber(program_.numbers[instr.operand]), precedence });
+                break;
+            case OpCode::LoadCell:
+            case OpCode::ReloadCell:
+                stack.push_back({ PrintCell(Shift(program_.cells[instr.operand], anchor)),
+                                  precedence });
+                break;
+            case OpCode::Aggregate:
+                stack.push_back({ PrintCall(program_, program_.calls[instr.operand], anchor),
+                                  precedence });
+                break;
+            case OpCode::UnaryPlus:
+            case OpCode::UnaryMinus:
+                stack.back().text = GetOperationSign(instr.code)
+                    + wrap(stack.back(), precedence, false);
+                stack.back().precedence = precedence;
+                break;
+            default: {
+                Operand rhs = std::move(stack.back());
+                stack.pop_back();
+                Operand& lhs = stack.back();
+                lhs.text = wrap(lhs, precedence, false) + GetOperationSign(instr.code)
+                    + wrap(rhs, precedence, true);
+                lhs.precedence = precedence;
+            }
+        }
+    }
+
+    out << stack.back().text;
+}
+
+/**
+ * Вычисляет формулу, выполняя оптимизированный байт-код на стековой машине.
+ * Ошибки передаются по стеку как значения, исключения не используются
+*/
+std::variant<double, FormulaError> FormulaAST::Execute(const SheetInterface& sheet,
+                                                       Position anchor) const {
+    using namespace ASTImpl;
+
+    const Program& program = executable_;
+
+    // Стек и загруженные значения ячеек; для типичных формул они умещаются
+    // в буфер в автоматической памяти
+    double inline_buffer[INLINE_STACK_SIZE];
+    std::vector<double> heap_buffer;
+    double* stack = inline_buffer;
+    if (program.stack_size + program.cells.size() > INLINE_STACK_SIZE) {
+        heap_buffer.resize(program.stack_size + program.cells.size());
+        stack = heap_buffer.data();
+    }
+    double* const loaded = stack + program.stack_size;
+
+    // top указывает на ячейку за вершиной стека
+    double* top = stack;
+    for (const Instruction& instr : program.code) {
+        switch (instr.code) {
+            case OpCode::PushNumber:
+                *top++ = program.numbers[instr.operand];
+                break;
+            case OpCode::LoadCell:
+                *top++ = loaded[instr.operand] =
+                    LoadCell(sheet, Shift(program.cells[instr.operand], anchor));
+                break;
+            case OpCode::ReloadCell:
+                *top++ = loaded[instr.operand];
+                break;
+            case OpCode::Add:
+                --top;
+                top[-1] = CheckResult(top[-1], top[0], top[-1] + top[0]);
+                break;
+            case OpCode::Subtract:
+                --top;
+                top[-1] = CheckResult(top[-1], top[0], top[-1] - top[0]);
+                break;
+            case OpCode::Multiply:
+                --top;
+                top[-1] = CheckResult(top[-1], top[0], top[-1] * top[0]);
+                break;
+            case OpCode::Divide:
+                --top;
+                top[-1] = Divide(top[-1], top[0]);
+                break;
+            case OpCode::UnaryPlus:
+                break;
+            case OpCode::UnaryMinus:
+                top[-1] = -top[-1];
+                break;
+            case OpCode::Aggregate:
+                *top++ = Aggregate(sheet, program, program.calls[instr.operand], anchor);
+                break;
+        }
+    }
+
+    assert(top == stack + 1);
+    if (IsError(stack[0])) {
+        return FormulaError(GetErrorCategory(stack[0]));
+    }
+    return stack[0];
+}
+
+/**
+ * Вычисляет формулу для строк столбца, выполняя каждую команду сразу над
+ * массивами значений всех строк. Строки, в которых возникает ошибка или
+ * значение операнда не является числом, помечаются для поячеечного вычисления
+*/
+void FormulaAST::ExecuteRows(const SheetInterface& sheet, Position anchor, size_t count,
+                             double* results, bool* computed) const {
+    using namespace ASTImpl;
+
+    const Program& program = executable_;
+
+    // Аргументы функций - диапазоны, разные для каждой строки
+    std::fill(computed, computed + count, program.calls.empty());
+    if (!program.calls.empty() || count == 0) {
+        return;
+    }
+
+    // Значения ячеек-операндов, по столбцу массива на каждую ячейку
+    std::vector<double> loaded(program.cells.size() * count, 0.0);
+    for (size_t slot = 0; slot < program.cells.size(); ++slot) {
+        const Position first = Shift(program.cells[slot], anchor);
+
+        // Строки, ссылка которых выходит за пределы таблицы, дают #REF!
+        const long long begin = std::clamp<long long>(-first.row, 0, count);
+        const long long end = std::clamp<long long>(Position::MAX_ROWS - first.row, begin, count);
+        if (first.col < 0 || first.col >= Position::MAX_COLS) {
+            std::fill(computed, computed + count, false);
+            return;
+        }
+        std::fill(computed, computed + begin, false);
+        std::fill(computed + end, computed + count, false);
+
+        if (begin < end) {
+            sheet.GetColumnValues({ first.row + static_cast<int>(begin), first.col },
+                                  static_cast<size_t>(end - begin),
+                                  &loaded[slot * count + begin], computed + begin);
+        }
+    }
+
+    // Стек массивов: top указывает на массив за вершиной стека
+    std::vector<double> stack(program.stack_size * count);
+    double* top = stack.data();
+
+    // Бесконечность означает деление на ноль или переполнение
+    const auto check = [computed, count](const double* values) {
+        for (size_t i = 0; i < count; ++i) {
+            computed[i] &= std::abs(values[i]) != std::numeric_limits<double>::infinity();
+        }
+    };
+
+    // Бинарная операция: op(lhs, rhs) записывает результат на место lhs
+    const auto binary = [&top, count, &check](auto op) {
+        top -= count;
+        double* const lhs = top - count;
+        for (size_t i = 0; i < count; ++i) {
+            lhs[i] = op(lhs[i], top[i]);
+        }
+        check(lhs);
+    };
+
+    for (const Instruction& instr : program.code) {
+        switch (instr.code) {
+            case OpCode::PushNumber:
+                std::fill(top, top + count, program.numbers[instr.operand]);
+                top += count;
+                break;
+            case OpCode::LoadCell:
+            case OpCode::ReloadCell: {
+                const double* column = &loaded[instr.operand * count];
+                std::copy(column, column + count, top);
+                top += count;
+                break;
+            }
+            case OpCode::Add:
+                binary([](double lhs, double rhs) { return lhs + rhs; });
+                break;
+            case OpCode::Subtract:
+                binary([](double lhs, double rhs) { return lhs - rhs; });
+                break;
+            case OpCode::Multiply:
+                binary([](double lhs, double rhs) { return lhs * rhs; });
+                break;
+            case OpCode::Divide:
+                for (size_t i = 0; i < count; ++i) {
+                    computed[i] &= (top - count)[i] != 0.0;
+                }
+                binary([](double lhs, double rhs) { return lhs / rhs; });
+                break;
+            case OpCode::UnaryPlus:
+                break;
+            case OpCode::UnaryMinus:
+                for (double* value = top - count; value != top; ++value) {
+                    *value = -*value;
+                }
+                break;
+            case OpCode::Aggregate:
+                assert(false);
+                break;
+        }
+    }
+
+    assert(top == stack.data() + count);
+    std::copy(stack.data(), top, results);
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+/**
+ * Переводит ссылки формулы в смещения относительно anchor
+*/
+void FormulaAST::MakeRelative(Position anchor) {
+    const Position inverse = { -anchor.row, -anchor.col };
+    for (Position& cell : program_.cells) {
+        cell = ASTImpl::Shift(cell, inverse);
+    }
+    for (Position& cell : executable_.cells) {
+        cell = ASTImpl::Shift(cell, inverse);
+    }
+    for (Position& cell : cells_) {
+        cell = ASTImpl::Shift(cell, inverse);
+    }
+    for (ASTImpl::Program* program : { &program_, &executable_ }) {
+        for (Range& range : program->ranges) {
+            range = { ASTImpl::Shift(range.first, inverse), ASTImpl::Shift(range.last, inverse) };
+        }
+    }
 }
 
-double FormulaAST::Execute(const SheetInterface& sheet) const {
-    return root_expr_->Evaluate(sheet);
+/**
+ * Возвращает текст формулы, в котором ссылки на ячейки записаны смещениями
+ * относительно anchor в виде R[строки]C[столбцы]. Такой текст одинаков у всех
+ * формул диапазона, заполненного копированием одной формулы.
+ * Возвращает пустую строку, если текст не разбирается на лексемы
+*/
+std::string MakeRelativeExpression(std::string_view expression, Position anchor) {
+    using namespace ASTImpl;
+
+    std::string result;
+    result.reserve(expression.size() + 8);
+    size_t copied = 0;
+    try {
+        for (Lexer lexer(expression); lexer.GetToken() != Token::End; lexer.Next()) {
+            if (lexer.GetToken() != Token::Cell) {
+                continue;
+            }
+
+            const Position cell = Position::FromString(lexer.GetText());
+            if (!cell.IsValid()) {
+                return {};
+            }
+
+            result.append(expression, copied, lexer.GetOffset() - copied);
+            result += "R[" + std::to_string(cell.row - anchor.row)
+                + "]C[" + std::to_string(cell.col - anchor.col) + ']';
+            copied = lexer.GetOffset() + lexer.GetText().size();
+        }
+    } catch (const ParsingError&) {
+        return {};
+    }
+    result.append(expression, copied);
+
+    return result;
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
+FormulaAST::FormulaAST(PoolPtr<std::pmr::monotonic_buffer_resource> arena,
+                       ASTImpl::Program program, std::pmr::forward_list<Position> cells)
+    : arena_(std::move(arena))
+    , program_(std::move(program))
+    , executable_(ASTImpl::Optimizer(program_).Run(arena_.get()))
     , cells_(std::move(cells)) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
 }
 
-FormulaAST::~FormulaAST() = default;
\ No newline at end of file
+FormulaAST::~FormulaAST() = default;
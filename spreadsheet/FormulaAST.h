@@ -1,48 +1,155 @@
 #pragma once
 
 #include "FormulaLexer.h"
+#include "arena.h"
 #include "common.h"
 
+#include <cstdint>
 #include <forward_list>
 #include <functional>
+#include <memory_resource>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
 
 namespace ASTImpl {
-class Expr;
-}
+
+// Команды стековой машины. Формула хранится в обратной польской записи:
+// операнды помещаются на стек, операции снимают их и кладут результат
+enum class OpCode : std::uint8_t {
+    PushNumber,  // operand - индекс в Program::numbers
+    LoadCell,    // operand - индекс в Program::cells; значение запоминается
+    ReloadCell,  // значение ячейки operand, уже загруженное командой LoadCell
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    UnaryPlus,
+    UnaryMinus,
+    Aggregate,   // operand - индекс в Program::calls
+};
+
+// Агрегатные функции над диапазонами
+enum class Function : std::uint8_t {
+    Sum,
+    Average,
+    Min,
+    Max,
+    Count,
+};
+
+// Вызов агрегатной функции над аргументами
+// Program::ranges[first_range, first_range + range_count)
+struct FunctionCall {
+    Function function;
+    std::uint32_t first_range = 0;
+    std::uint32_t range_count = 0;
+};
+
+struct Instruction {
+    OpCode code;
+    std::uint32_t operand = 0;
+};
+
+// Скомпилированная формула: непрерывный поток команд и таблицы операндов
+struct Program {
+    explicit Program(std::pmr::memory_resource* resource)
+        : code(resource)
+        , numbers(resource)
+        , cells(resource)
+        , ranges(resource)
+        , calls(resource) {
+    }
+
+    std::pmr::vector<Instruction> code;
+    std::pmr::vector<double> numbers;
+    std::pmr::vector<Position> cells;
+    std::pmr::vector<Range> ranges;
+    std::pmr::vector<FunctionCall> calls;
+    size_t stack_size = 0; // Наибольшая глубина стека при выполнении
+};
+
+}  // namespace ASTImpl
 
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
+// Формула компилируется при разборе в байт-код, который выполняется
+// стековой машиной и по которому восстанавливается текст формулы.
+// Байт-код и список ячеек размещаются в арене, принадлежащей FormulaAST,
+// и освобождаются вместе с ней одним вызовом
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
+    explicit FormulaAST(PoolPtr<std::pmr::monotonic_buffer_resource> arena,
+                        ASTImpl::Program program,
+                        std::pmr::forward_list<Position> cells);
     FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+    // Перемещающее присваивание между разными аренами копировало бы узлы
+    FormulaAST& operator=(FormulaAST&&) = delete;
     ~FormulaAST();
 
-    double Execute(const SheetInterface& sheet) const;
-    void PrintCells(std::ostream& out) const;
-    void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    // Ссылки на ячейки хранятся смещениями относительно позиции anchor,
+    // если формула переведена в относительный вид вызовом MakeRelative,
+    // иначе - абсолютными позициями, и тогда anchor равен (0, 0)
+    std::variant<double, FormulaError> Execute(const SheetInterface& sheet,
+                                               Position anchor = { 0, 0 }) const;
+    // Вычисляет формулу для count ячеек столбца: строка i - относительно
+    // { anchor.row + i, anchor.col }. Команды выполняются над массивами
+    // значений всех строк сразу. Если строку так вычислить нельзя (ошибка,
+    // текст в ячейке, вызов функции), computed[i] сбрасывается, и ее нужно
+    // вычислить отдельно методом Execute; иначе результат - в results[i]
+    void ExecuteRows(const SheetInterface& sheet, Position anchor, size_t count,
+                     double* results, bool* computed) const;
+    void PrintCells(std::ostream& out, Position anchor = { 0, 0 }) const;
+    void Print(std::ostream& out, Position anchor = { 0, 0 }) const;
+    void PrintFormula(std::ostream& out, Position anchor = { 0, 0 }) const;
 
-    std::forward_list<Position>& GetCells() {
+    void MakeRelative(Position anchor);
+
+    std::pmr::forward_list<Position>& GetCells() {
         return cells_;
     }
-    const std::forward_list<Position>& GetCells() const {
+    const std::pmr::forward_list<Position>& GetCells() const {
         return cells_;
     }
 
+    // Аргументы агрегатных функций в порядке записи, включая повторы
+    const std::pmr::vector<Range>& GetRanges() const {
+        return program_.ranges;
+    }
+
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    // owns the memory of the program and of the cells list;
+    // declared first so that it is released last
+    PoolPtr<std::pmr::monotonic_buffer_resource> arena_;
+
+    // program_ повторяет формулу в записи пользователя и служит для печати,
+    // executable_ - результат ее оптимизации, который и выполняется
+    ASTImpl::Program program_;
+    ASTImpl::Program executable_;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
-    std::forward_list<Position> cells_;
+    std::pmr::forward_list<Position> cells_;
+};
+
+std::string MakeRelativeExpression(std::string_view expression, Position anchor);
+
+// Способ разбора формулы. Разбор средствами ANTLR по Formula.g4 сохранен
+// для перекрестной проверки собственного парсера той же грамматики
+enum class FormulaParserKind {
+    Native,
+    Antlr,
 };
 
-FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
\ No newline at end of file
+// Арена разбора берет блоки памяти у resource
+FormulaAST ParseFormulaAST(std::istream& in,
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource(),
+    FormulaParserKind parser = FormulaParserKind::Native);
+FormulaAST ParseFormulaAST(const std::string& in_str,
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource(),
+    FormulaParserKind parser = FormulaParserKind::Native);
\ No newline at end of file
@@ -0,0 +1,120 @@
+#include "aggregate_kernels.h"
+
+#include <algorithm>
+#include <cassert>
+
+#if defined(__AVX__)
+#define AGGREGATE_KERNELS_AVX
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define AGGREGATE_KERNELS_SSE2
+#include <emmintrin.h>
+#endif
+
+/**
+ * Возвращает сумму чисел массива
+*/
+double SumValues(const double* values, size_t count) {
+    size_t i = 0;
+    double result = 0.0;
+
+#if defined(AGGREGATE_KERNELS_AVX)
+    // Два независимых аккумулятора скрывают задержку сложения
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    for (; i + 8 <= count; i += 8) {
+        sum0 = _mm256_add_pd(sum0, _mm256_loadu_pd(values + i));
+        sum1 = _mm256_add_pd(sum1, _mm256_loadu_pd(values + i + 4));
+    }
+    alignas(32) double lanes[4];
+    _mm256_store_pd(lanes, _mm256_add_pd(sum0, sum1));
+    result = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#elif defined(AGGREGATE_KERNELS_SSE2)
+    __m128d sum0 = _mm_setzero_pd();
+    __m128d sum1 = _mm_setzero_pd();
+    for (; i + 4 <= count; i += 4) {
+        sum0 = _mm_add_pd(sum0, _mm_loadu_pd(values + i));
+        sum1 = _mm_add_pd(sum1, _mm_loadu_pd(values + i + 2));
+    }
+    alignas(16) double lanes[2];
+    _mm_store_pd(lanes, _mm_add_pd(sum0, sum1));
+    result = lanes[0] + lanes[1];
+#endif
+
+    for (; i < count; ++i) {
+        result += values[i];
+    }
+    return result;
+}
+
+/**
+ * Возвращает наименьшее число непустого массива
+*/
+double MinValue(const double* values, size_t count) {
+    assert(count > 0);
+    size_t i = 0;
+    double result = values[0];
+
+#if defined(AGGREGATE_KERNELS_AVX)
+    if (count >= 4) {
+        __m256d min = _mm256_loadu_pd(values);
+        for (i = 4; i + 4 <= count; i += 4) {
+            min = _mm256_min_pd(min, _mm256_loadu_pd(values + i));
+        }
+        alignas(32) double lanes[4];
+        _mm256_store_pd(lanes, min);
+        result = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+    }
+#elif defined(AGGREGATE_KERNELS_SSE2)
+    if (count >= 2) {
+        __m128d min = _mm_loadu_pd(values);
+        for (i = 2; i + 2 <= count; i += 2) {
+            min = _mm_min_pd(min, _mm_loadu_pd(values + i));
+        }
+        alignas(16) double lanes[2];
+        _mm_store_pd(lanes, min);
+        result = std::min(lanes[0], lanes[1]);
+    }
+#endif
+
+    for (; i < count; ++i) {
+        result = std::min(result, values[i]);
+    }
+    return result;
+}
+
+/**
+ * Возвращает наибольшее число непустого массива
+*/
+double MaxValue(const double* values, size_t count) {
+    assert(count > 0);
+    size_t i = 0;
+    double result = values[0];
+
+#if defined(AGGREGATE_KERNELS_AVX)
+    if (count >= 4) {
+        __m256d max = _mm256_loadu_pd(values);
+        for (i = 4; i + 4 <= count; i += 4) {
+            max = _mm256_max_pd(max, _mm256_loadu_pd(values + i));
+        }
+        alignas(32) double lanes[4];
+        _mm256_store_pd(lanes, max);
+        result = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+    }
+#elif defined(AGGREGATE_KERNELS_SSE2)
+    if (count >= 2) {
+        __m128d max = _mm_loadu_pd(values);
+        for (i = 2; i + 2 <= count; i += 2) {
+            max = _mm_max_pd(max, _mm_loadu_pd(values + i));
+        }
+        alignas(16) double lanes[2];
+        _mm_store_pd(lanes, max);
+        result = std::max(lanes[0], lanes[1]);
+    }
+#endif
+
+    for (; i < count; ++i) {
+        result = std::max(result, values[i]);
+    }
+    return result;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstddef>
+
+// Векторные ядра агрегатных функций над непрерывными массивами чисел.
+// Используют AVX или SSE2, если компилятор их поддерживает для целевой
+// платформы, иначе - скалярный цикл. Порядок суммирования отличается
+// от последовательного, поэтому сумма может отличаться в последних разрядах.
+
+// Сумма count чисел
+double SumValues(const double* values, size_t count);
+
+// Наименьшее и наибольшее из count > 0 чисел
+double MinValue(const double* values, size_t count);
+double MaxValue(const double* values, size_t count);
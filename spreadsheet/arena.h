@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <type_traits>
+#include <utility>
+
+// Статистика обращений к вышестоящему распределителю памяти
+struct AllocationStats {
+    size_t allocations = 0; // Количество выделений
+    size_t deallocations = 0; // Количество освобождений
+    size_t bytes_in_use = 0; // Объем занятой памяти в байтах
+};
+
+// Ресурс памяти, подсчитывающий выделения и передающий их вышестоящему ресурсу.
+// Используется как источник блоков для пулов таблицы: по его статистике видно,
+// сколько раз таблица действительно обращалась к системному распределителю.
+class CountingResource : public std::pmr::memory_resource {
+public:
+    explicit CountingResource(
+        std::pmr::memory_resource* upstream = std::pmr::new_delete_resource())
+        : upstream_(upstream)
+    {}
+
+    const AllocationStats& GetStats() const {
+        return stats_;
+    }
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        void* ptr = upstream_->allocate(bytes, alignment);
+        ++stats_.allocations;
+        stats_.bytes_in_use += bytes;
+        return ptr;
+    }
+    void do_deallocate(void* ptr, size_t bytes, size_t alignment) override {
+        upstream_->deallocate(ptr, bytes, alignment);
+        ++stats_.deallocations;
+        stats_.bytes_in_use -= bytes;
+    }
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    std::pmr::memory_resource* upstream_;
+    AllocationStats stats_;
+};
+
+// Удалитель объектов, размещенных в ресурсе памяти функцией MakePooled.
+// Хранит размер и выравнивание исходного объекта, поэтому указатель на
+// производный класс можно передавать во владение указателю на базовый.
+template <typename T>
+class PoolDeleter {
+public:
+    PoolDeleter() = default;
+    PoolDeleter(std::pmr::memory_resource* resource, size_t size, size_t alignment)
+        : resource_(resource)
+        , size_(size)
+        , alignment_(alignment)
+    {}
+
+    template <typename U, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+    PoolDeleter(const PoolDeleter<U>& other)
+        : resource_(other.GetResource())
+        , size_(other.GetSize())
+        , alignment_(other.GetAlignment())
+    {}
+
+    void operator()(T* ptr) const {
+        // Для полиморфных типов освобождаем адрес полного объекта
+        void* raw = nullptr;
+        if constexpr (std::is_polymorphic_v<T>) {
+            raw = dynamic_cast<void*>(ptr);
+        }
+        else {
+            raw = ptr;
+        }
+
+        ptr->~T();
+        resource_->deallocate(raw, size_, alignment_);
+    }
+
+    std::pmr::memory_resource* GetResource() const { return resource_; }
+    size_t GetSize() const { return size_; }
+    size_t GetAlignment() const { return alignment_; }
+
+private:
+    std::pmr::memory_resource* resource_ = nullptr;
+    size_t size_ = 0;
+    size_t alignment_ = 0;
+};
+
+template <typename T>
+using PoolPtr = std::unique_ptr<T, PoolDeleter<T>>;
+
+// Создает объект типа T в ресурсе памяти resource
+template <typename T, typename... Args>
+PoolPtr<T> MakePooled(std::pmr::memory_resource* resource, Args&&... args) {
+    void* raw = resource->allocate(sizeof(T), alignof(T));
+    try {
+        T* ptr = new (raw) T(std::forward<Args>(args)...);
+        return PoolPtr<T>(ptr, PoolDeleter<T>(resource, sizeof(T), alignof(T)));
+    }
+    catch (...) {
+        resource->deallocate(raw, sizeof(T), alignof(T));
+        throw;
+    }
+}
@@ -1,9 +1,12 @@
 #include "cell.h"
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <string>
 #include <optional>
+#include <thread>
+#include <type_traits>
 
 class Cell::Impl {
 public:
@@ -14,7 +17,14 @@ public:
 
     virtual ~Impl() = default;
 
+    // Ячейки, на которые формула ссылается по отдельности, и диапазоны
     virtual std::vector<Position> GetReferencedCells() const = 0;
+    virtual std::vector<Range> GetReferencedRanges() const { return {}; }
+
+    // Значение ячейки как операнда формулы, если оно известно без вычисления
+    virtual std::optional<NumericValue> GetNumericValue() const { return std::nullopt; }
+    // Значение ячейки без копирования, если оно известно без вычисления
+    virtual std::optional<ValueView> GetValueView() const { return std::nullopt; }
 };
 /**
  * Пустая ячейка
@@ -31,19 +41,77 @@ public:
     bool IsEmpty() const override { return true; }
 
     std::vector<Position> GetReferencedCells() const override { return {}; }
+
+    std::optional<NumericValue> GetNumericValue() const override { return 0.0; }
+    std::optional<ValueView> GetValueView() const override { return std::string_view(); }
 };
 /**
  * Текстовая ячейка
+ * Значение (текст без экранирующего символа) хранится в пуле строк таблицы.
+ * Является ли значение числом, определяется один раз при создании
 */
 class Cell::TextImpl : public Cell::Impl {
 public:
-    explicit TextImpl(std::string text, int pos = 0)
+    TextImpl(std::string_view text, bool escaped, StringPool& pool)
+        : pool_(pool)
+        , value_id_(pool.Intern(escaped ? text.substr(1) : text))
+        , number_(ParseCellText(pool.Get(value_id_)))
+        , escaped_(escaped)
+    {}
+    ~TextImpl() {
+        pool_.Release(value_id_);
+    }
+
+    Value GetValue(SheetInterface& /*sheet*/) const override {
+        return std::string(pool_.Get(value_id_));
+    }
+    std::string GetText() const override {
+        std::string text;
+        if (escaped_) {
+            text += ESCAPE_SIGN;
+        }
+        text += pool_.Get(value_id_);
+
+        return text;
+    }
+
+    bool IsEmpty() const override { return false; }
+
+    std::vector<Position> GetReferencedCells() const override { return {}; }
+
+    std::optional<NumericValue> GetNumericValue() const override {
+        if (number_) {
+            return *number_;
+        }
+        return FormulaError(FormulaError::Category::Value);
+    }
+    std::optional<ValueView> GetValueView() const override {
+        return pool_.Get(value_id_);
+    }
+
+    StringPool::Id GetValueId() const { return value_id_; }
+    bool IsNumeric() const { return number_.has_value(); }
+
+private:
+    StringPool& pool_; // Пул строк таблицы
+    StringPool::Id value_id_; // Идентификатор значения ячейки в пуле
+    std::optional<double> number_; // Число, которым является значение
+    bool escaped_ = false; // Начинается ли текст ячейки с экранирующего символа
+};
+/**
+ * Число колоночного хранилища, выданное через GetCell(), или число,
+ * записанное в позицию с уже созданным объектом ячейки. Значение - текст
+ * числа, как у текстовой ячейки с тем же содержимым
+*/
+class Cell::NumberImpl : public Cell::Impl {
+public:
+    NumberImpl(double number, std::string text)
         : text_(std::move(text))
-        , value_pos_(pos)
+        , number_(number)
     {}
 
     Value GetValue(SheetInterface& /*sheet*/) const override {
-        return text_.substr(value_pos_);
+        return text_;
     }
     std::string GetText() const override {
         return text_;
@@ -53,21 +121,25 @@ public:
 
     std::vector<Position> GetReferencedCells() const override { return {}; }
 
+    std::optional<NumericValue> GetNumericValue() const override { return number_; }
+    std::optional<ValueView> GetValueView() const override { return std::string_view(text_); }
+
 private:
-    std::string text_; // Тест ячейки
-    int value_pos_ = 0; // Позиция начала значения ячейки
+    std::string text_; // Текст числа
+    double number_;
 };
 /**
  * Формульная ячейка
 */
 class Cell::FormulaImpl : public Cell::Impl {
 public:
-    explicit FormulaImpl(std::string text)
-        : formula_ptr_(ParseFormula(std::move(text)))
+    explicit FormulaImpl(FormulaCache::AnchoredFormula formula)
+        : formula_ptr_(std::move(formula.formula))
+        , anchor_(formula.anchor)
     {}
 
     Value GetValue(SheetInterface& sheet) const override {
-        const FormulaInterface::Value& value = formula_ptr_->Evaluate(sheet);
+        const FormulaInterface::Value& value = formula_ptr_->Evaluate(sheet, anchor_);
 
         // Если значение содержит тип double - возвращаем его
         if (std::holds_alternative<double>(value)) {
@@ -78,21 +150,33 @@ public:
         return std::get<FormulaError>(value);
     }
     std::string GetText() const override {
-        return FORMULA_SIGN + formula_ptr_->GetExpression();
+        return FORMULA_SIGN + formula_ptr_->GetExpression(anchor_);
     }
 
     bool IsEmpty() const override { return false; }
 
+    const RelativeFormulaInterface& GetFormula() const { return *formula_ptr_; }
+    Position GetAnchor() const { return anchor_; }
+
     std::vector<Position> GetReferencedCells() const override { 
-        return formula_ptr_->GetReferencedCells(); 
+        return formula_ptr_->GetReferencedCells(anchor_);
+    }
+    std::vector<Range> GetReferencedRanges() const override {
+        return formula_ptr_->GetReferencedRanges(anchor_);
     }
 
 private:
-    // Указатель на объект FormulaInterface
-    std::unique_ptr<FormulaInterface> formula_ptr_;
+    // Указатель на формулу в относительном виде, общий для одинаковых
+    // и скопированных формул таблицы
+    FormulaCache::FormulaPtr formula_ptr_;
+    Position anchor_; // Позиция, относительно которой вычисляется формула
 };
 
-Cell::Cell(Sheet& sheet) : impl_(new EmptyImpl), sheet_(sheet) {}
+Cell::Cell(Sheet& sheet, Position pos)
+    : sheet_(sheet)
+    , pos_(pos)
+    , impl_(MakePooled<EmptyImpl>(sheet.GetMemoryResource()))
+{}
 Cell::~Cell() {}
 
 void Cell::Set(std::string text) {
@@ -101,20 +185,24 @@ void Cell::Set(std::string text) {
         return;
     }
 
+    std::pmr::memory_resource* resource = sheet_.GetMemoryResource();
+
     // Если строка пустая - создаем пустую ячейку
     if (text.empty()) {
-        impl_ = std::make_unique<EmptyImpl>();
+        impl_ = MakePooled<EmptyImpl>(resource);
     }
     // Если первый символ строки - символ начала формулы, и строка имеет 
     // больше одного символа - создаем формульную ячейку
     else if (text[0] == FORMULA_SIGN && text.size() > 1) {
         // Создаем временный указатель на формульную реализацию ячейки
-        std::unique_ptr<Impl> temp = std::make_unique<FormulaImpl>(text.substr(1));
+        PoolPtr<Impl> temp = MakePooled<FormulaImpl>(
+            resource,
+            sheet_.GetFormulaCache().Acquire(std::string_view(text).substr(1), pos_)
+        );
 
         // Если ячейка содержит циклические зависимости 
         // - выбрасываем CircularDependencyException
-        std::unordered_set<const Cell*> visited_cells;
-        if (IsCyclic(temp->GetReferencedCells(), visited_cells)) {
+        if (IsCyclic(temp->GetReferencedCells(), temp->GetReferencedRanges())) {
             throw CircularDependencyException("Circular dependency detected");
         }
 
@@ -122,18 +210,49 @@ void Cell::Set(std::string text) {
     }
     // В остальных случаях ячейка будет считать текстовой
     else {
-        impl_ = std::make_unique<TextImpl>(
-            std::move(text),
-            text[0] == ESCAPE_SIGN ? 1 : 0
+        impl_ = MakePooled<TextImpl>(
+            resource,
+            text,
+            text[0] == ESCAPE_SIGN,
+            sheet_.GetStringPool()
         );
     }
 
-    // Инвалидируем кэш в необходимых ячейках
-    InvalidateCache();
+    // Инвалидируем кэш в необходимых ячейках. Внутри транзакции сбрасываем
+    // только собственный кэш: зависимые инвалидирует таблица при подтверждении
+    state_.store(0, std::memory_order_relaxed);
+    if (sheet_.IsInTransaction()) {
+        cache_.reset();
+        sheet_.MarkDirty(pos_);
+    }
+    else {
+        InvalidateCache();
+    }
     // Обновляем списки зависимостей
     UpdateDepencies();
 }
 
+/**
+ * Задает ячейке заранее разобранную формулу без проверки циклических
+ * зависимостей, инвалидации кэша зависимых ячеек и обновления списков
+ * зависимостей. Сбрасывается только собственный кэш ячейки.
+ * Используется пакетной загрузкой, которая выполняет эти шаги сама
+ * для всех загруженных ячеек сразу
+*/
+void Cell::Load(FormulaCache::AnchoredFormula formula) {
+    impl_ = MakePooled<FormulaImpl>(sheet_.GetMemoryResource(), std::move(formula));
+    cache_.reset();
+    state_.store(0, std::memory_order_relaxed);
+}
+/**
+ * Делает ячейку представлением числа без записи его текста в пул строк
+*/
+void Cell::LoadNumber(double number, std::string text) {
+    impl_ = MakePooled<NumberImpl>(sheet_.GetMemoryResource(), number, std::move(text));
+    cache_.reset();
+    state_.store(0, std::memory_order_relaxed);
+}
+
 /**
  * Очищает ячейку (меняет тип ячейки на пустую)
 */
@@ -146,13 +265,50 @@ void Cell::Clear() {
  * текст для текстовой ячейки
 */
 Cell::Value Cell::GetValue() const {
-    // Если у ячейки нет кэша - создаем его
-    if (!cache_) {
-        cache_ = impl_->GetValue(sheet_);
+    // Значение текстовой и пустой ячейки копируется сразу из пула строк,
+    // минуя кэш
+    if (std::optional<ValueView> view = impl_->GetValueView()) {
+        return std::visit([](const auto& value) -> Value {
+            if constexpr (std::is_same_v<std::decay_t<decltype(value)>, std::string_view>) {
+                return std::string(value);
+            } else {
+                return value;
+            }
+        }, *view);
+    }
+
+    // Если у ячейки нет актуального кэша - создаем его
+    if (NeedsEvaluation()) {
+        Evaluate();
     }
 
     return cache_.value();
 }
+/**
+ * Возвращает значение ячейки без копирования. Текст берется прямо из пула
+ * строк таблицы, значение формулы - из кэша, который заполняется при
+ * необходимости. Представление действительно до следующего изменения таблицы
+*/
+Cell::ValueView Cell::GetValueView() const {
+    if (std::optional<ValueView> view = impl_->GetValueView()) {
+        return *view;
+    }
+
+    if (NeedsEvaluation()) {
+        Evaluate();
+    }
+
+    return std::visit([](const auto& value) -> ValueView { return value; }, *cache_);
+}
+/**
+ * Заполняет кэш формульной ячейки. Формулы без кэша, от которых она
+ * зависит, таблица вычисляет заранее в порядке зависимостей, поэтому
+ * глубина вызовов не зависит от длины цепочки ссылок. Каждую формулу
+ * вычисляет один поток, захвативший ее
+*/
+void Cell::Evaluate() const {
+    sheet_.EvaluateFormulas(pos_);
+}
 /**
  * Возвращает содержимое ячейки
 */
@@ -160,23 +316,127 @@ std::string Cell::GetText() const {
     return impl_->GetText();
 }
 /**
- * Возвращает вектор позиций ячеек, от которых зависит текущая ячейка
+ * Возвращает идентификатор значения текстовой ячейки в пуле строк таблицы.
+ * Значения текстовых ячеек одной таблицы равны тогда и только тогда,
+ * когда равны их идентификаторы
+*/
+std::optional<StringPool::Id> Cell::GetValueId() const {
+    if (const auto* text_impl = dynamic_cast<const TextImpl*>(impl_.get())) {
+        return text_impl->GetValueId();
+    }
+
+    return std::nullopt;
+}
+/**
+ * Возвращает значение ячейки как операнда формулы. Для текста оно
+ * определено при установке ячейки, для формулы берется из кэша значения
+*/
+Cell::NumericValue Cell::GetNumericValue() const {
+    if (std::optional<NumericValue> value = impl_->GetNumericValue()) {
+        return *value;
+    }
+
+    const ValueView value = GetValueView();
+    if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    }
+    return FormulaError(FormulaError::Category::Value);
+}
+/**
+ * Возвращает true, если ячейка текстовая и ее текст является записью числа
+*/
+bool Cell::IsNumericText() const {
+    const auto* text_impl = dynamic_cast<const TextImpl*>(impl_.get());
+    return text_impl != nullptr && text_impl->IsNumeric();
+}
+/**
+ * Возвращает формулу ячейки и ее якорь; для ячеек без формулы formula равен nullptr
+*/
+Cell::FormulaRef Cell::GetFormula() const {
+    if (const auto* formula_impl = dynamic_cast<const FormulaImpl*>(impl_.get())) {
+        return { &formula_impl->GetFormula(), formula_impl->GetAnchor() };
+    }
+
+    return {};
+}
+/**
+ * Возвращает true, если значение ячейки уже вычислено
+*/
+bool Cell::HasCachedValue() const {
+    return (state_.load(std::memory_order_acquire) & HAS_VALUE) != 0;
+}
+/**
+ * Запоминает значение ячейки, вычисленное вне GetValue()
+*/
+void Cell::SetCachedValue(Value value, bool clean) const {
+    cache_ = std::move(value);
+
+    const uint8_t state = state_.load(std::memory_order_relaxed);
+    state_.store(HAS_VALUE | (clean ? 0 : state & DIRTY), std::memory_order_release);
+}
+/**
+ * Возвращает true, если значение формулы устарело
+*/
+bool Cell::IsDirty() const {
+    return (state_.load(std::memory_order_acquire) & DIRTY) != 0;
+}
+/**
+ * Возвращает true, если формулу нужно вычислить при чтении. При ручном
+ * пересчете устаревший кэш читается как есть до вызова Recalculate()
+*/
+bool Cell::NeedsEvaluation() const {
+    const uint8_t state = state_.load(std::memory_order_acquire);
+    return (state & HAS_VALUE) == 0
+        || ((state & DIRTY) != 0 && sheet_.GetRecalcPolicy() != Sheet::RecalcPolicy::Manual);
+}
+/**
+ * Захватывает вычисление формулы установкой EVALUATING. Поток, не
+ * сумевший захватить формулу, ждет, пока ее вычисляющий поток сохранит
+ * значение. Захватывают только формулы, ссылки которых уже вычислены,
+ * поэтому вычисляющий поток не ждет других и ожидание конечно
+*/
+bool Cell::ClaimEvaluation() const {
+    uint8_t state = state_.load(std::memory_order_acquire);
+    while ((state & EVALUATING) == 0) {
+        if (!NeedsEvaluation()) {
+            return false;
+        }
+        if (state_.compare_exchange_weak(state, state | EVALUATING, std::memory_order_acquire)) {
+            return true;
+        }
+    }
+
+    while ((state_.load(std::memory_order_acquire) & EVALUATING) != 0) {
+        std::this_thread::yield();
+    }
+    return false;
+}
+/**
+ * Возвращает отсортированный вектор позиций ячеек, на которые формула
+ * ссылается по отдельности. Диапазоны не разворачиваются: их позиции
+ * возвращает GetReferencedRanges()
 */
 std::vector<Position> Cell::GetReferencedCells() const {
     return impl_->GetReferencedCells();
 }
+/**
+ * Возвращает диапазоны, на которые ссылается формула ячейки
+*/
+std::vector<Range> Cell::GetReferencedRanges() const {
+    return impl_->GetReferencedRanges();
+}
 
 /**
- * Возвращает true, если вектор зависит от других ячеек
+ * Возвращает true, если формула ячейки ссылается на другие ячейки
 */
 bool Cell::IsReferenced() const {
-    return !current_depends_on_.empty();
+    return sheet_.GetDependencyGraph().HasPrecedents(DependencyGraph::ToId(pos_));
 }
 /**
  * Вовращает true, если имеются ячейки, которые зависят от текущей
 */
 bool Cell::HasDependencies() const {
-    return !depends_on_current_.empty();
+    return sheet_.GetDependencyGraph().HasDependents(DependencyGraph::ToId(pos_));
 }
 
 /**
@@ -186,78 +446,85 @@ bool Cell::IsEmpty() const {
     return impl_->IsEmpty();
 }
 /**
- * Возвращает true, если граф связей ячейки содержит циклы
+ * Возвращает true, если формула ячейки, ссылающаяся на cells_to_check
+ * и ranges_to_check, замкнет цикл. Благодаря топологическому порядку графа
+ * обходится только его часть между ячейкой и ее ссылками
 */
 bool Cell::IsCyclic(const std::vector<Position>& cells_to_check,
-        std::unordered_set<const Cell*>& visited_cells) const
+        const std::vector<Range>& ranges_to_check) const
 {
-    for (Position pos : cells_to_check) {
-        const Cell* cell = reinterpret_cast<Cell*>(sheet_.GetCell(pos));
-
-        // Если указатель на ячейку является указателем на начальную ячейку 
-        // - возвращаем true
-        if (cell == this) {
-            return true;
-        }
-
-        // Если ячейка является листом - пропускаем итерацию
-        if (cell == nullptr
-            || cell->IsEmpty())
-        {
-            continue;
-        }
-
-        // Если ячейка уже посещалась - пропускаем итерацию
-        if (visited_cells.find(cell) != visited_cells.end()) {
-            continue;
-        }
-        visited_cells.insert(cell);
-
-        // Если метод ContainsCircularReferences для зависимостей cell 
-        // вернул true - возвращаем также true
-        if (IsCyclic(cell->GetReferencedCells(), visited_cells)) {
+    for (const Range& range : ranges_to_check) {
+        if (range.Contains(pos_)) {
             return true;
         }
     }
 
-    return false;
+    // Формулы, диапазоны которых содержат ячейку, станут ее зависимыми
+    return sheet_.GetDependencyGraph().CreatesCycle(
+        DependencyGraph::ToId(pos_),
+        sheet_.CollectPrecedents(cells_to_check, ranges_to_check),
+        sheet_.FindRangeDependents(pos_));
 }
 
 /**
- * Инвалидирует кэш у текущей и зависящих от нее ячеек
+ * Инвалидирует кэш у текущей и отмечает устаревшими зависящие от нее ячейки.
+ * Зависимые ячейки обходятся всегда: пустая ячейка не кэширует значение
+ * при чтении из формулы, а зависящие от нее формулы - кэшируют
 */
 void Cell::InvalidateCache() {
-    // Если кэш не был создан, или уже был инвалидирован - не делаем ничего
-    if (!cache_) {
-        return;
-    }
-
-    // Инвалидируем кэш
+    state_.fetch_and(static_cast<uint8_t>(~HAS_VALUE), std::memory_order_relaxed);
     cache_.reset();
-
-    // Запускаем инвалидацию кэша у всех зависящих ячеек
-    for (Cell* dep_cell : depends_on_current_) {
-        dep_cell->InvalidateCache();
-    }
+    sheet_.InvalidateDependents(pos_);
 }
 /**
- * Обновляет списки зависимостей
+ * Отмечает формулу устаревшей без обхода зависимых
 */
-void Cell::UpdateDepencies() {
-    // Удаляем текущую ячейку из старых списков зависимостей
-    for (Cell* cell : current_depends_on_) {
-        cell->depends_on_current_.erase(this);
+bool Cell::MarkDirty() {
+    if (GetFormula().formula == nullptr) {
+        return false;
     }
 
-    // Обновляем список зависимостей текущей ячейки
-    current_depends_on_.clear();
-    for (Position pos : GetReferencedCells()) {
-        Cell* cell = reinterpret_cast<Cell*>(sheet_.GetOrCreateCell(pos));
-        current_depends_on_.insert(cell);
+    // Одновременные записи в разные тайлы отмечают общие формулы: отметку
+    // ставит и обходит зависимые ровно одна из них
+    const uint8_t state = state_.fetch_or(DIRTY, std::memory_order_acq_rel);
+    return (state & DIRTY) == 0;
+}
+/**
+ * Возвращает true, если ячейка внесена в список устаревших формул таблицы
+*/
+bool Cell::IsListed() const {
+    return listed_;
+}
+/**
+ * Задает отметку о внесении в список устаревших формул
+*/
+bool Cell::SetListed(bool listed) {
+    if (listed_ == listed) {
+        return false;
     }
 
-    // Вносим текущую ячейку в новые списки зависимостей
-    for (Cell* cell : current_depends_on_) {
-        cell->depends_on_current_.insert(this);
+    listed_ = listed;
+    return true;
+}
+/**
+ * Обновляет ссылки ячейки в графе зависимостей таблицы. Позиции, на которые
+ * ссылается формула, в графе адресуются идентификаторами, поэтому объекты
+ * ячеек для них не создаются
+*/
+void Cell::UpdateDepencies() {
+    DependencyGraph& graph = sheet_.GetDependencyGraph();
+    const DependencyGraph::Id id = DependencyGraph::ToId(pos_);
+
+    // Ячейки диапазонов не связываются с текущей поштучно: зависимости
+    // от диапазонов хранит таблица, в граф попадают только формулы диапазонов
+    std::vector<Range> ranges = GetReferencedRanges();
+    graph.SetPrecedents(id, sheet_.CollectPrecedents(GetReferencedCells(), ranges));
+    sheet_.SetRangeDependencies(pos_, std::move(ranges));
+
+    // Формула, попавшая в диапазоны других формул, вычисляется раньше них
+    if (GetFormula().formula != nullptr) {
+        for (const DependencyGraph::Id dependent : sheet_.FindRangeDependents(pos_)) {
+            graph.AddEdge(id, dependent);
+        }
     }
-}
\ No newline at end of file
+}
@@ -1,49 +1,109 @@
 #pragma once
 
+#include "arena.h"
 #include "common.h"
 #include "formula.h"
+#include "formula_cache.h"
 #include "sheet.h"
+#include "string_pool.h"
 
+#include <atomic>
+#include <cstdint>
 #include <functional>
+#include <memory_resource>
 #include <optional>
-#include <unordered_set>
 
 class Sheet;
 
 class Cell : public CellInterface {
 public:
-    explicit Cell(Sheet& sheet);
+    Cell(Sheet& sheet, Position pos);
     ~Cell();
 
     void Set(std::string text);
+    void Load(FormulaCache::AnchoredFormula formula);
+    // Делает ячейку числом с текстом text, как в колоночном хранилище.
+    // Текст хранится в самой ячейке, а не в пуле строк таблицы, поэтому
+    // такую ячейку можно создать при чтении. Ссылки и кэши не меняются
+    void LoadNumber(double number, std::string text);
     void Clear();
 
     Value GetValue() const override;
     std::string GetText() const override;
     std::vector<Position> GetReferencedCells() const override;
+    std::vector<Range> GetReferencedRanges() const;
+    Position GetPosition() const { return pos_; }
+
+    std::optional<StringPool::Id> GetValueId() const;
+
+    NumericValue GetNumericValue() const override;
+    ValueView GetValueView() const override;
+    bool IsNumericText() const;
+
+    // Формула ячейки и позиция, относительно которой она вычисляется
+    struct FormulaRef {
+        const RelativeFormulaInterface* formula = nullptr; // nullptr - ячейка не формульная
+        Position anchor;
+    };
+    FormulaRef GetFormula() const;
+
+    // Кэш значения, заполняемый пакетным вычислением формул. Значение,
+    // вычисленное по актуальным значениям ссылок (clean), снимает отметку
+    // устаревшего. Кэш публикуется атомарно: поток, увидевший значение
+    // через HasCachedValue() или NeedsEvaluation(), видит его целиком
+    bool HasCachedValue() const;
+    void SetCachedValue(Value value, bool clean = true) const;
+
+    // Формула устарела: кэш, если есть, хранит последнее вычисленное значение
+    bool IsDirty() const;
+    // Формулу нужно вычислить при чтении: кэша нет или он устарел, а
+    // политика пересчета таблицы не ручная
+    bool NeedsEvaluation() const;
+    // Захватывает вычисление формулы, которой нужно вычисление. Возвращает
+    // true, если вычислять должен вызвавший поток: он сохраняет значение
+    // через SetCachedValue(), снимающий захват. Если формулу уже вычисляет
+    // другой поток, дожидается его значения и возвращает false
+    bool ClaimEvaluation() const;
 
     bool IsReferenced() const;
     bool HasDependencies() const;
 
     bool IsEmpty() const;
     bool IsCyclic(const std::vector<Position>& cells_to_check,
-        std::unordered_set<const Cell*>& visited_cells) const;
+        const std::vector<Range>& ranges_to_check) const;
 
     void InvalidateCache();
+    // Отмечает формулу устаревшей без обхода зависимых, сохраняя кэш;
+    // возвращает false, если ячейка уже отмечена или не является формулой
+    bool MarkDirty();
+    // Отметка о том, что ячейка внесена в список устаревших формул таблицы.
+    // SetListed() возвращает false, если отметка уже была такой
+    bool IsListed() const;
+    bool SetListed(bool listed);
 
     void UpdateDepencies();
 
 private:
+    void Evaluate() const;
+
     class Impl;
     class EmptyImpl;
     class TextImpl;
+    class NumberImpl;
     class FormulaImpl;
 
-    std::unique_ptr<Impl> impl_;
-
     Sheet& sheet_; // Ссылка на таблицу, в которой находится ячейка
+    Position pos_; // Позиция ячейки в таблице
+
+    PoolPtr<Impl> impl_; // Реализация, размещенная в пуле памяти таблицы
+
+    static constexpr uint8_t HAS_VALUE = 1; // Кэш содержит значение
+    static constexpr uint8_t DIRTY = 2; // Значение формулы устарело
+    static constexpr uint8_t EVALUATING = 4; // Формулу вычисляет один из потоков
 
     mutable std::optional<Value> cache_; // Значение кэша текущей ячейки
-    std::unordered_set<Cell*> depends_on_current_; // Указатели на ячейки, которые зависят от текущей
-    std::unordered_set<Cell*> current_depends_on_; // Указатели на ячейки, от которых зависит текущая
+    // Флаги HAS_VALUE, DIRTY и EVALUATING. Вычисляющий поток записывает
+    // cache_, а затем флаги с release; читатель загружает флаги с acquire
+    mutable std::atomic<uint8_t> state_{ 0 };
+    bool listed_ = false; // Ячейка внесена в список устаревших формул таблицы
 };
\ No newline at end of file
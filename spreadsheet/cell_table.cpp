@@ -0,0 +1,217 @@
+#include "cell_table.h"
+
+#include "cell.h"
+
+CellTable::CellTable() = default;
+CellTable::~CellTable() {
+    Clear();
+}
+
+/**
+ * Возвращает тайл, содержащий позицию pos, либо nullptr, если он не создан
+*/
+CellTable::Tile* CellTable::FindTile(Position pos) const {
+    const TileRow* tile_row = tile_rows_[pos.row / TILE_SIZE].get();
+    if (tile_row == nullptr) {
+        return nullptr;
+    }
+
+    return tile_row->tiles[pos.col / TILE_SIZE].get();
+}
+/**
+ * Возвращает тайл, содержащий позицию pos, создавая его при необходимости
+*/
+CellTable::Tile& CellTable::GetOrCreateTile(Position pos) {
+    auto& tile_row = tile_rows_[pos.row / TILE_SIZE];
+    if (tile_row == nullptr) {
+        tile_row = std::make_unique<TileRow>();
+    }
+
+    const int tile_col = pos.col / TILE_SIZE;
+    auto& tile = tile_row->tiles[tile_col];
+    if (tile == nullptr) {
+        tile = std::make_unique<Tile>();
+        tile_row->tile_mask[tile_col / 64] |= uint64_t{1} << (tile_col % 64);
+        ++tile_row->count;
+    }
+
+    return *tile;
+}
+
+/**
+ * Возвращает указатель на ячейку по адресу pos, либо nullptr
+*/
+Cell* CellTable::Get(Position pos) const {
+    const Tile* tile = FindTile(pos);
+    if (tile == nullptr) {
+        return nullptr;
+    }
+
+    return tile->cells[IndexInTile(pos)];
+}
+
+/**
+ * Помещает ячейку по адресу pos, создавая тайл при необходимости.
+ * Число, хранившееся по этому адресу, удаляется.
+ * Возвращает указатель на размещенную ячейку
+*/
+Cell* CellTable::Set(Position pos, PoolPtr<Cell> cell) {
+    Tile& tile = GetOrCreateTile(pos);
+
+    Cell*& slot = tile.cells[IndexInTile(pos)];
+    if (slot != nullptr) {
+        deleter_(slot);
+    }
+    else {
+        if (HasNumber(tile, pos)) {
+            tile.number_masks[pos.col % TILE_SIZE] &= ~(uint64_t{1} << (pos.row % TILE_SIZE));
+            if (--tile.number_count == 0) {
+                tile.numbers.reset();
+            }
+        }
+        else {
+            tile.row_masks[pos.row % TILE_SIZE] |= uint64_t{1} << (pos.col % TILE_SIZE);
+            ++tile.count;
+        }
+    }
+    deleter_ = cell.get_deleter();
+    slot = cell.release();
+
+    return slot;
+}
+
+/**
+ * Возвращает указатель на число по адресу pos, либо nullptr,
+ * если позиция не хранит число
+*/
+const double* CellTable::GetNumber(Position pos) const {
+    const Tile* tile = FindTile(pos);
+    if (tile == nullptr || !HasNumber(*tile, pos)) {
+        return nullptr;
+    }
+
+    return &tile->numbers[NumberIndexInTile(pos)];
+}
+
+/**
+ * Сохраняет число по адресу pos в колоночном хранилище тайла.
+ * Ячейка, хранившаяся по этому адресу, удаляется
+*/
+void CellTable::SetNumber(Position pos, double number) {
+    Tile& tile = GetOrCreateTile(pos);
+
+    if (tile.numbers == nullptr) {
+        tile.numbers = std::make_unique<double[]>(TILE_SIZE * TILE_SIZE);
+    }
+
+    Cell*& slot = tile.cells[IndexInTile(pos)];
+    if (slot != nullptr) {
+        deleter_(slot);
+        slot = nullptr;
+    }
+    else if (!HasNumber(tile, pos)) {
+        tile.row_masks[pos.row % TILE_SIZE] |= uint64_t{1} << (pos.col % TILE_SIZE);
+        ++tile.count;
+    }
+
+    if (!HasNumber(tile, pos)) {
+        tile.number_masks[pos.col % TILE_SIZE] |= uint64_t{1} << (pos.row % TILE_SIZE);
+        ++tile.number_count;
+    }
+    tile.numbers[NumberIndexInTile(pos)] = number;
+}
+
+/**
+ * Возвращает true, если позиция занята ячейкой или числом
+*/
+bool CellTable::Contains(Position pos) const {
+    const Tile* tile = FindTile(pos);
+    if (tile == nullptr) {
+        return false;
+    }
+
+    return tile->row_masks[pos.row % TILE_SIZE] >> (pos.col % TILE_SIZE) & 1;
+}
+
+/**
+ * Возвращает количество занятых позиций в тайле, содержащем pos
+*/
+int CellTable::CountInTile(Position pos) const {
+    const Tile* tile = FindTile(pos);
+    return tile != nullptr ? tile->count : 0;
+}
+
+/**
+ * Удаляет ячейку или число по адресу pos. Опустевшие тайлы освобождаются
+*/
+void CellTable::Erase(Position pos) {
+    if (Contains(pos)) {
+        ReleaseSlot(pos);
+    }
+}
+/**
+ * Удаляет все ячейки и числа
+*/
+void CellTable::Clear() {
+    for (auto& tile_row : tile_rows_) {
+        if (tile_row == nullptr) {
+            continue;
+        }
+        for (auto& tile : tile_row->tiles) {
+            if (tile != nullptr) {
+                DestroyCells(*tile);
+            }
+        }
+        tile_row.reset();
+    }
+}
+/**
+ * Разрушает объекты ячеек тайла, обходя занятые позиции по маскам строк
+*/
+void CellTable::DestroyCells(Tile& tile) {
+    if (tile.count == tile.number_count) {
+        return;
+    }
+    for (int row = 0; row < TILE_SIZE; ++row) {
+        for (uint64_t mask = tile.row_masks[row]; mask != 0; mask &= mask - 1) {
+            Cell*& slot = tile.cells[row * TILE_SIZE + LowestBit(mask)];
+            if (slot != nullptr) {
+                deleter_(slot);
+                slot = nullptr;
+            }
+        }
+    }
+}
+/**
+ * Освобождает занятую позицию pos, а также опустевший тайл
+ * и опустевшую строку тайлов
+*/
+void CellTable::ReleaseSlot(Position pos) {
+    auto& tile_row = tile_rows_[pos.row / TILE_SIZE];
+    const int tile_col = pos.col / TILE_SIZE;
+    auto& tile = tile_row->tiles[tile_col];
+
+    if (Cell*& slot = tile->cells[IndexInTile(pos)]; slot != nullptr) {
+        deleter_(slot);
+        slot = nullptr;
+    }
+    tile->row_masks[pos.row % TILE_SIZE] &= ~(uint64_t{1} << (pos.col % TILE_SIZE));
+
+    if (HasNumber(*tile, pos)) {
+        tile->number_masks[pos.col % TILE_SIZE] &= ~(uint64_t{1} << (pos.row % TILE_SIZE));
+
+        // Освобождаем колоночный массив, когда в тайле не осталось чисел
+        if (--tile->number_count == 0) {
+            tile->numbers.reset();
+        }
+    }
+
+    if (--tile->count == 0) {
+        tile.reset();
+        tile_row->tile_mask[tile_col / 64] &= ~(uint64_t{1} << (tile_col % 64));
+
+        if (--tile_row->count == 0) {
+            tile_row.reset();
+        }
+    }
+}
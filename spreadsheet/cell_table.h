@@ -0,0 +1,207 @@
+#pragma once
+
+#include "arena.h"
+#include "common.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+class Cell;
+
+// Возвращает индекс младшего установленного бита непустой маски
+inline int LowestBit(uint64_t mask) {
+#if defined(_MSC_VER)
+    unsigned long index = 0;
+    _BitScanForward64(&index, mask);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctzll(mask);
+#endif
+}
+
+// Возвращает маску с установленными битами от low до high включительно
+inline uint64_t BitRange(int low, int high) {
+    const uint64_t upto_high = high == 63 ? ~uint64_t{ 0 } : (uint64_t{ 1 } << (high + 1)) - 1;
+    return upto_high & ~((uint64_t{ 1 } << low) - 1);
+}
+
+// Разреженное хранилище ячеек таблицы.
+// Таблица разбита на блоки (тайлы) размером TILE_SIZE x TILE_SIZE, которые
+// создаются по требованию и адресуются через двухуровневый каталог:
+// строка тайлов -> тайл. Потребление памяти зависит от количества занятых
+// тайлов, а не от положения самой дальней ячейки.
+//
+// Помимо объектов Cell тайл хранит чисто числовые ячейки в колоночном виде:
+// непрерывный массив double (по столбцам) и битовую маску занятости для
+// каждого столбца тайла. Позиция занята либо объектом Cell, либо числом.
+//
+// Объекты Cell размещаются в одном ресурсе памяти, поэтому тайл хранит
+// простые указатели, а удалитель у таблицы один: слот занимает 8 байт
+// вместо 32 у PoolPtr, и тайл весит около 32 КиБ.
+class CellTable {
+public:
+    static constexpr int TILE_SIZE = 64;
+    static constexpr int TILE_ROWS = (Position::MAX_ROWS + TILE_SIZE - 1) / TILE_SIZE;
+    static constexpr int TILE_COLS = (Position::MAX_COLS + TILE_SIZE - 1) / TILE_SIZE;
+
+    CellTable();
+    CellTable(const CellTable&) = delete;
+    CellTable& operator=(const CellTable&) = delete;
+    ~CellTable();
+
+    Cell* Get(Position pos) const;
+    Cell* Set(Position pos, PoolPtr<Cell> cell);
+
+    const double* GetNumber(Position pos) const;
+    void SetNumber(Position pos, double number);
+
+    bool Contains(Position pos) const;
+    // Количество занятых позиций в тайле, содержащем pos (0, если тайла нет)
+    int CountInTile(Position pos) const;
+    void Erase(Position pos);
+    void Clear();
+
+    // Вызывает func(col, cell, number) для всех занятых позиций строки row
+    // с индексом столбца меньше col_end в порядке возрастания столбцов.
+    // Для числовой позиции cell равен nullptr, иначе number равен nullptr.
+    // Пустые тайлы пропускаются целиком.
+    template <typename Func>
+    void ForEachInRow(int row, int col_end, Func func) const;
+
+    // Обходит занятые позиции диапазона range тайл за тайлом. Числа передаются
+    // непрерывными участками столбцов, начинающимися с позиции first:
+    // on_numbers(Position first, const double* values, size_t count),
+    // объекты Cell - по одному: on_cell(const Cell& cell).
+    template <typename NumbersFunc, typename CellFunc>
+    void ForEachInRange(Range range, NumbersFunc on_numbers, CellFunc on_cell) const;
+
+private:
+    struct Tile {
+        std::array<Cell*, TILE_SIZE * TILE_SIZE> cells{}; // Принадлежат таблице, см. deleter_
+        std::array<uint64_t, TILE_SIZE> row_masks{}; // Занятые столбцы в каждой строке тайла
+        int count = 0; // Количество занятых позиций в тайле
+
+        std::unique_ptr<double[]> numbers; // Числа, уложенные по столбцам
+        std::array<uint64_t, TILE_SIZE> number_masks{}; // Числовые строки в каждом столбце тайла
+        int number_count = 0; // Количество чисел в тайле
+    };
+    struct TileRow {
+        std::array<std::unique_ptr<Tile>, TILE_COLS> tiles;
+        std::array<uint64_t, (TILE_COLS + 63) / 64> tile_mask{}; // Занятые тайлы
+        int count = 0; // Количество тайлов в строке
+    };
+
+    Tile* FindTile(Position pos) const;
+    Tile& GetOrCreateTile(Position pos);
+    void ReleaseSlot(Position pos);
+    void DestroyCells(Tile& tile);
+
+    static int IndexInTile(Position pos) {
+        return (pos.row % TILE_SIZE) * TILE_SIZE + pos.col % TILE_SIZE;
+    }
+    static int NumberIndexInTile(Position pos) {
+        return (pos.col % TILE_SIZE) * TILE_SIZE + pos.row % TILE_SIZE;
+    }
+    static bool HasNumber(const Tile& tile, Position pos) {
+        return tile.number_masks[pos.col % TILE_SIZE] >> (pos.row % TILE_SIZE) & 1;
+    }
+
+    std::array<std::unique_ptr<TileRow>, TILE_ROWS> tile_rows_; // Каталог строк тайлов
+    // Удалитель объектов Cell, общий для всех ячеек таблицы: они созданы
+    // MakePooled в одном ресурсе памяти
+    PoolDeleter<Cell> deleter_;
+};
+
+template <typename Func>
+void CellTable::ForEachInRow(int row, int col_end, Func func) const {
+    const TileRow* tile_row = tile_rows_[row / TILE_SIZE].get();
+    if (tile_row == nullptr) {
+        return;
+    }
+
+    const int tile_end = (col_end + TILE_SIZE - 1) / TILE_SIZE;
+    for (int word = 0; word < static_cast<int>(tile_row->tile_mask.size()); ++word) {
+        for (uint64_t tiles = tile_row->tile_mask[word]; tiles != 0; tiles &= tiles - 1) {
+            const int tile_col = word * 64 + LowestBit(tiles);
+            if (tile_col >= tile_end) {
+                return;
+            }
+
+            const Tile& tile = *tile_row->tiles[tile_col];
+            const int row_in_tile = row % TILE_SIZE;
+            for (uint64_t cols = tile.row_masks[row_in_tile]; cols != 0; cols &= cols - 1) {
+                const int col = tile_col * TILE_SIZE + LowestBit(cols);
+                if (col >= col_end) {
+                    return;
+                }
+
+                const Cell* cell = tile.cells[row_in_tile * TILE_SIZE + col % TILE_SIZE];
+                if (cell != nullptr) {
+                    func(col, cell, static_cast<const double*>(nullptr));
+                }
+                else {
+                    func(col, cell, &tile.numbers[(col % TILE_SIZE) * TILE_SIZE + row_in_tile]);
+                }
+            }
+        }
+    }
+}
+
+template <typename NumbersFunc, typename CellFunc>
+void CellTable::ForEachInRange(Range range, NumbersFunc on_numbers, CellFunc on_cell) const {
+    for (int tile_row = range.first.row / TILE_SIZE; tile_row <= range.last.row / TILE_SIZE; ++tile_row) {
+        const TileRow* tiles = tile_rows_[tile_row].get();
+        if (tiles == nullptr) {
+            continue;
+        }
+
+        // Строки диапазона внутри тайлов этой строки тайлов
+        const int row_base = tile_row * TILE_SIZE;
+        const int row_begin = std::max(range.first.row - row_base, 0);
+        const int row_end = std::min(range.last.row - row_base, TILE_SIZE - 1);
+        const uint64_t rows = BitRange(row_begin, row_end);
+
+        for (int tile_col = range.first.col / TILE_SIZE; tile_col <= range.last.col / TILE_SIZE; ++tile_col) {
+            const Tile* tile = tiles->tiles[tile_col].get();
+            if (tile == nullptr) {
+                continue;
+            }
+
+            const int col_base = tile_col * TILE_SIZE;
+            const int col_begin = std::max(range.first.col - col_base, 0);
+            const int col_end = std::min(range.last.col - col_base, TILE_SIZE - 1);
+
+            // Числа: участки подряд идущих установленных битов маски столбца
+            for (int col = col_begin; tile->number_count > 0 && col <= col_end; ++col) {
+                for (uint64_t mask = tile->number_masks[col] & rows; mask != 0;) {
+                    const int start = LowestBit(mask);
+                    const uint64_t rest = ~(mask >> start);
+                    const int length = rest == 0 ? TILE_SIZE - start : LowestBit(rest);
+                    on_numbers(Position{ row_base + start, col_base + col },
+                               &tile->numbers[col * TILE_SIZE + start], static_cast<size_t>(length));
+                    mask &= ~BitRange(start, start + length - 1);
+                }
+            }
+
+            // Объекты ячеек
+            if (tile->count == tile->number_count) {
+                continue;
+            }
+            const uint64_t cols = BitRange(col_begin, col_end);
+            for (int row = row_begin; row <= row_end; ++row) {
+                for (uint64_t mask = tile->row_masks[row] & cols; mask != 0; mask &= mask - 1) {
+                    const Cell* cell = tile->cells[row * TILE_SIZE + LowestBit(mask)];
+                    if (cell != nullptr) {
+                        on_cell(*cell);
+                    }
+                }
+            }
+        }
+    }
+}
@@ -2,6 +2,7 @@
 
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -33,6 +34,22 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Прямоугольный диапазон ячеек от левой верхней first до правой нижней last
+// включительно. Записывается как A1:B10; диапазон из одной ячейки - как A1.
+struct Range {
+    Position first;
+    Position last;
+
+    bool operator==(Range rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    std::string ToString() const;
+
+    // Диапазон с углами a и b, заданными в любом порядке
+    static Range FromCorners(Position a, Position b);
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -95,13 +112,42 @@ public:
 
     // Возвращает список ячеек, которые непосредственно задействованы в данной
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек. В случае текстовой ячейки список пуст.
+    // ячеек. Ячейки диапазонов формулы в список не входят. В случае текстовой
+    // ячейки список пуст.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Значение ячейки как операнда формулы: число, ноль для пустой ячейки,
+    // #VALUE! для ошибки и текста, который не является числом (см. ParseCellText).
+    // Реализация по умолчанию получает его из GetValue() при каждом вызове.
+    using NumericValue = std::variant<double, FormulaError>;
+    virtual NumericValue GetNumericValue() const;
+
+    // То же значение, что и GetValue(), но без копирования: текст ссылается
+    // на память, которой владеет ячейка или таблица. Представление действительно
+    // до следующего изменения таблицы
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
+    virtual ValueView GetValueView() const = 0;
 };
 
 inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
 
+// Число, которое текст значения ячейки записывает целиком по правилам
+// std::stod (с начальными пробелами, знаком, экспонентой), или nullopt.
+// Так читают текстовые ячейки формулы
+std::optional<double> ParseCellText(std::string_view text);
+
+// Получатель значений ячеек диапазона, см. SheetInterface::VisitRange()
+class RangeVisitor {
+public:
+    virtual ~RangeVisitor() = default;
+
+    // Непрерывный участок ячеек одного столбца, содержащих только числа
+    virtual void VisitNumbers(const double* values, size_t count) = 0;
+    // Любая другая непустая ячейка диапазона
+    virtual void VisitCell(const CellInterface& cell) = 0;
+};
+
 // Интерфейс таблицы
 class SheetInterface {
 public:
@@ -143,6 +189,26 @@ public:
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Передает visitor все непустые ячейки валидного диапазона range в
+    // произвольном порядке. Таблица, хранящая числа непрерывными участками,
+    // может передавать их целыми участками, не создавая объектов ячеек.
+    // Реализация по умолчанию обходит ячейки по одной через GetCell().
+    virtual void VisitRange(Range range, RangeVisitor& visitor) const;
+
+    // Значения count ячеек столбца, начиная с first, для пакетного вычисления
+    // формул: в values[i] записывается число ячейки (first.row + i, first.col),
+    // пустая ячейка дает ноль. Если значение ячейки не число (текст или
+    // ошибка), numeric[i] сбрасывается, иначе не изменяется.
+    // Реализация по умолчанию обращается к ячейкам по одной через GetCell().
+    virtual void GetColumnValues(Position first, size_t count,
+                                 double* values, bool* numeric) const;
+
+    // Значение валидной позиции pos как операнда формулы (пустая дает ноль),
+    // см. CellInterface::GetNumericValue(). Таблица с колоночным хранением
+    // чисел отдает их, не создавая объектов ячеек.
+    // Реализация по умолчанию обращается к ячейке через GetCell().
+    virtual CellInterface::NumericValue GetNumericValue(Position pos) const;
 };
 
 // Создаёт готовую к работе пустую таблицу.
@@ -0,0 +1,559 @@
+#include "dependency_graph.h"
+
+#include <algorithm>
+#include <limits>
+#include <optional>
+#include <type_traits>
+#include <unordered_set>
+
+namespace {
+
+// Буфер правок с меньшим числом правок не переносится в CSR
+constexpr size_t MIN_EDITS_TO_COMPACT = 4096;
+
+}  // namespace
+
+/**
+ * Заменяет список ячеек, на которые ссылается формула id, и обновляет
+ * обратные связи только для изменившихся ребер. Удаление ребер порядок
+ * не нарушает, для добавленных он восстанавливается
+*/
+void DependencyGraph::SetPrecedents(Id id, std::vector<Id> precedents) {
+    std::sort(precedents.begin(), precedents.end());
+    precedents.erase(std::unique(precedents.begin(), precedents.end()), precedents.end());
+
+    std::vector<Id> previous;
+    precedents_.ForEach(id, [&previous](Id target) { previous.push_back(target); });
+    std::sort(previous.begin(), previous.end());
+
+    if (previous == precedents) {
+        return;
+    }
+
+    // Оба списка отсортированы: удаленные и добавленные ребра находятся слиянием
+    std::vector<Id> removed;
+    std::vector<Id> added;
+    size_t i = 0;
+    size_t j = 0;
+    while (i < previous.size() || j < precedents.size()) {
+        if (j == precedents.size() || (i < previous.size() && previous[i] < precedents[j])) {
+            dependents_.Remove(previous[i], id);
+            removed.push_back(previous[i++]);
+        }
+        else if (i == previous.size() || precedents[j] < previous[i]) {
+            added.push_back(precedents[j++]);
+        }
+        else {
+            ++i;
+            ++j;
+        }
+    }
+
+    precedents_.Assign(id, std::move(precedents));
+
+    // Новые вершины получают номера в конце порядка, ячейки раньше формулы,
+    // поэтому ссылки новой формулы на новые ячейки порядок не меняют
+    for (const Id from : added) {
+        if (order_.count(from) == 0) {
+            AddToOrder(from);
+        }
+    }
+    if (!added.empty() && order_.count(id) == 0) {
+        AddToOrder(id);
+    }
+    for (const Id from : added) {
+        dependents_.Add(from, id);
+        Reorder(from, id);
+    }
+
+    for (const Id from : removed) {
+        DropIfIsolated(from);
+    }
+    DropIfIsolated(id);
+}
+
+/**
+ * Заменяет списки формул пакета. Если пакет мал по сравнению с графом,
+ * формулы обрабатываются по одной, иначе оба направления собираются
+ * заново из ребер графа и пакета сортировкой
+*/
+void DependencyGraph::SetPrecedents(std::vector<std::pair<Id, std::vector<Id>>> formulas) {
+    size_t batch_edges = 0;
+    for (const auto& [id, precedents] : formulas) {
+        batch_edges += precedents.size();
+    }
+
+    if (batch_edges < MIN_EDITS_TO_COMPACT || batch_edges < GetEdgeCount() / 4) {
+        for (auto& [id, precedents] : formulas) {
+            SetPrecedents(id, std::move(precedents));
+        }
+        return;
+    }
+
+    std::sort(formulas.begin(), formulas.end(),
+        [](const auto& lhs, const auto& rhs) { return lhs.first < rhs.first; });
+    const auto in_batch = [&formulas](Id id) {
+        return std::binary_search(formulas.begin(), formulas.end(), id,
+            [](const auto& lhs, const auto& rhs) {
+                if constexpr (std::is_same_v<std::decay_t<decltype(lhs)>, Id>) {
+                    return lhs < rhs.first;
+                } else {
+                    return lhs.first < rhs;
+                }
+            });
+    };
+
+    // Ребра формул вне пакета сохраняются, ребра формул пакета заменяются
+    std::vector<std::pair<Id, Id>> edges;
+    edges.reserve(GetEdgeCount() + batch_edges);
+    precedents_.ForEachEdge([&](Id id, Id target) {
+        if (!in_batch(id)) {
+            edges.emplace_back(id, target);
+        }
+    });
+    for (auto& [id, precedents] : formulas) {
+        std::sort(precedents.begin(), precedents.end());
+        precedents.erase(std::unique(precedents.begin(), precedents.end()), precedents.end());
+        for (const Id target : precedents) {
+            edges.emplace_back(id, target);
+        }
+    }
+
+    precedents_.Build(edges);
+    for (auto& [id, target] : edges) {
+        std::swap(id, target);
+    }
+    dependents_.Build(edges);
+
+    RebuildOrder();
+}
+/**
+ * Добавляет ребро from -> to, если его нет
+*/
+void DependencyGraph::AddEdge(Id from, Id to) {
+    bool exists = false;
+    precedents_.ForEach(to, [from, &exists](Id target) { exists = exists || target == from; });
+    if (exists) {
+        return;
+    }
+
+    if (order_.count(from) == 0) {
+        AddToOrder(from);
+    }
+    if (order_.count(to) == 0) {
+        AddToOrder(to);
+    }
+    precedents_.Add(to, from);
+    dependents_.Add(from, to);
+    Reorder(from, to);
+}
+
+/**
+ * Ищет путь от формулы id к одной из ячеек precedents по зависимым.
+ * Путь по ребрам графа проходит вершины с возрастающими номерами, поэтому
+ * вершины с номером больше наибольшего номера precedents не обходятся
+*/
+bool DependencyGraph::CreatesCycle(Id id, const std::vector<Id>& precedents,
+                                   const std::vector<Id>& dependents) const
+{
+    std::vector<Id> targets = precedents;
+    std::sort(targets.begin(), targets.end());
+    if (std::binary_search(targets.begin(), targets.end(), id)) {
+        return true;
+    }
+
+    // Вершины без ребер недостижимы
+    std::optional<uint32_t> upper;
+    for (const Id target : targets) {
+        if (const auto it = order_.find(target); it != order_.end()) {
+            upper = std::max(upper.value_or(0), it->second);
+        }
+    }
+    if (!upper) {
+        return false;
+    }
+
+    std::vector<Id> stack = dependents;
+    dependents_.ForEach(id, [&stack](Id dependent) { stack.push_back(dependent); });
+    std::unordered_set<Id> visited;
+
+    while (!stack.empty()) {
+        const Id current = stack.back();
+        stack.pop_back();
+
+        if (std::binary_search(targets.begin(), targets.end(), current)) {
+            return true;
+        }
+        if (!visited.insert(current).second) {
+            continue;
+        }
+
+        const auto it = order_.find(current);
+        if (it == order_.end() || it->second > *upper) {
+            continue;
+        }
+        dependents_.ForEach(current, [&stack](Id dependent) { stack.push_back(dependent); });
+    }
+
+    return false;
+}
+
+/**
+ * Упорядочивает вершины по номерам топологического порядка
+*/
+void DependencyGraph::SortTopologically(std::vector<Id>& ids) const {
+    std::sort(ids.begin(), ids.end(), [this](Id lhs, Id rhs) {
+        return GetOrder(lhs) < GetOrder(rhs);
+    });
+}
+
+/**
+ * Возвращает true, если формула id ссылается на другие ячейки
+*/
+bool DependencyGraph::HasPrecedents(Id id) const {
+    return !precedents_.IsEmpty(id);
+}
+/**
+ * Возвращает true, если на ячейку id ссылаются формулы
+*/
+bool DependencyGraph::HasDependents(Id id) const {
+    return !dependents_.IsEmpty(id);
+}
+
+size_t DependencyGraph::GetEdgeCount() const {
+    return precedents_.GetEdgeCount();
+}
+size_t DependencyGraph::GetMemoryUsage() const {
+    // Узел хеш-таблицы порядка: указатель на следующий, вершина и номер
+    const size_t order_bytes = order_.bucket_count() * sizeof(void*)
+        + order_.size() * (sizeof(void*) + sizeof(std::pair<const Id, uint32_t>));
+    return precedents_.GetMemoryUsage() + dependents_.GetMemoryUsage() + order_bytes;
+}
+
+void DependencyGraph::Compact() {
+    precedents_.Compact();
+    dependents_.Compact();
+}
+void DependencyGraph::Clear() {
+    precedents_.Clear();
+    dependents_.Clear();
+    order_.clear();
+    next_order_ = 0;
+}
+
+/**
+ * Возвращает номер вершины в порядке; вершины без ребер ничем
+ * не ограничены и получают нулевой номер
+*/
+uint32_t DependencyGraph::GetOrder(Id id) const {
+    const auto it = order_.find(id);
+    return it != order_.end() ? it->second : 0;
+}
+/**
+ * Ставит новую вершину в конец порядка
+*/
+uint32_t DependencyGraph::AddToOrder(Id id) {
+    if (next_order_ == std::numeric_limits<uint32_t>::max()) {
+        RenumberOrder();
+    }
+
+    order_[id] = next_order_;
+    return next_order_++;
+}
+/**
+ * Восстанавливает порядок после добавления ребра from -> to (алгоритм
+ * Пирса-Келли). Если from уже раньше to, ничего не делает. Иначе находит
+ * вершины между to и from: достижимые из to по зависимым и ведущие к from
+ * по ссылкам, - и раздает их номера заново, ставя вторые перед первыми
+*/
+void DependencyGraph::Reorder(Id from, Id to) {
+    const uint32_t lower = GetOrder(to);
+    const uint32_t upper = GetOrder(from);
+    if (upper < lower) {
+        return;
+    }
+
+    std::unordered_set<Id> visited;
+    std::vector<Id> stack;
+
+    // Вершины, зависящие от to, с номерами меньше номера from
+    std::vector<Id> forward;
+    stack.push_back(to);
+    visited.insert(to);
+    while (!stack.empty()) {
+        const Id current = stack.back();
+        stack.pop_back();
+        forward.push_back(current);
+
+        dependents_.ForEach(current, [&](Id dependent) {
+            if (GetOrder(dependent) < upper && visited.insert(dependent).second) {
+                stack.push_back(dependent);
+            }
+        });
+    }
+
+    // Вершины, от которых зависит from, с номерами больше номера to
+    std::vector<Id> backward;
+    stack.push_back(from);
+    visited.insert(from);
+    while (!stack.empty()) {
+        const Id current = stack.back();
+        stack.pop_back();
+        backward.push_back(current);
+
+        precedents_.ForEach(current, [&](Id precedent) {
+            if (GetOrder(precedent) > lower && visited.insert(precedent).second) {
+                stack.push_back(precedent);
+            }
+        });
+    }
+
+    const auto by_order = [this](Id lhs, Id rhs) { return GetOrder(lhs) < GetOrder(rhs); };
+    std::sort(forward.begin(), forward.end(), by_order);
+    std::sort(backward.begin(), backward.end(), by_order);
+
+    std::vector<uint32_t> numbers;
+    numbers.reserve(forward.size() + backward.size());
+    for (const Id id : backward) {
+        numbers.push_back(GetOrder(id));
+    }
+    for (const Id id : forward) {
+        numbers.push_back(GetOrder(id));
+    }
+    std::sort(numbers.begin(), numbers.end());
+
+    size_t next = 0;
+    for (const Id id : backward) {
+        order_[id] = numbers[next++];
+    }
+    for (const Id id : forward) {
+        order_[id] = numbers[next++];
+    }
+}
+/**
+ * Вычисляет порядок всех вершин заново (алгоритм Кана)
+*/
+void DependencyGraph::RebuildOrder() {
+    order_.clear();
+    next_order_ = 0;
+
+    // Количество еще не упорядоченных ячеек, на которые ссылается вершина
+    std::unordered_map<Id, uint32_t> waiting;
+    precedents_.ForEachEdge([&waiting](Id id, Id target) {
+        ++waiting[id];
+        waiting.try_emplace(target, 0);
+    });
+
+    std::vector<Id> ready;
+    for (const auto& [id, count] : waiting) {
+        if (count == 0) {
+            ready.push_back(id);
+        }
+    }
+    while (!ready.empty()) {
+        const Id id = ready.back();
+        ready.pop_back();
+        order_[id] = next_order_++;
+
+        dependents_.ForEach(id, [&](Id dependent) {
+            if (--waiting[dependent] == 0) {
+                ready.push_back(dependent);
+            }
+        });
+    }
+}
+/**
+ * Раздает вершинам номера подряд с нуля, сохраняя порядок
+*/
+void DependencyGraph::RenumberOrder() {
+    std::vector<std::pair<uint32_t, Id>> numbered;
+    numbered.reserve(order_.size());
+    for (const auto& [id, number] : order_) {
+        numbered.emplace_back(number, id);
+    }
+    std::sort(numbered.begin(), numbered.end());
+
+    next_order_ = 0;
+    for (const auto& [number, id] : numbered) {
+        order_[id] = next_order_++;
+    }
+}
+/**
+ * Убирает из порядка вершину, у которой не осталось ребер
+*/
+void DependencyGraph::DropIfIsolated(Id id) {
+    if (precedents_.IsEmpty(id) && dependents_.IsEmpty(id)) {
+        order_.erase(id);
+    }
+}
+
+/**
+ * Возвращает true, если список вершины id пуст
+*/
+bool DependencyGraph::Adjacency::IsEmpty(Id id) const {
+    if (!edits_.empty()) {
+        if (const auto it = edits_.find(id); it != edits_.end()) {
+            return it->second.empty();
+        }
+    }
+
+    const auto [begin, end] = FindBase(id);
+    return begin == end;
+}
+
+/**
+ * Заменяет список вершины id
+*/
+void DependencyGraph::Adjacency::Assign(Id id, std::vector<Id> targets) {
+    std::vector<Id>& list = Edit(id);
+    edge_count_ += targets.size() - list.size();
+    edit_count_ += targets.size() + 1;
+    list = std::move(targets);
+
+    CompactIfNeeded();
+}
+/**
+ * Добавляет ребро id -> target, которого еще нет в графе
+*/
+void DependencyGraph::Adjacency::Add(Id id, Id target) {
+    Edit(id).push_back(target);
+    ++edge_count_;
+    ++edit_count_;
+
+    CompactIfNeeded();
+}
+/**
+ * Удаляет ребро id -> target, если оно есть. Порядок списка не сохраняется
+*/
+void DependencyGraph::Adjacency::Remove(Id id, Id target) {
+    std::vector<Id>& list = Edit(id);
+    const auto it = std::find(list.begin(), list.end(), target);
+    if (it == list.end()) {
+        return;
+    }
+
+    *it = list.back();
+    list.pop_back();
+    --edge_count_;
+    ++edit_count_;
+}
+
+/**
+ * Возвращает приблизительный объем памяти списков смежности в байтах
+*/
+size_t DependencyGraph::Adjacency::GetMemoryUsage() const {
+    size_t bytes = (nodes_.capacity() + targets_.capacity()) * sizeof(Id)
+        + offsets_.capacity() * sizeof(uint32_t)
+        + edits_.bucket_count() * sizeof(void*);
+    for (const auto& [id, list] : edits_) {
+        // Узел хеш-таблицы: указатель на следующий, ключ и вектор
+        bytes += sizeof(void*) + sizeof(std::pair<const Id, std::vector<Id>>)
+            + list.capacity() * sizeof(Id);
+    }
+    return bytes;
+}
+
+/**
+ * Собирает CSR из списка ребер, упорядочивая его
+*/
+void DependencyGraph::Adjacency::Build(std::vector<std::pair<Id, Id>>& edges) {
+    std::sort(edges.begin(), edges.end());
+
+    Clear();
+    nodes_.reserve(edges.size());
+    targets_.reserve(edges.size());
+    for (size_t i = 0; i < edges.size(); ++i) {
+        if (i == 0 || edges[i].first != edges[i - 1].first) {
+            nodes_.push_back(edges[i].first);
+            offsets_.push_back(static_cast<uint32_t>(i));
+        }
+        targets_.push_back(edges[i].second);
+    }
+    offsets_.push_back(static_cast<uint32_t>(edges.size()));
+    nodes_.shrink_to_fit();
+    offsets_.shrink_to_fit();
+    edge_count_ = edges.size();
+}
+
+/**
+ * Собирает CSR заново из его списков, не затронутых правками,
+ * и списков буфера правок
+*/
+void DependencyGraph::Adjacency::Compact() {
+    if (edits_.empty()) {
+        return;
+    }
+
+    std::vector<Id> nodes;
+    nodes.reserve(nodes_.size() + edits_.size());
+    for (const Id id : nodes_) {
+        if (edits_.count(id) == 0) {
+            nodes.push_back(id);
+        }
+    }
+    for (const auto& [id, list] : edits_) {
+        if (!list.empty()) {
+            nodes.push_back(id);
+        }
+    }
+    std::sort(nodes.begin(), nodes.end());
+
+    std::vector<uint32_t> offsets;
+    offsets.reserve(nodes.size() + 1);
+    std::vector<Id> targets;
+    targets.reserve(edge_count_);
+    for (const Id id : nodes) {
+        offsets.push_back(static_cast<uint32_t>(targets.size()));
+        ForEach(id, [&targets](Id target) { targets.push_back(target); });
+    }
+    offsets.push_back(static_cast<uint32_t>(targets.size()));
+
+    nodes_ = std::move(nodes);
+    offsets_ = std::move(offsets);
+    targets_ = std::move(targets);
+    edits_.clear();
+    edit_count_ = 0;
+}
+void DependencyGraph::Adjacency::Clear() {
+    nodes_.clear();
+    offsets_.clear();
+    targets_.clear();
+    edits_.clear();
+    edit_count_ = 0;
+    edge_count_ = 0;
+}
+
+/**
+ * Находит список вершины id в CSR двоичным поиском
+*/
+std::pair<uint32_t, uint32_t> DependencyGraph::Adjacency::FindBase(Id id) const {
+    const auto it = std::lower_bound(nodes_.begin(), nodes_.end(), id);
+    if (it == nodes_.end() || *it != id) {
+        return { 0, 0 };
+    }
+
+    const size_t index = it - nodes_.begin();
+    return { offsets_[index], offsets_[index + 1] };
+}
+/**
+ * Возвращает изменяемый список вершины id из буфера правок
+*/
+std::vector<DependencyGraph::Id>& DependencyGraph::Adjacency::Edit(Id id) {
+    auto [it, inserted] = edits_.try_emplace(id);
+    if (inserted) {
+        const auto [begin, end] = FindBase(id);
+        it->second.assign(targets_.begin() + begin, targets_.begin() + end);
+    }
+    return it->second;
+}
+/**
+ * Переносит буфер правок в CSR, когда число правок стало сравнимо с CSR.
+ * Перенос линеен по числу ребер, поэтому его стоимость в пересчете на
+ * одну правку постоянна. Скопированные в буфер списки не считаются:
+ * иначе каждая правка вершины с большим списком вызывала бы перенос
+*/
+void DependencyGraph::Adjacency::CompactIfNeeded() {
+    if (edit_count_ >= MIN_EDITS_TO_COMPACT && edit_count_ >= targets_.size() / 2) {
+        Compact();
+    }
+}
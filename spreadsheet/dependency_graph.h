@@ -0,0 +1,170 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Граф зависимостей ячеек таблицы.
+// Вершины - упакованные 32-битные идентификаторы позиций, поэтому ребрам не
+// нужны объекты Cell: формула может ссылаться на пустую позицию или на число
+// колоночного хранилища. Связи хранятся в обоих направлениях (от формулы к
+// ячейкам, на которые она ссылается, и обратно) сжатыми списками смежности
+// (CSR). Изменения копятся в буфере правок и переносятся в CSR одним
+// проходом, когда буфер становится сравним с ним по размеру.
+//
+// Граф поддерживает топологический порядок вершин (ячейка раньше формул,
+// которые на нее ссылаются) инкрементально, алгоритмом Пирса-Келли: ребро,
+// согласное с порядком, его не меняет, а для несогласного переупорядочивается
+// только область между концами ребра. Той же границей ограничен поиск циклов.
+class DependencyGraph {
+public:
+    using Id = uint32_t;
+
+    static Id ToId(Position pos) {
+        return static_cast<Id>(pos.row) * Position::MAX_COLS + static_cast<Id>(pos.col);
+    }
+    static Position ToPosition(Id id) {
+        return { static_cast<int>(id / Position::MAX_COLS), static_cast<int>(id % Position::MAX_COLS) };
+    }
+
+    // Заменяет список ячеек, на которые ссылается формула id.
+    // Новые ребра не должны образовывать циклов, см. CreatesCycle()
+    void SetPrecedents(Id id, std::vector<Id> precedents);
+    // Заменяет списки нескольких различных формул. Большой пакет (например,
+    // при загрузке таблицы) собирается в CSR сразу, без буфера правок,
+    // а порядок вычисляется заново
+    void SetPrecedents(std::vector<std::pair<Id, std::vector<Id>>> formulas);
+    // Добавляет ссылку формулы to на ячейку from, если ее еще нет
+    void AddEdge(Id from, Id to);
+
+    // Возвращает true, если граф получит цикл, когда формула id будет
+    // ссылаться на precedents, а формулы dependents - на нее (вдобавок к
+    // имеющимся зависимым). Прежние ссылки формулы id не учитываются.
+    // Обходятся только вершины, лежащие в порядке не дальше ссылок
+    bool CreatesCycle(Id id, const std::vector<Id>& precedents,
+                      const std::vector<Id>& dependents) const;
+
+    // Упорядочивает вершины топологически: каждая - раньше формул,
+    // которые на нее ссылаются
+    void SortTopologically(std::vector<Id>& ids) const;
+
+    // Вызывает func(Id) для каждой ячейки, на которую ссылается формула id
+    template <typename Func>
+    void ForEachPrecedent(Id id, Func func) const {
+        precedents_.ForEach(id, func);
+    }
+    // Вызывает func(Id) для каждой формулы, ссылающейся на ячейку id
+    template <typename Func>
+    void ForEachDependent(Id id, Func func) const {
+        dependents_.ForEach(id, func);
+    }
+
+    bool HasPrecedents(Id id) const;
+    bool HasDependents(Id id) const;
+
+    // Количество ребер графа
+    size_t GetEdgeCount() const;
+    // Объем памяти, занятой списками смежности и порядком, в байтах
+    size_t GetMemoryUsage() const;
+
+    // Переносит буфер правок в CSR
+    void Compact();
+    void Clear();
+
+private:
+    // Списки смежности одного направления
+    class Adjacency {
+    public:
+        template <typename Func>
+        void ForEach(Id id, Func func) const;
+        bool IsEmpty(Id id) const;
+
+        void Assign(Id id, std::vector<Id> targets);
+        void Add(Id id, Id target);
+        void Remove(Id id, Id target);
+
+        size_t GetEdgeCount() const { return edge_count_; }
+        size_t GetMemoryUsage() const;
+
+        // Вызывает func(Id id, Id target) для всех ребер
+        template <typename Func>
+        void ForEachEdge(Func func) const;
+
+        // Заменяет все списки ребрами edges (пары вершина - цель) без повторов
+        void Build(std::vector<std::pair<Id, Id>>& edges);
+        void Compact();
+        void Clear();
+
+    private:
+        // Границы списка вершины id в targets_; пустой список, если его нет в CSR
+        std::pair<uint32_t, uint32_t> FindBase(Id id) const;
+        // Список вершины id в буфере правок, скопированный из CSR при первой правке
+        std::vector<Id>& Edit(Id id);
+        void CompactIfNeeded();
+
+        std::vector<Id> nodes_; // Вершины CSR с непустыми списками по возрастанию
+        std::vector<uint32_t> offsets_; // Начало списка каждой вершины в targets_ и общий конец
+        std::vector<Id> targets_; // Списки смежности вершин подряд
+
+        // Буфер правок: актуальные списки вершин, измененных после последнего
+        // переноса в CSR. Пустой список скрывает удаленный список CSR
+        std::unordered_map<Id, std::vector<Id>> edits_;
+        size_t edit_count_ = 0; // Количество правок ребер после последнего переноса
+        size_t edge_count_ = 0; // Количество ребер с учетом правок
+    };
+
+    // Номер вершины в топологическом порядке, создаваемый по требованию
+    uint32_t GetOrder(Id id) const;
+    uint32_t AddToOrder(Id id);
+    void InsertEdge(Id from, Id to);
+    void Reorder(Id from, Id to);
+    void RebuildOrder();
+    void RenumberOrder();
+    void DropIfIsolated(Id id);
+
+    Adjacency precedents_; // Формула -> ячейки, на которые она ссылается
+    Adjacency dependents_; // Ячейка -> формулы, которые на нее ссылаются
+
+    // Топологический порядок вершин, имеющих ребра: номера возрастают
+    // от ячеек к формулам, которые на них ссылаются. Номера не обязаны
+    // идти подряд: новая вершина получает номер в конце порядка
+    std::unordered_map<Id, uint32_t> order_;
+    uint32_t next_order_ = 0; // Номер для следующей новой вершины
+};
+
+template <typename Func>
+void DependencyGraph::Adjacency::ForEachEdge(Func func) const {
+    for (size_t index = 0; index < nodes_.size(); ++index) {
+        if (edits_.count(nodes_[index]) != 0) {
+            continue;
+        }
+        for (uint32_t i = offsets_[index]; i < offsets_[index + 1]; ++i) {
+            func(nodes_[index], targets_[i]);
+        }
+    }
+    for (const auto& [id, list] : edits_) {
+        for (const Id target : list) {
+            func(id, target);
+        }
+    }
+}
+
+template <typename Func>
+void DependencyGraph::Adjacency::ForEach(Id id, Func func) const {
+    if (!edits_.empty()) {
+        if (const auto it = edits_.find(id); it != edits_.end()) {
+            for (const Id target : it->second) {
+                func(target);
+            }
+            return;
+        }
+    }
+
+    const auto [begin, end] = FindBase(id);
+    for (uint32_t i = begin; i < end; ++i) {
+        func(targets_[i]);
+    }
+}
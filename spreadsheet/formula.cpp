@@ -33,33 +33,46 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe) {
 
 namespace {
 
+// Отсортированный список различных валидных ячеек формулы
+void CollectReferencedCells(const FormulaAST& ast, std::pmr::vector<Position>& cells) {
+    Position prev_cell = Position::NONE;
+    for (Position cell : ast.GetCells()) {
+        if (cell.IsValid()
+            && !(cell == prev_cell))
+        {
+            cells.push_back(std::move(cell));
+            prev_cell = cells.back();
+        }
+    }
+}
+
+// Различные диапазоны формулы
+void CollectReferencedRanges(const FormulaAST& ast, std::pmr::vector<Range>& ranges) {
+    for (const Range& range : ast.GetRanges()) {
+        if (std::find(ranges.begin(), ranges.end(), range) == ranges.end()) {
+            ranges.push_back(range);
+        }
+    }
+}
+
 class Formula : public FormulaInterface {
 public:
-    explicit Formula(std::string expression) 
+    explicit Formula(std::string expression,
+        std::pmr::memory_resource* resource = std::pmr::get_default_resource())
     try
-        : ast_(ParseFormulaAST(expression))
+        : ast_(ParseFormulaAST(expression, resource))
+        , referenced_cells_(resource)
+        , referenced_ranges_(resource)
     {
-        Position prev_cell = Position::NONE;
-        for (Position cell : ast_.GetCells()) {
-            if (cell.IsValid()
-                && !(cell == prev_cell))
-            {
-                referenced_cells_.push_back(std::move(cell));
-                prev_cell = referenced_cells_.back();
-            }
-        }
+        CollectReferencedCells(ast_, referenced_cells_);
+        CollectReferencedRanges(ast_, referenced_ranges_);
     }
     catch (std::exception& ex) {
         throw FormulaException(ex.what());
     }
 
     Value Evaluate(const SheetInterface& sheet) const override {
-        try {
-            return ast_.Execute(sheet);
-        }
-        catch (FormulaError& error) {
-            return error;
-        }
+        return ast_.Execute(sheet);
     }
 
     std::string GetExpression() const override {
@@ -69,16 +82,106 @@ public:
     }
 
     std::vector<Position> GetReferencedCells() const override {
-        return referenced_cells_;
+        return { referenced_cells_.begin(), referenced_cells_.end() };
+    }
+
+    std::vector<Range> GetReferencedRanges() const override {
+        return { referenced_ranges_.begin(), referenced_ranges_.end() };
     }
 
 private:
     FormulaAST ast_;
-    std::vector<Position> referenced_cells_;
+    std::pmr::vector<Position> referenced_cells_;
+    std::pmr::vector<Range> referenced_ranges_;
+};
+
+class RelativeFormula : public RelativeFormulaInterface {
+public:
+    RelativeFormula(std::string expression, Position anchor,
+                    std::pmr::memory_resource* resource)
+    try
+        : ast_(ParseFormulaAST(expression, resource))
+        , referenced_cells_(resource)
+        , referenced_ranges_(resource)
+    {
+        CollectReferencedCells(ast_, referenced_cells_);
+        CollectReferencedRanges(ast_, referenced_ranges_);
+
+        ast_.MakeRelative(anchor);
+        for (Position& cell : referenced_cells_) {
+            cell = { cell.row - anchor.row, cell.col - anchor.col };
+        }
+        for (Range& range : referenced_ranges_) {
+            range.first = { range.first.row - anchor.row, range.first.col - anchor.col };
+            range.last = { range.last.row - anchor.row, range.last.col - anchor.col };
+        }
+    }
+    catch (std::exception& ex) {
+        throw FormulaException(ex.what());
+    }
+
+    Value Evaluate(const SheetInterface& sheet, Position anchor) const override {
+        return ast_.Execute(sheet, anchor);
+    }
+
+    std::string GetExpression(Position anchor) const override {
+        std::stringstream ss;
+        ast_.PrintFormula(ss, anchor);
+        return ss.str();
+    }
+
+    void EvaluateRows(const SheetInterface& sheet, Position anchor, size_t count,
+                      Value* results) const override {
+        std::vector<double> values(count);
+        std::unique_ptr<bool[]> computed(new bool[count]);
+        ast_.ExecuteRows(sheet, anchor, count, values.data(), computed.get());
+
+        for (size_t i = 0; i < count; ++i) {
+            results[i] = computed[i]
+                ? Value(values[i])
+                : Evaluate(sheet, { anchor.row + static_cast<int>(i), anchor.col });
+        }
+    }
+
+    std::vector<Position> GetReferencedCells(Position anchor) const override {
+        std::vector<Position> cells;
+        cells.reserve(referenced_cells_.size());
+        for (Position cell : referenced_cells_) {
+            cells.push_back({ cell.row + anchor.row, cell.col + anchor.col });
+        }
+        return cells;
+    }
+
+    std::vector<Range> GetReferencedRanges(Position anchor) const override {
+        std::vector<Range> ranges;
+        ranges.reserve(referenced_ranges_.size());
+        for (const Range& range : referenced_ranges_) {
+            ranges.push_back({
+                { range.first.row + anchor.row, range.first.col + anchor.col },
+                { range.last.row + anchor.row, range.last.col + anchor.col },
+            });
+        }
+        return ranges;
+    }
+
+private:
+    FormulaAST ast_;
+    // Смещения относительно якоря
+    std::pmr::vector<Position> referenced_cells_;
+    std::pmr::vector<Range> referenced_ranges_;
 };
 
 }  // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     return std::make_unique<Formula>(std::move(expression));
-}
\ No newline at end of file
+}
+
+PoolPtr<RelativeFormulaInterface> ParseRelativeFormula(std::string expression, Position anchor,
+                                                       std::pmr::memory_resource* resource) {
+    return MakePooled<RelativeFormula>(resource, std::move(expression), anchor, resource);
+}
+
+std::string GetRelativeExpression(std::string_view expression, Position anchor) {
+    return MakeRelativeExpression(expression, anchor);
+}
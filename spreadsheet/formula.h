@@ -1,14 +1,20 @@
 #pragma once
 
+#include "arena.h"
 #include "common.h"
 
 #include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
 #include <vector>
 
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Агрегатные функции над ячейками и диапазонами: SUM(A1:A10,C1)+MAX(B1:B10),
+//   также AVERAGE, MIN и COUNT
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -32,10 +38,49 @@ public:
 
     // Возвращает список ячеек, которые непосредственно задействованы в вычислении
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек.
+    // ячеек. Диапазоны не разворачиваются в списки ячеек: их возвращает
+    // GetReferencedRanges().
     virtual std::vector<Position> GetReferencedCells() const = 0;
+    // Различные диапазоны, на которые ссылается формула
+    virtual std::vector<Range> GetReferencedRanges() const = 0;
+};
+
+// Формула, ссылки которой хранятся смещениями относительно позиции-якоря,
+// как в нотации R1C1. Один объект используется всеми ячейками диапазона,
+// заполненного копированием формулы: =B2*C2 в D2 и =B3*C3 в D3 - это одна
+// формула R[0]C[-2]*R[0]C[-1], вычисляемая относительно D2 и D3.
+class RelativeFormulaInterface {
+public:
+    using Value = FormulaInterface::Value;
+
+    virtual ~RelativeFormulaInterface() = default;
+
+    // Методы аналогичны методам FormulaInterface для формулы,
+    // ссылки которой отсчитываются от позиции anchor
+    virtual Value Evaluate(const SheetInterface& sheet, Position anchor) const = 0;
+    virtual std::string GetExpression(Position anchor) const = 0;
+
+    // Вычисляет формулу для count ячеек столбца, начиная с anchor: results[i] -
+    // значение формулы относительно { anchor.row + i, anchor.col }. Строки
+    // вычисляются вместе над массивами значений операндов; по отдельности -
+    // только строки с ошибками и текстом в операндах
+    virtual void EvaluateRows(const SheetInterface& sheet, Position anchor, size_t count,
+                              Value* results) const = 0;
+
+    // Как и в FormulaInterface, ячейки, на которые формула ссылается по
+    // отдельности, и диапазоны возвращаются раздельно
+    virtual std::vector<Position> GetReferencedCells(Position anchor) const = 0;
+    virtual std::vector<Range> GetReferencedRanges(Position anchor) const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+// Парсит выражение формулы, записанной в ячейке anchor, и возвращает
+// ее относительный вид. Объект формулы и её байт-код размещаются в resource
+PoolPtr<RelativeFormulaInterface> ParseRelativeFormula(std::string expression, Position anchor,
+                                                       std::pmr::memory_resource* resource);
+// Текст формулы, записанной в ячейке anchor, со ссылками в нотации R1C1.
+// Совпадает у формул, которые различаются только сдвигом ссылок вместе
+// с ячейкой. Пустая строка, если выражение синтаксически некорректно
+std::string GetRelativeExpression(std::string_view expression, Position anchor);
\ No newline at end of file
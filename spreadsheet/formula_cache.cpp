@@ -0,0 +1,89 @@
+#include "formula_cache.h"
+
+
+/**
+ * Запись кэша. Принадлежит ячейкам, использующим формулу, и при удалении
+ * последней из них исключает себя из индексов кэша
+*/
+class FormulaCache::Entry : public std::enable_shared_from_this<FormulaCache::Entry> {
+public:
+    Entry(FormulaCache& cache, PoolPtr<RelativeFormulaInterface> formula, Position anchor,
+          std::string_view relative_text, std::string_view absolute_text)
+        : cache_(cache)
+        , formula_(std::move(formula))
+        , anchor_(anchor)
+        , relative_text_(relative_text, cache.resource_)
+        , absolute_text_(absolute_text, cache.resource_)
+    {}
+    ~Entry() {
+        cache_.relative_index_.erase(relative_text_);
+        cache_.absolute_index_.erase(absolute_text_);
+    }
+
+    std::string_view GetRelativeText() const {
+        return relative_text_;
+    }
+    std::string_view GetAbsoluteText() const {
+        return absolute_text_;
+    }
+
+    // Формула, которая при вычислении относительно anchor
+    // ссылается на те же ячейки, что и формула в ячейке pos
+    AnchoredFormula GetFormula(Position anchor) {
+        // Указатель разделяет владение записью
+        return { FormulaPtr(shared_from_this(), formula_.get()), anchor };
+    }
+    AnchoredFormula GetFormula() {
+        return GetFormula(anchor_);
+    }
+
+private:
+    FormulaCache& cache_;
+    PoolPtr<RelativeFormulaInterface> formula_;
+    Position anchor_; // Ячейка, по формуле которой создана запись
+    std::pmr::string relative_text_;
+    std::pmr::string absolute_text_; // Канонический текст относительно anchor_
+};
+
+FormulaCache::FormulaCache(std::pmr::memory_resource* resource)
+    : resource_(resource)
+{}
+
+/**
+ * Возвращает формулу expression ячейки pos из кэша, при промахе разбирает ее
+*/
+FormulaCache::AnchoredFormula FormulaCache::Acquire(std::string_view expression, Position pos) {
+    // Та же формула, скопированная в другую ячейку
+    std::string relative_text = GetRelativeExpression(expression, pos);
+    if (auto it = relative_index_.find(relative_text); it != relative_index_.end()) {
+        ++stats_.hits;
+        return it->second->GetFormula(pos);
+    }
+    // Та же формула с теми же ссылками в другой ячейке
+    if (auto it = absolute_index_.find(expression); it != absolute_index_.end()) {
+        ++stats_.hits;
+        return it->second->GetFormula();
+    }
+
+    ++stats_.misses;
+    PoolPtr<RelativeFormulaInterface> formula =
+        ParseRelativeFormula(std::string(expression), pos, resource_);
+
+    // Текст мог отличаться от канонического, например лишними скобками
+    const std::string absolute_text = formula->GetExpression(pos);
+    relative_text = GetRelativeExpression(absolute_text, pos);
+    if (auto it = relative_index_.find(relative_text); it != relative_index_.end()) {
+        return it->second->GetFormula(pos);
+    }
+    if (auto it = absolute_index_.find(absolute_text); it != absolute_index_.end()) {
+        return it->second->GetFormula();
+    }
+
+    auto entry = std::allocate_shared<Entry>(
+        std::pmr::polymorphic_allocator<Entry>(resource_),
+        *this, std::move(formula), pos, relative_text, absolute_text);
+    relative_index_.emplace(entry->GetRelativeText(), entry.get());
+    absolute_index_.emplace(entry->GetAbsoluteText(), entry.get());
+
+    return entry->GetFormula();
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "arena.h"
+#include "common.h"
+#include "formula.h"
+
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Статистика обращений к кэшу формул
+struct FormulaCacheStats {
+    size_t hits = 0; // Формула найдена в кэше, разбор не выполнялся
+    size_t misses = 0; // Формула разобрана
+};
+
+// Кэш разобранных формул таблицы со счетчиками ссылок.
+// Формулы хранятся в относительном виде, поэтому один объект используется
+// как ячейками с одинаковым текстом формулы, так и ячейками диапазона,
+// заполненного копированием формулы (=B2*C2, =B3*C3, ...). Синтаксическое
+// дерево и список ячеек формулы хранятся в единственном экземпляре.
+// Формула удаляется из кэша вместе с последней ссылкой на нее.
+class FormulaCache {
+public:
+    using FormulaPtr = std::shared_ptr<const RelativeFormulaInterface>;
+
+    // Формула и позиция, относительно которой ее нужно вычислять
+    struct AnchoredFormula {
+        FormulaPtr formula;
+        Position anchor;
+    };
+
+    // Формулы и служебные данные кэша размещаются в resource
+    explicit FormulaCache(std::pmr::memory_resource* resource);
+
+    FormulaCache(const FormulaCache&) = delete;
+    FormulaCache& operator=(const FormulaCache&) = delete;
+
+    // Возвращает формулу expression (текст без знака '='), записанную
+    // в ячейке pos. Разбирает ее, только если в кэше нет ни формулы с тем же
+    // относительным текстом, ни формулы с тем же абсолютным текстом.
+    // Бросает FormulaException, если формула синтаксически некорректна
+    AnchoredFormula Acquire(std::string_view expression, Position pos);
+
+    // Количество различных формул в кэше
+    size_t GetSize() const {
+        return relative_index_.size();
+    }
+
+    const FormulaCacheStats& GetStats() const {
+        return stats_;
+    }
+
+private:
+    class Entry;
+
+    std::pmr::memory_resource* resource_;
+    // Записи по относительному тексту формулы (см. GetRelativeExpression)
+    // и по ее каноническому тексту относительно якоря записи.
+    // Ключи указывают на текст, хранящийся в записи
+    std::unordered_map<std::string_view, Entry*> relative_index_;
+    std::unordered_map<std::string_view, Entry*> absolute_index_;
+    FormulaCacheStats stats_;
+};
@@ -1,6 +1,12 @@
+#include <chrono>
+#include <iostream>
 #include <limits>
+#include <random>
+#include <thread>
+#include "FormulaAST.h"
 #include "common.h"
 #include "formula.h"
+#include "sheet.h"
 #include "test_runner_p.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
@@ -345,9 +351,1999 @@ void TestCellCircularReferences() {
     ASSERT(caught);
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
+
+void TestSparseStorage() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "first");
+    sheet->SetCell("XFD16384"_pos, "last");
+
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{Position::MAX_ROWS, Position::MAX_COLS}));
+    ASSERT_EQUAL(sheet->GetCell("XFD16384"_pos)->GetText(), "last");
+    ASSERT(sheet->GetCell("XFD1"_pos) == nullptr);
+    ASSERT(sheet->GetCell("A16384"_pos) == nullptr);
+    ASSERT(sheet->GetCell("ZZ700"_pos) == nullptr);
+
+    // Печать ячеек, лежащих в разных тайлах
+    auto small = CreateSheet();
+    small->SetCell("C2"_pos, "x");
+    small->SetCell("BM2"_pos, "=1+2");
+    small->SetCell("BN70"_pos, "y");
+
+    std::ostringstream expected_texts;
+    std::ostringstream expected_values;
+    for (int row = 0; row < 70; ++row) {
+        for (int col = 0; col < 66; ++col) {
+            if (col != 0) {
+                expected_texts << '\t';
+                expected_values << '\t';
+            }
+            if (row == 1 && col == 2) {
+                expected_texts << "x";
+                expected_values << "x";
+            }
+            else if (row == 1 && col == 64) {
+                expected_texts << "=1+2";
+                expected_values << "3";
+            }
+            else if (row == 69 && col == 65) {
+                expected_texts << "y";
+                expected_values << "y";
+            }
+        }
+        expected_texts << '\n';
+        expected_values << '\n';
+    }
+
+    std::ostringstream texts;
+    small->PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), expected_texts.str());
+
+    std::ostringstream values;
+    small->PrintValues(values);
+    ASSERT_EQUAL(values.str(), expected_values.str());
+}
+
+void TestNumericCells() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+    sheet->SetCell("A2"_pos, "1.50");
+    sheet->SetCell("A3"_pos, "-0.25");
+    sheet->SetCell("B1"_pos, "1e+20");
+
+    std::ostringstream texts;
+    sheet->PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "2\t1e+20\n1.50\t\n-0.25\t\n");
+
+    std::ostringstream values;
+    sheet->PrintValues(values);
+    ASSERT_EQUAL(values.str(), "2\t1e+20\n1.50\t\n-0.25\t\n");
+
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "2");
+    ASSERT_EQUAL(std::get<std::string>(sheet->GetCell("A3"_pos)->GetValue()), "-0.25");
+
+    // Формула видит числа и пересчитывается при их изменении
+    sheet->SetCell("C1"_pos, "=A1+A2+A3");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(3.25));
+    sheet->SetCell("A1"_pos, "4");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(5.25));
+    sheet->SetCell("A1"_pos, "text");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Value));
+
+    // Число заменяется формулой и текстом
+    sheet->SetCell("B1"_pos, "=1/4");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.25));
+    sheet->SetCell("B1"_pos, "7");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "7");
+
+    sheet->ClearCell("B1"_pos);
+    ASSERT(sheet->GetCell("B1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{3, 3}));
+}
+
+void TestCellPointerStability() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "5");
+    sheet.SetCell("A2"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+C1");
+
+    // Объекты, выданные для числа и для пустой позиции со ссылками,
+    // показывают новое содержимое после изменения позиции
+    const CellInterface* a1 = sheet.GetCell("A1"_pos);
+    const CellInterface* c1 = sheet.GetCell("C1"_pos);
+    sheet.SetCell("A1"_pos, "7");
+    ASSERT(sheet.GetCell("A1"_pos) == a1);
+    ASSERT_EQUAL(a1->GetValue(), CellInterface::Value(std::string("7")));
+    sheet.SetCell("C1"_pos, "text");
+    ASSERT(sheet.GetCell("C1"_pos) == c1);
+    ASSERT_EQUAL(c1->GetValue(), CellInterface::Value(std::string("text")));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+
+    // Число становится формулой, текстом и снова числом
+    sheet.SetCells({ { "A1"_pos, "=A2*3" } });
+    ASSERT(sheet.GetCell("A1"_pos) == a1);
+    ASSERT_EQUAL(a1->GetValue(), CellInterface::Value(3.0));
+    sheet.SetCell("C1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(5.0));
+    sheet.SetCell("A1"_pos, "8");
+    ASSERT(sheet.GetCell("A1"_pos) == a1);
+    ASSERT_EQUAL(a1->GetText(), "8");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+
+    // Откат транзакции возвращает прежнее содержимое в тот же объект
+    const CellInterface* a2 = sheet.GetCell("A2"_pos);
+    sheet.BeginTransaction();
+    sheet.SetCell("A2"_pos, "4");
+    sheet.Rollback();
+    ASSERT(sheet.GetCell("A2"_pos) == a2);
+    ASSERT_EQUAL(a2->GetText(), "1");
+
+    // Объект числа, которое не выдавалось, не создается
+    sheet.SetCell("A3"_pos, "1");
+    sheet.SetCell("A3"_pos, "2");
+    ASSERT(sheet.FindCell("A3"_pos) == nullptr);
+
+    // Очистка позиции освобождает ее объект
+    sheet.ClearCell("A1"_pos);
+    ASSERT(sheet.FindCell("A1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+}
+
+void TestPooledAllocation() {
+    Sheet sheet;
+    constexpr int count = 10000;
+
+    const AllocationStats before = sheet.GetAllocationStats();
+    for (int i = 0; i < count; ++i) {
+        sheet.SetCell(Position{ i, 1 }, "=A" + std::to_string(i + 1) + "*2+A1");
+        sheet.SetCell(Position{ i, 2 }, "label " + std::to_string(i));
+    }
+    const AllocationStats loaded = sheet.GetAllocationStats();
+
+    // Ячейки, реализации, множества зависимостей и деревья формул
+    // берутся из пула крупными блоками
+    ASSERT(loaded.allocations - before.allocations < count / 10);
+    ASSERT(loaded.bytes_in_use > 0);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell(Position{ 5, 1 })->GetValue()), 0.0);
+
+    sheet.Clear();
+    ASSERT_EQUAL(sheet.GetAllocationStats().bytes_in_use, 0u);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 0, 0 }));
+    ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+
+    sheet.SetCell("A1"_pos, "3");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 6.0);
+}
+
+void TestInternedText() {
+    Sheet sheet;
+    for (int i = 0; i < 1000; ++i) {
+        sheet.SetCell(Position{ i, 0 }, i % 2 == 0 ? "OK" : "N/A");
+    }
+    sheet.SetCell("B1"_pos, "'OK");
+    sheet.SetCell("B2"_pos, "'=N/A");
+
+    ASSERT_EQUAL(sheet.GetStringPool().GetSize(), 3u);
+
+    auto value_id = [&](Position pos) {
+        return dynamic_cast<Cell*>(sheet.GetCell(pos))->GetValueId();
+    };
+    ASSERT(value_id("A1"_pos).has_value());
+    ASSERT(value_id("A1"_pos) == value_id("A999"_pos));
+    ASSERT(value_id("A1"_pos) == value_id("B1"_pos));
+    ASSERT(value_id("A1"_pos) != value_id("A2"_pos));
+
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "'OK");
+    ASSERT_EQUAL(std::get<std::string>(sheet.GetCell("B1"_pos)->GetValue()), "OK");
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "'=N/A");
+    ASSERT_EQUAL(std::get<std::string>(sheet.GetCell("B2"_pos)->GetValue()), "=N/A");
+
+    // Строка удаляется из пула вместе с последней ссылкой на нее
+    sheet.ClearCell("B2"_pos);
+    ASSERT_EQUAL(sheet.GetStringPool().GetSize(), 2u);
+    for (int i = 1; i < 1000; i += 2) {
+        sheet.SetCell(Position{ i, 0 }, "=1");
+    }
+    ASSERT_EQUAL(sheet.GetStringPool().GetSize(), 1u);
+}
+
+void TestPrintableSizeOnClear() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "a");
+    sheet->SetCell("C5"_pos, "=A1");
+    sheet->SetCell("XFD16384"_pos, "corner");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ Position::MAX_ROWS, Position::MAX_COLS }));
+
+    sheet->ClearCell("XFD16384"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 5, 3 }));
+
+    // Пустая ячейка, на которую ссылается формула, не входит в печатную область
+    sheet->SetCell("B7"_pos, "=D9");
+    sheet->ClearCell("B7"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 5, 3 }));
+
+    // Очистка столбца снизу вверх
+    for (int row = 0; row < 2000; ++row) {
+        sheet->SetCell(Position{ row, 5 }, std::to_string(row));
+    }
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 2000, 6 }));
+    for (int row = 1999; row >= 0; --row) {
+        sheet->ClearCell(Position{ row, 5 });
+    }
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 5, 3 }));
+
+    // Запись пустого текста также сужает печатную область
+    sheet->SetCell("C5"_pos, "");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 1, 1 }));
+    sheet->ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 0, 0 }));
+}
+
+void TestInvalidationFromEmptyCell() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=B1+1");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(1.0));
+
+    sheet->SetCell("B1"_pos, "5");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(6.0));
+}
+
+void TestBulkLoad() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("D1"_pos, "=C1*10");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    sheet.SetCells({
+        { "C1"_pos, "=B1+A1" },
+        { "B1"_pos, "=A1*2" },
+        { "A2"_pos, "label" },
+        { "A1"_pos, "2" },
+        { "E5"_pos, "=A1" },
+        { "E5"_pos, "=A1+1" },
+    });
+
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(4.0));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(60.0));
+    ASSERT_EQUAL(sheet.GetCell("E5"_pos)->GetText(), "=A1+1");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 5, 5 }));
+
+    // Загрузка с циклами отклоняется целиком и сообщает обо всех ячейках циклов
+    try {
+        sheet.SetCells({
+            { "F1"_pos, "7" },
+            { "A1"_pos, "=D1" },
+            { "G1"_pos, "=G1" },
+            { "H1"_pos, "=A1" },
+        });
+        ASSERT(false);
+    } catch (const CircularDependencyException& ex) {
+        ASSERT_EQUAL(std::string(ex.what()),
+                     "Circular dependency detected: A1, B1, C1, D1, G1");
+    }
+    ASSERT(sheet.GetCell("F1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "2");
+
+    // Синтаксическая ошибка также не меняет таблицу
+    try {
+        sheet.SetCells({ { "F1"_pos, "7" }, { "F2"_pos, "=1+" } });
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    ASSERT(sheet.GetCell("F1"_pos) == nullptr);
+}
+
+void TestTransactions() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+1");
+    sheet.SetCell("C1"_pos, "=B1*A1");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    // Зависимые ячейки инвалидируются при подтверждении транзакции
+    sheet.BeginTransaction();
+    sheet.SetCell("A1"_pos, "3");
+    sheet.SetCell("D1"_pos, "=C1");
+    sheet.Commit();
+    ASSERT(!sheet.IsInTransaction());
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(12.0));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(12.0));
+
+    // Откат возвращает прежнее содержимое и освобождает новые позиции
+    sheet.BeginTransaction();
+    sheet.SetCell("A1"_pos, "text");
+    sheet.SetCell("B1"_pos, "=A1*10");
+    sheet.SetCell("Z9"_pos, "new");
+    sheet.ClearCell("D1"_pos);
+    sheet.Rollback();
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "3");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1+1");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=C1");
+    ASSERT(sheet.GetCell("Z9"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(12.0));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 4 }));
+
+    // Циклическая зависимость внутри транзакции откатывает ее целиком
+    sheet.BeginTransaction();
+    sheet.SetCell("A1"_pos, "5");
+    try {
+        sheet.SetCell("A1"_pos, "=D1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT(!sheet.IsInTransaction());
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "3");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(12.0));
+
+    // Как и синтаксическая ошибка в формуле
+    sheet.BeginTransaction();
+    sheet.SetCell("E1"_pos, "x");
+    try {
+        sheet.SetCell("E2"_pos, "=1+");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    ASSERT(!sheet.IsInTransaction());
+    ASSERT(sheet.GetCell("E1"_pos) == nullptr);
+
+    try {
+        sheet.Commit();
+        ASSERT(false);
+    } catch (const std::logic_error&) {
+    }
+}
+
+void TestFormulaDeepNesting() {
+    // Глубина стека вычислений больше встроенного буфера стековой машины
+    std::string expression = "2-1";
+    for (int i = 3; i <= 100; ++i) {
+        expression = std::to_string(i) + "-(" + expression + ")";
+    }
+    auto formula = ParseFormula(expression);
+    ASSERT_EQUAL(formula->GetExpression(), expression);
+    ASSERT_EQUAL(std::get<double>(formula->Evaluate(*CreateSheet())), 50.0);
+
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "0");
+    sheet->SetCell("B1"_pos, "=-(+A1+2)/(3*-A1)");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "=-(+A1+2)/(3*-A1)");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Div0));
+    sheet->SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(4.0 / 6.0));
+}
+
+void TestFormulaOptimization() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "4");
+
+    // Текст формулы не зависит от оптимизации
+    auto formula = ParseFormula("A1*(2*3)+0-(--A1)*1/+1");
+    ASSERT_EQUAL(formula->GetExpression(), "A1*2*3+0---A1*1/+1");
+    ASSERT_EQUAL(std::get<double>(formula->Evaluate(*sheet)), 20.0);
+
+    // Ошибки в константных подвыражениях сохраняются
+    ASSERT_EQUAL(std::get<FormulaError>(ParseFormula("A1+1/0")->Evaluate(*sheet)),
+                 FormulaError(FormulaError::Category::Div0));
+    ASSERT_EQUAL(std::get<FormulaError>(ParseFormula("A1*(1e308*10)")->Evaluate(*sheet)),
+                 FormulaError(FormulaError::Category::Div0));
+    ASSERT_EQUAL(std::get<FormulaError>(ParseFormula("A1/(2-2)")->Evaluate(*sheet)),
+                 FormulaError(FormulaError::Category::Div0));
+
+    // Сложение с нулем не сохраняет знак -0 у отрицания пустой ячейки
+    {
+        auto zero_sheet = CreateSheet();
+        zero_sheet->SetCell("B1"_pos, "=-A1+0");
+        std::ostringstream values;
+        zero_sheet->PrintValues(values);
+        ASSERT_EQUAL(values.str(), "\t0\n");
+        for (const std::string text : { "-A1+0", "0+-A1", "-A1-(-0)" }) {
+            const double value = std::get<double>(ParseFormula(text)->Evaluate(*zero_sheet));
+            ASSERT(value == 0.0 && !std::signbit(value));
+        }
+        const double negative = std::get<double>(ParseFormula("-A1+(-0)-0")->Evaluate(*zero_sheet));
+        ASSERT(negative == 0.0 && std::signbit(negative));
+    }
+
+    // Повторные ссылки на ячейку
+    sheet->SetCell("B1"_pos, "=A1*A1-A1/A1+B2");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(15.0));
+    ASSERT_EQUAL(ParseFormula("A1*A1-A1")->GetReferencedCells(),
+                 std::vector<Position>{ "A1"_pos });
+}
+
+// Случайная формула грамматики Formula.g4 с произвольными пробелами
+std::string GenerateFormula(std::mt19937& random, int depth) {
+    static const std::vector<std::string> atoms = {
+        "0", "7", "42", "3.25", ".5", "1e3", "2E-2", "6e+1", "1.5e2",
+        "A1", "B12", "ZZ7", "XFD16384", "AAA1", "XFE1", "A16385", "A0", "A01",
+        "SUM(A1:B2)", "MAX(A1, C3:B2)", "COUNT(XFD1:A1)", "MIN(A0:A1)", "AVERAGE( A1 :B2 ,C3 )",
+    };
+    static const std::string operations = "+-*/";
+
+    std::string space(std::uniform_int_distribution<int>(0, 3)(random) == 0 ? 1 : 0, ' ');
+    switch (depth > 0 ? std::uniform_int_distribution<int>(0, 4)(random) : 0) {
+        case 0:
+            return space + atoms[std::uniform_int_distribution<size_t>(0, atoms.size() - 1)(random)];
+        case 1:
+            return space + operations[std::uniform_int_distribution<int>(0, 1)(random)]
+                + GenerateFormula(random, depth - 1);
+        case 2:
+            return "(" + GenerateFormula(random, depth - 1) + space + ")";
+        default:
+            return GenerateFormula(random, depth - 1) + space
+                + operations[std::uniform_int_distribution<int>(0, 3)(random)]
+                + GenerateFormula(random, depth - 1);
+    }
+}
+
+// Результат разбора формулы: дерево в префиксной записи и список ячеек
+// либо "error", если формула отвергнута
+std::string DescribeParse(const std::string& text, FormulaParserKind parser) {
+    try {
+        FormulaAST ast = ParseFormulaAST(text, std::pmr::get_default_resource(), parser);
+        std::ostringstream out;
+        ast.Print(out);
+        out << " | ";
+        ast.PrintCells(out);
+        return out.str();
+    } catch (const std::exception&) {
+        return "error";
+    }
+}
+
+void TestNativeParserMatchesAntlr() {
+    std::mt19937 random(2024);
+    const std::string alphabet = "+-*/()1.eE5AZ :,";
+
+    int rejected = 0;
+    for (int i = 0; i < 2000; ++i) {
+        std::string text = GenerateFormula(random, 5);
+
+        // Часть формул портится, чтобы сравнить и обработку ошибок
+        if (i % 3 == 0) {
+            const size_t pos = std::uniform_int_distribution<size_t>(0, text.size())(random);
+            const char c = alphabet[std::uniform_int_distribution<size_t>(0, alphabet.size() - 1)(random)];
+            text.insert(text.begin() + pos, c);
+        }
+
+        const std::string native = DescribeParse(text, FormulaParserKind::Native);
+        ASSERT_EQUAL(native, DescribeParse(text, FormulaParserKind::Antlr));
+        rejected += native == "error";
+    }
+    ASSERT(rejected > 0);
+
+    ASSERT_EQUAL(DescribeParse("-1*2+3/-A1", FormulaParserKind::Native),
+                 "(+ (* (- 1) 2) (/ 3 (- A1))) | A1 ");
+    ASSERT_EQUAL(DescribeParse("SUM(B2:A1,C3)*2", FormulaParserKind::Native),
+                 "(* SUM(A1:B2,C3) 2) | ");
+    for (const std::string text : { "", "1.", "1e", "A", "a1", "1 2", "(1", "1)", "1.5.5", "A1B2",
+                                    "SUM", "SUM()", "SUM(1)", "SUM(A1:)", "SUMA(A1)", "A1:B2" }) {
+        ASSERT_EQUAL(DescribeParse(text, FormulaParserKind::Native), "error");
+    }
+}
+
+void TestRangeFunctions() {
+    Sheet sheet;
+    for (int row = 0; row < 100; ++row) {
+        sheet.SetCell(Position{ row, 0 }, std::to_string(row + 1));
+    }
+    sheet.SetCell("B1"_pos, "=SUM(A1:A100)");
+    sheet.SetCell("B2"_pos, "=AVERAGE(A1:A100)+MIN(A1:A100)*MAX(A100:A1)");
+    sheet.SetCell("B3"_pos, "=COUNT(A1:A100,C1)");
+    sheet.SetCell("B4"_pos, "=SUM(C1:D10)+MIN(C1)");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 5050.0);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B2"_pos)->GetValue()), 50.5 + 100.0);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B3"_pos)->GetValue()), 100.0);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B4"_pos)->GetValue()), 0.0);
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=AVERAGE(A1:A100)+MIN(A1:A100)*MAX(A1:A100)");
+
+    // Числа диапазона не превращаются в объекты ячеек
+    ASSERT(sheet.FindCell("A50"_pos) == nullptr);
+    // Диапазоны не разворачиваются в списки ячеек
+    ASSERT(sheet.GetCell("B3"_pos)->GetReferencedCells().empty());
+    ASSERT(sheet.FindCell("B3"_pos)->GetReferencedRanges()
+           == (std::vector<Range>{ { "A1"_pos, "A100"_pos }, { "C1"_pos, "C1"_pos } }));
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetReferencedCells(), std::vector<Position>{});
+    sheet.SetCell("AA1"_pos, "=COUNT(B1:Z16000)");
+    ASSERT(sheet.GetCell("AA1"_pos)->GetReferencedCells().empty());
+
+    // Изменение числа, формулы или текста в диапазоне инвалидирует агрегаты
+    sheet.SetCell("A50"_pos, "0");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 5000.0);
+    sheet.SetCell("A50"_pos, "=A1*50");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 5050.0);
+    sheet.SetCell("A1"_pos, "11");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 5050.0 + 10.0 + 500.0);
+    sheet.SetCell("A1"_pos, "'1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 5050.0);
+    sheet.SetCell("A2"_pos, "text");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B3"_pos)->GetValue()), 99.0);
+    sheet.ClearCell("A2"_pos);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 5048.0);
+
+    sheet.SetCell("C1"_pos, "=1/0");
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B3"_pos)->GetValue()), 99.0);
+    sheet.SetCell("E1"_pos, "=AVERAGE(E2:E5)");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+
+    // Скопированные формулы с диапазонами разделяют относительный вид
+    const size_t cached = sheet.GetFormulaCache().GetSize();
+    sheet.SetCell("F1"_pos, "=SUM(A1:A2)");
+    sheet.SetCells({ { "F3"_pos, "=SUM(A3:A4)" } });
+    ASSERT_EQUAL(sheet.GetFormulaCache().GetSize(), cached + 1);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("F1"_pos)->GetValue()), 1.0);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("F3"_pos)->GetValue()), 7.0);
+    ASSERT_EQUAL(sheet.GetCell("F3"_pos)->GetText(), "=SUM(A3:A4)");
+
+    // Циклы через диапазоны
+    const auto is_circular = [](auto set) {
+        try {
+            set();
+        } catch (const CircularDependencyException&) {
+            return true;
+        }
+        return false;
+    };
+    ASSERT(is_circular([&] { sheet.SetCell("B5"_pos, "=SUM(B1:B10)"); }));
+    ASSERT(is_circular([&] { sheet.SetCell("A3"_pos, "=MAX(B1)"); }));
+    ASSERT(is_circular([&] { sheet.SetCells({ { "G1"_pos, "=SUM(G2:G3)" }, { "G3"_pos, "=G1" } }); }));
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 5048.0);
+
+    // Функции доступны и через ParseFormula
+    auto formula = ParseFormula("COUNT(A1:B2)");
+    ASSERT(formula->GetReferencedCells().empty());
+    ASSERT(formula->GetReferencedRanges() == (std::vector<Range>{ { "A1"_pos, "B2"_pos } }));
+}
+
+void TestBatchEvaluation() {
+    // Одинаковые таблицы: в первой формулы вычисляются пакетами,
+    // во второй - по одной
+    Sheet batch;
+    Sheet single;
+    for (Sheet* sheet : { &batch, &single }) {
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = 0; row < 300; ++row) {
+            const std::string index = std::to_string(row + 1);
+            cells.push_back({ Position{ row, 0 }, std::to_string(row % 17 + 1) });
+            cells.push_back({ Position{ row, 1 }, std::to_string(row % 5) });
+            cells.push_back({ Position{ row, 2 }, "=A" + index + "*B" + index });
+            cells.push_back({ Position{ row, 3 }, "=A" + index + "/B" + index + "-1" });
+        }
+        cells.push_back({ "B10"_pos, "text" });
+        cells.push_back({ "A30"_pos, "'5" });
+        cells.push_back({ "A40"_pos, "=1/0" });
+        cells.push_back({ "B50"_pos, "" });
+        cells.push_back({ "A100"_pos, "=C99" });
+        sheet->SetCells(std::move(cells));
+    }
+
+    batch.EvaluateRange({ "C1"_pos, "D300"_pos });
+    for (int row = 0; row < 300; ++row) {
+        for (int col = 2; col <= 3; ++col) {
+            const Position pos = { row, col };
+            ASSERT(static_cast<const Cell*>(batch.FindCell(pos))->HasCachedValue());
+            ASSERT_EQUAL(batch.GetCell(pos)->GetValue(), single.GetCell(pos)->GetValue());
+        }
+    }
+    // Числовые операнды читаются без создания объектов ячеек
+    ASSERT(batch.FindCell("A5"_pos) == nullptr);
+    ASSERT_EQUAL(batch.GetCell("C30"_pos)->GetValue(), CellInterface::Value(5.0 * (29 % 5)));
+    ASSERT_EQUAL(batch.GetCell("C40"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+
+    // Строки, ссылки которых выходят за пределы таблицы, дают #REF!
+    auto formula = ParseRelativeFormula("A1*2", "B2"_pos, std::pmr::get_default_resource());
+    std::vector<FormulaInterface::Value> results(3);
+    formula->EvaluateRows(batch, "B1"_pos, results.size(), results.data());
+    ASSERT(results[0] == FormulaInterface::Value(FormulaError::Category::Ref));
+    ASSERT(results[1] == FormulaInterface::Value(2.0));
+    ASSERT(results[2] == FormulaInterface::Value(4.0));
+}
+
+void TestFormulaCache() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    for (int row = 1; row <= 100; ++row) {
+        sheet.SetCell(Position{ row, 0 }, "=A1*1.5");
+    }
+    sheet.SetCell("B1"_pos, "=(A1)*1.5");
+    sheet.SetCells({ { "B2"_pos, "=A1*1.5" }, { "B3"_pos, "=A1+1" } });
+
+    const FormulaCache& cache = sheet.GetFormulaCache();
+    ASSERT_EQUAL(cache.GetSize(), 2u);
+    ASSERT_EQUAL(cache.GetStats().misses, 3u);
+    ASSERT_EQUAL(cache.GetStats().hits, 100u);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1*1.5");
+    ASSERT_EQUAL(sheet.GetCell("A50"_pos)->GetValue(), CellInterface::Value(3.0));
+
+    // Формула удаляется из кэша вместе с последней ячейкой, которая ее использует
+    sheet.ClearCell("B3"_pos);
+    ASSERT_EQUAL(cache.GetSize(), 1u);
+    sheet.Clear();
+    ASSERT_EQUAL(cache.GetSize(), 0u);
+
+    // Диапазон, заполненный копированием формулы, использует одну формулу
+    for (int row = 1; row <= 1000; ++row) {
+        const std::string suffix = std::to_string(row + 1);
+        sheet.SetCell(Position{ row, 1 }, std::to_string(row));
+        sheet.SetCell(Position{ row, 2 }, "2");
+        sheet.SetCell(Position{ row, 3 }, row % 2 == 0
+            ? "=B" + suffix + "*C" + suffix
+            : "=(B" + suffix + " * C" + suffix + ")");
+    }
+    ASSERT_EQUAL(cache.GetSize(), 1u);
+    ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT_EQUAL(sheet.GetCell("D1001"_pos)->GetValue(), CellInterface::Value(2000.0));
+    ASSERT_EQUAL(sheet.GetCell("D777"_pos)->GetText(), "=B777*C777");
+    ASSERT_EQUAL(sheet.GetCell("D777"_pos)->GetReferencedCells(),
+                 (std::vector<Position>{ "B777"_pos, "C777"_pos }));
+
+    sheet.SetCell("B500"_pos, "1");
+    ASSERT_EQUAL(sheet.GetCell("D500"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT_EQUAL(sheet.GetCell("D501"_pos)->GetValue(), CellInterface::Value(1000.0));
+}
+
+void TestErrorPropagation() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "text");
+    sheet.SetCell("A2"_pos, "nan");
+    sheet.SetCell("A3"_pos, " 2.5");
+    sheet.SetCell("B1"_pos, "=A1+1/0");
+    sheet.SetCell("B2"_pos, "=1/0+A1");
+    sheet.SetCell("B3"_pos, "=-A1*0");
+    sheet.SetCell("B4"_pos, "=A2+B2");
+    sheet.SetCell("B5"_pos, "=A3*2");
+    sheet.SetCell("B6"_pos, "=SUM(A3)+MAX(A1:A3)");
+    sheet.SetCell("B7"_pos, "=1e308*10-1e308*10");
+    sheet.SetCell("C1"_pos, "=A1/0");
+    sheet.SetCell("C2"_pos, "=A1/Z9");
+    sheet.SetCell("C3"_pos, "=A1/(1-1)");
+    sheet.SetCell("C4"_pos, "=1/A1");
+
+    // Ошибки передаются в порядке вычисления операндов слева направо
+    const auto error = [](FormulaError::Category category) {
+        return CellInterface::Value(FormulaError(category));
+    };
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), error(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), error(FormulaError::Category::Div0));
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), error(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), error(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetValue(), CellInterface::Value(5.0));
+    ASSERT_EQUAL(sheet.GetCell("B6"_pos)->GetValue(), error(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet.GetCell("B7"_pos)->GetValue(), error(FormulaError::Category::Div0));
+
+    // Делитель проверяется раньше делимого: текст, деленный на ноль, дает #DIV/0!
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), error(FormulaError::Category::Div0));
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), error(FormulaError::Category::Div0));
+    ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), error(FormulaError::Category::Div0));
+    ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetValue(), error(FormulaError::Category::Value));
+}
+
+void TestNumericText() {
+    Sheet sheet;
+    sheet.SetCells({
+        { "A1"_pos, " 12" },
+        { "A2"_pos, "1.50" },
+        { "A3"_pos, "1e3" },
+        { "A4"_pos, "'7" },
+        { "A5"_pos, "12abc" },
+        { "A6"_pos, "'" },
+        { "A7"_pos, "42" },
+        { "B1"_pos, "=A1+A2+A3+A4" },
+        { "B2"_pos, "=A5+1" },
+        { "B3"_pos, "=A6" },
+        { "B4"_pos, "=SUM(A1:A4)" },
+        { "B5"_pos, "=COUNT(A1:A7)" },
+    });
+
+    // Число 42 хранится числом, а не текстом
+    ASSERT_EQUAL(sheet.CountNumericTextCells(), 4u);
+    ASSERT(static_cast<const Cell*>(sheet.GetCell("A2"_pos))->IsNumericText());
+    ASSERT(!static_cast<const Cell*>(sheet.GetCell("A5"_pos))->IsNumericText());
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(std::string("1.50")));
+
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(1020.5));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), CellInterface::Value(1020.5));
+    ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetValue(), CellInterface::Value(5.0));
+
+    sheet.SetCell("A2"_pos, "n/a");
+    ASSERT_EQUAL(sheet.CountNumericTextCells(), 3u);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+}
+
+void TestValueView() {
+    Sheet sheet;
+    sheet.SetCells({
+        { "A1"_pos, "text" },
+        { "A2"_pos, "'=escaped" },
+        { "A3"_pos, "2" },
+        { "B1"_pos, "=A3*3" },
+        { "B2"_pos, "=1/0" },
+        { "B3"_pos, "=A1" },
+    });
+    sheet.SetCell("C1"_pos, "");
+
+    using View = CellInterface::ValueView;
+    for (const Position pos : { "A1"_pos, "A2"_pos, "A3"_pos, "B1"_pos, "B2"_pos, "B3"_pos, "C1"_pos }) {
+        const CellInterface* cell = sheet.GetCell(pos);
+        const CellInterface::Value value = cell->GetValue();
+        const View view = cell->GetValueView();
+        ASSERT_EQUAL(value.index(), view.index());
+        if (std::holds_alternative<std::string>(value)) {
+            ASSERT_EQUAL(std::get<std::string>(value), std::get<std::string_view>(view));
+        } else if (std::holds_alternative<double>(value)) {
+            ASSERT_EQUAL(std::get<double>(value), std::get<double>(view));
+        } else {
+            ASSERT_EQUAL(std::get<FormulaError>(value), std::get<FormulaError>(view));
+        }
+    }
+
+    // Текст не копируется: одинаковые значения ссылаются на одну строку пула
+    sheet.SetCell("D1"_pos, "text");
+    const std::string_view a1 = std::get<std::string_view>(sheet.GetCell("A1"_pos)->GetValueView());
+    const std::string_view d1 = std::get<std::string_view>(sheet.GetCell("D1"_pos)->GetValueView());
+    ASSERT(a1.data() == d1.data());
+
+    // Значение формулы читается из кэша ячейки, повторное чтение его не вычисляет
+    const auto* b1 = static_cast<const Cell*>(sheet.GetCell("B1"_pos));
+    ASSERT(b1->HasCachedValue());
+    ASSERT(std::get<double>(b1->GetValueView()) == 6.0);
+}
+
+void TestDependencyGraph() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("A3"_pos, "3");
+    sheet.SetCell("B1"_pos, "=A1+A2");
+    sheet.SetCell("B2"_pos, "=B1*A3");
+    sheet.SetCell("C1"_pos, "=D1+1");
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(9.0));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(1.0));
+    ASSERT_EQUAL(sheet.GetDependencyGraph().GetEdgeCount(), 5u);
+
+    // Ни ссылки, ни вычисление не создают объектов для чисел и пустых позиций
+    for (const Position pos : { "A1"_pos, "A2"_pos, "A3"_pos, "D1"_pos }) {
+        ASSERT(sheet.FindCell(pos) == nullptr);
+    }
+
+    // Изменение числа и заполнение пустой позиции инвалидируют зависимые
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT(sheet.FindCell("A1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(21.0));
+    sheet.SetCell("D1"_pos, "3");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+    sheet.ClearCell("D1"_pos);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(1.0));
+
+    // Формула заменяется числом: ее ссылки удаляются, зависимые видят число.
+    // Объект ячейки, который мог быть выдан GetCell(), сохраняется
+    const CellInterface* b1 = sheet.GetCell("B1"_pos);
+    sheet.SetCell("B1"_pos, "10");
+    ASSERT(sheet.FindCell("B1"_pos) == b1);
+    ASSERT_EQUAL(b1->GetValue(), CellInterface::Value(std::string("10")));
+    ASSERT_EQUAL(sheet.GetDependencyGraph().GetEdgeCount(), 3u);
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(30.0));
+    bool caught = false;
+    try {
+        sheet.SetCell("A3"_pos, "=B2");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "3");
+
+    // Множество правок переносится из буфера в CSR без потери ребер
+    constexpr int ROWS = 10000;
+    Sheet large;
+    large.SetCell("Z1"_pos, "2");
+    for (int row = 0; row < ROWS; ++row) {
+        large.SetCell({ row, 0 }, std::to_string(row));
+        large.SetCell({ row, 1 }, "=A" + std::to_string(row + 1) + "*Z1");
+    }
+    for (int row = 0; row < ROWS; row += 2) {
+        large.SetCell({ row, 1 }, "=A" + std::to_string(row + 1) + "+Z1");
+    }
+    ASSERT_EQUAL(large.GetDependencyGraph().GetEdgeCount(), 2u * ROWS);
+    large.SetCell("Z1"_pos, "3");
+    for (int row = 0; row < ROWS; row += 999) {
+        const double expected = row % 2 == 0 ? row + 3.0 : row * 3.0;
+        ASSERT_EQUAL(large.GetCell({ row, 1 })->GetValue(), CellInterface::Value(expected));
+    }
+}
+
+// Возвращает true, если каждая ссылка формул sheet стоит в топологическом
+// порядке графа раньше формулы
+bool IsTopologicallyOrdered(const Sheet& sheet, const std::vector<Position>& positions) {
+    std::vector<DependencyGraph::Id> ids;
+    for (const Position pos : positions) {
+        ids.push_back(DependencyGraph::ToId(pos));
+    }
+    sheet.GetDependencyGraph().SortTopologically(ids);
+
+    std::unordered_map<DependencyGraph::Id, size_t> index;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        index[ids[i]] = i;
+    }
+    for (const Position pos : positions) {
+        const Cell* cell = sheet.FindCell(pos);
+        if (cell == nullptr) {
+            continue;
+        }
+        std::vector<Position> references = cell->GetReferencedCells();
+        for (const Range& range : cell->GetReferencedRanges()) {
+            for (int row = range.first.row; row <= range.last.row; ++row) {
+                for (int col = range.first.col; col <= range.last.col; ++col) {
+                    references.push_back({ row, col });
+                }
+            }
+        }
+        for (const Position reference : references) {
+            const auto it = index.find(DependencyGraph::ToId(reference));
+            if (it != index.end() && it->second >= index[DependencyGraph::ToId(pos)]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void TestTopologicalOrder() {
+    // Ссылки против порядка создания: каждая новая формула ссылается
+    // на ячейку, ставшую формулой позже
+    Sheet chain;
+    for (int row = 0; row < 50; ++row) {
+        chain.SetCell({ row, 0 }, "=A" + std::to_string(row + 2) + "+1");
+    }
+    ASSERT_EQUAL(chain.GetCell("A1"_pos)->GetValue(), CellInterface::Value(50.0));
+    bool caught = false;
+    try {
+        chain.SetCell("A51"_pos, "=A1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    // Цикл через диапазон
+    Sheet ranges;
+    ranges.SetCell("B1"_pos, "=SUM(A1:A3)");
+    ranges.SetCell("A2"_pos, "=C5");
+    caught = false;
+    try {
+        ranges.SetCell("C5"_pos, "=B1*2");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ranges.SetCell("C5"_pos, "=7");
+    ASSERT_EQUAL(ranges.GetCell("B1"_pos)->GetValue(), CellInterface::Value(7.0));
+
+    // Случайные правки: проверка циклов совпадает с полным обходом,
+    // а порядок остается топологическим
+    constexpr int SIZE = 6;
+    std::mt19937 random(19);
+    Sheet sheet;
+    std::map<Position, std::vector<Position>> formulas;
+    std::vector<Position> positions;
+    for (int row = 0; row < SIZE; ++row) {
+        for (int col = 0; col < SIZE; ++col) {
+            positions.push_back({ row, col });
+        }
+    }
+    const auto pick = [&] {
+        return positions[std::uniform_int_distribution<size_t>(0, positions.size() - 1)(random)];
+    };
+    const auto reaches = [&formulas](Position from, Position to) {
+        std::vector<Position> stack = { from };
+        std::set<Position> visited;
+        while (!stack.empty()) {
+            const Position current = stack.back();
+            stack.pop_back();
+            if (current == to) {
+                return true;
+            }
+            if (!visited.insert(current).second || formulas.count(current) == 0) {
+                continue;
+            }
+            for (const Position next : formulas.at(current)) {
+                stack.push_back(next);
+            }
+        }
+        return false;
+    };
+
+    for (int step = 0; step < 2000; ++step) {
+        const Position target = pick();
+        if (std::uniform_int_distribution<int>(0, 4)(random) == 0) {
+            sheet.SetCell(target, "1");
+            formulas.erase(target);
+        }
+        else {
+            std::vector<Position> references = { pick(), pick() };
+            const bool expected_cycle = reaches(references[0], target) || reaches(references[1], target);
+
+            bool cycle = false;
+            try {
+                sheet.SetCell(target, "=" + references[0].ToString() + "+" + references[1].ToString());
+            } catch (const CircularDependencyException&) {
+                cycle = true;
+            }
+            ASSERT_EQUAL(cycle, expected_cycle);
+            if (!cycle) {
+                formulas[target] = references;
+            }
+        }
+        ASSERT(IsTopologicallyOrdered(sheet, positions));
+    }
+}
+
+// Цепочка из length ячеек нарастающим итогом, уложенная по столбцам:
+// первая ячейка - число, каждая следующая ссылается на предыдущую
+std::vector<std::pair<Position, std::string>> MakeChain(int length) {
+    const auto position = [](int index) {
+        return Position{ index % Position::MAX_ROWS, index / Position::MAX_ROWS };
+    };
+
+    std::vector<std::pair<Position, std::string>> cells;
+    cells.reserve(length);
+    cells.push_back({ position(0), "1" });
+    for (int index = 1; index < length; ++index) {
+        cells.push_back({ position(index), "=" + position(index - 1).ToString() + "+1" });
+    }
+    return cells;
+}
+
+void TestDeepChain() {
+    constexpr int LENGTH = 200000;
+    const Position last = { (LENGTH - 1) % Position::MAX_ROWS, (LENGTH - 1) / Position::MAX_ROWS };
+
+    // Глубина вызовов при чтении, инвалидации и проверке циклов
+    // не зависит от длины цепочки
+    Sheet sheet;
+    sheet.SetCells(MakeChain(LENGTH));
+    ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(static_cast<double>(LENGTH)));
+
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(LENGTH + 4.0));
+
+    bool caught = false;
+    try {
+        sheet.SetCell("A1"_pos, "=" + last.ToString());
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    // Цепочка, построенная по одной ячейке, и ее промежуточная ячейка
+    Sheet single;
+    for (auto& [pos, text] : MakeChain(20000)) {
+        single.SetCell(pos, std::move(text));
+    }
+    ASSERT_EQUAL(single.GetCell("A10000"_pos)->GetValue(), CellInterface::Value(10000.0));
+    ASSERT_EQUAL(single.GetCell({ 20000 - 1 - Position::MAX_ROWS, 1 })->GetValue(), CellInterface::Value(20000.0));
+}
+
+void TestParallelRecalculation() {
+    // Случайная таблица: числа в столбце A и формулы, ссылающиеся на ячейки
+    // левее - отдельными ссылками и диапазонами, с делением на ноль
+    constexpr int ROWS = 300;
+    constexpr int COLS = 12;
+    std::mt19937 random(21);
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < ROWS; ++row) {
+        cells.push_back({ Position{ row, 0 }, std::to_string(row % 7) });
+        for (int col = 1; col < COLS; ++col) {
+            const auto ref = [&] {
+                return Position{ static_cast<int>(random() % ROWS),
+                                 static_cast<int>(random() % col) }.ToString();
+            };
+            std::string text = "=" + ref() + "+" + ref() + "*2";
+            switch (random() % 3) {
+                case 0:
+                    text += "/" + ref();
+                    break;
+                case 1: {
+                    const Position first = { static_cast<int>(random() % (ROWS - 5)), col - 1 };
+                    text += "+SUM(" + first.ToString() + ":"
+                          + Position{ first.row + 4, col - 1 }.ToString() + ")";
+                    break;
+                }
+            }
+            cells.push_back({ Position{ row, col }, std::move(text) });
+        }
+    }
+
+    Sheet lazy;
+    Sheet parallel;
+    lazy.SetCells(cells);
+    parallel.SetCells(std::move(cells));
+
+    const auto check = [&] {
+        for (int row = 0; row < ROWS; ++row) {
+            for (int col = 1; col < COLS; ++col) {
+                ASSERT(static_cast<const Cell*>(parallel.GetCell({ row, col }))->HasCachedValue());
+                ASSERT_EQUAL(parallel.GetCell({ row, col })->GetValue(), lazy.GetCell({ row, col })->GetValue());
+            }
+        }
+    };
+
+    parallel.RecalculateAll(4);
+    check();
+
+    // Пересчитываются только инвалидированные формулы
+    for (int row = 0; row < ROWS; row += 10) {
+        lazy.SetCell({ row, 0 }, std::to_string(row + 1));
+        parallel.SetCell({ row, 0 }, std::to_string(row + 1));
+    }
+    parallel.RecalculateAll(3);
+    check();
+
+    lazy.SetCell("A1"_pos, "=1/0");
+    parallel.SetCell("A1"_pos, "=1/0");
+    parallel.RecalculateAll();
+    check();
+
+    // Таблица без формул
+    Sheet empty;
+    empty.RecalculateAll(8);
+    empty.SetCell("A1"_pos, "text");
+    empty.RecalculateAll(8);
+    ASSERT_EQUAL(empty.GetCell("A1"_pos)->GetValue(), CellInterface::Value(std::string("text")));
+}
+
+void TestRecalcPolicies() {
+    const auto value = [](const Sheet& sheet, Position pos) {
+        return std::get<double>(sheet.FindCell(pos)->GetValueView());
+    };
+    const auto is_dirty = [](const Sheet& sheet, Position pos) {
+        return sheet.FindCell(pos)->IsDirty();
+    };
+
+    // Ленивый пересчет: устаревшая формула хранит прежнее значение
+    // до первого чтения
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    ASSERT(is_dirty(sheet, "B1"_pos));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT(!is_dirty(sheet, "B1"_pos));
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT(is_dirty(sheet, "B1"_pos));
+    ASSERT(sheet.FindCell("B1"_pos)->HasCachedValue());
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 1u);
+    ASSERT_EQUAL(value(sheet, "B1"_pos), 10.0);
+
+    // Немедленный пересчет после изменения и после подтверждения транзакции
+    sheet.SetCell("A1"_pos, "6");
+    sheet.SetRecalcPolicy(Sheet::RecalcPolicy::Eager);
+    ASSERT(!is_dirty(sheet, "B1"_pos));
+    sheet.SetCell("A1"_pos, "7");
+    ASSERT(!is_dirty(sheet, "B1"_pos));
+    ASSERT_EQUAL(value(sheet, "B1"_pos), 14.0);
+    sheet.BeginTransaction();
+    sheet.SetCell("A1"_pos, "8");
+    sheet.SetCell("C1"_pos, "=B1+1");
+    sheet.Commit();
+    ASSERT(!is_dirty(sheet, "B1"_pos) && !is_dirty(sheet, "C1"_pos));
+    ASSERT_EQUAL(value(sheet, "C1"_pos), 17.0);
+
+    // Ручной пересчет: чтение возвращает последнее вычисленное значение,
+    // новая формула вычисляется по нему и остается устаревшей
+    sheet.SetRecalcPolicy(Sheet::RecalcPolicy::Manual);
+    sheet.SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(16.0));
+    sheet.SetCell("D1"_pos, "=C1*10");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(170.0));
+    ASSERT(is_dirty(sheet, "D1"_pos));
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 3u);
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 0u);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(70.0));
+    sheet.SetCell("A1"_pos, "4");
+    sheet.RecalculateAll(2);
+    ASSERT_EQUAL(value(sheet, "D1"_pos), 90.0);
+
+    // Адаптивный пересчет: без чтений изменения не пересчитывают формулы,
+    // при частых чтениях - пересчитывают
+    Sheet adaptive;
+    adaptive.SetRecalcPolicy(Sheet::RecalcPolicy::Adaptive);
+    adaptive.SetCell("B1"_pos, "=A1+1");
+    for (int i = 0; i < 20; ++i) {
+        adaptive.SetCell("A1"_pos, std::to_string(i));
+    }
+    ASSERT(is_dirty(adaptive, "B1"_pos));
+    for (int i = 0; i < 20; ++i) {
+        for (int read = 0; read < 3; ++read) {
+            adaptive.GetCell("B1"_pos)->GetValue();
+        }
+        adaptive.SetCell("A1"_pos, std::to_string(i));
+    }
+    ASSERT(!is_dirty(adaptive, "B1"_pos));
+    ASSERT_EQUAL(value(adaptive, "B1"_pos), 20.0);
+
+    // Список устаревших формул прореживается и не растет без границ
+    Sheet chain;
+    chain.SetCells(MakeChain(5000));
+    for (int round = 0; round < 10; ++round) {
+        chain.SetCell("A1"_pos, std::to_string(round));
+        ASSERT_EQUAL(chain.GetDirtyCount(), 4999u);
+        ASSERT_EQUAL(chain.GetCell("A5000"_pos)->GetValue(), CellInterface::Value(round + 4999.0));
+        ASSERT_EQUAL(chain.GetDirtyCount(), 0u);
+    }
+}
+
+void TestConcurrentReads() {
+    constexpr int ROWS = 500;
+    constexpr int THREADS = 8;
+
+    // Числа, текст, формулы со ссылками и диапазонами и ссылка на пустую позицию
+    const auto fill = [](Sheet& sheet) {
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = 0; row < ROWS; ++row) {
+            const std::string index = std::to_string(row + 1);
+            const std::string prev = std::to_string(row == 0 ? 1 : row);
+            cells.push_back({ Position{ row, 0 }, std::to_string(row % 13) });
+            cells.push_back({ Position{ row, 1 }, "=A" + index + "*2+B" + prev + "/4" });
+            cells.push_back({ Position{ row, 2 }, "=SUM(A1:B" + index + ")-Z1" });
+            cells.push_back({ Position{ row, 3 }, row % 50 == 0 ? "=1/0" : "=C" + index + "/A" + index });
+            cells.push_back({ Position{ row, 4 }, "text " + index });
+        }
+        cells[1].second = "=A1*2";
+        sheet.SetCells(std::move(cells));
+    };
+
+    Sheet sheet;
+    Sheet expected;
+    fill(sheet);
+    fill(expected);
+
+    const auto read_concurrently = [&] {
+        std::ostringstream expected_output;
+        expected.PrintValues(expected_output);
+
+        std::atomic<int> mismatches = 0;
+        std::vector<std::thread> threads;
+        for (int thread = 0; thread < THREADS; ++thread) {
+            threads.emplace_back([&, thread] {
+                const Sheet& reader = sheet;
+                if (thread == 0) {
+                    std::ostringstream output;
+                    reader.PrintValues(output);
+                    mismatches += output.str() != expected_output.str() ? 1 : 0;
+                }
+                // Пакетное вычисление одновременно с вычислением при чтении
+                if (thread == 1) {
+                    reader.EvaluateRange({ { 0, 0 }, { ROWS - 1, 4 } });
+                }
+                // Потоки читают строки в разном порядке
+                for (int i = 0; i < ROWS; ++i) {
+                    const int row = thread % 2 == 0 ? i : ROWS - 1 - i;
+                    for (int col = 0; col < 5; ++col) {
+                        const Position pos = { row, col };
+                        if (!(reader.GetCell(pos)->GetValue() == expected.GetCell(pos)->GetValue())
+                            || reader.GetCell(pos)->GetText() != expected.GetCell(pos)->GetText())
+                        {
+                            ++mismatches;
+                        }
+                    }
+                }
+                // Пустая позиция, на которую ссылаются формулы, а затем число
+                if (reader.GetCell("Z1"_pos) == nullptr
+                    || reader.GetCell("Z1"_pos)->GetText() != expected.GetCell("Z1"_pos)->GetText())
+                {
+                    ++mismatches;
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        ASSERT_EQUAL(mismatches.load(), 0);
+    };
+
+    read_concurrently();
+
+    // Изменения между чтениями: числа, пустая позиция и формула
+    for (Sheet* target : { &sheet, &expected }) {
+        target->SetCell("A1"_pos, "7");
+        target->SetCell("A250"_pos, "100");
+        target->SetCell("Z1"_pos, "3");
+        target->SetCell("B300"_pos, "=A300+Z1");
+    }
+    read_concurrently();
+    ASSERT_EQUAL(sheet.GetCell("A250"_pos)->GetText(), "100");
+    ASSERT(sheet.FindCell("A251"_pos) == nullptr);
+}
+
+void TestSnapshots() {
+    auto sheet = std::make_unique<Sheet>();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "text");
+    sheet->SetCell("B1"_pos, "=A1+1");
+    sheet->SetCell("C1"_pos, "=B1/0");
+    sheet->SetCell("CZ200"_pos, "=A1*10");
+
+    const std::shared_ptr<const SheetSnapshot> first = sheet->Snapshot();
+    ASSERT_EQUAL(first->GetPrintableSize(), (Size{ 200, 104 }));
+    ASSERT_EQUAL(first->GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT_EQUAL(first->GetCell("B1"_pos)->GetText(), "=A1+1");
+    ASSERT_EQUAL(first->GetCell("A1"_pos)->GetValue(), CellInterface::Value(std::string("1")));
+    ASSERT_EQUAL(std::get<double>(first->GetCell("A1"_pos)->GetNumericValue()), 1.0);
+    ASSERT_EQUAL(first->GetCell("C1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+    ASSERT(first->GetCell("CZ200"_pos)->GetReferencedCells() == std::vector<Position>{ "A1"_pos });
+    ASSERT(first->GetCell("D5"_pos) == nullptr);
+    ASSERT(sheet->Snapshot() == first);
+
+    // Снимок доступен только для чтения
+    SheetSnapshot& read_only = const_cast<SheetSnapshot&>(*first);
+    int rejected = 0;
+    try {
+        read_only.SetCell("A1"_pos, "2");
+    } catch (const std::logic_error&) {
+        ++rejected;
+    }
+    try {
+        read_only.ClearCell("A1"_pos);
+    } catch (const std::logic_error&) {
+        ++rejected;
+    }
+    ASSERT_EQUAL(rejected, 2);
+
+    // Изменения не видны в прежней версии; неизменный тайл разделяется
+    sheet->SetCell("A3"_pos, "5");
+    const std::shared_ptr<const SheetSnapshot> second = sheet->Snapshot();
+    ASSERT(second->GetVersion() > first->GetVersion());
+    ASSERT(second->GetCell("A3"_pos) != nullptr && first->GetCell("A3"_pos) == nullptr);
+    ASSERT(second->GetCell("CZ200"_pos) == first->GetCell("CZ200"_pos));
+
+    sheet->SetCell("A1"_pos, "4");
+    sheet->ClearCell("A2"_pos);
+    const std::shared_ptr<const SheetSnapshot> third = sheet->Snapshot();
+    ASSERT_EQUAL(third->GetCell("B1"_pos)->GetValue(), CellInterface::Value(5.0));
+    ASSERT_EQUAL(third->GetCell("CZ200"_pos)->GetValue(), CellInterface::Value(40.0));
+    ASSERT(third->GetCell("A2"_pos) == nullptr);
+    ASSERT_EQUAL(first->GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT_EQUAL(first->GetCell("CZ200"_pos)->GetValue(), CellInterface::Value(10.0));
+    ASSERT_EQUAL(first->GetCell("A2"_pos)->GetText(), "text");
+
+    // Снимок совпадает с таблицей при выводе
+    {
+        std::ostringstream expected_values, expected_texts, values, texts;
+        sheet->PrintValues(expected_values);
+        sheet->PrintTexts(expected_texts);
+        third->PrintValues(values);
+        third->PrintTexts(texts);
+        ASSERT_EQUAL(values.str(), expected_values.str());
+        ASSERT_EQUAL(texts.str(), expected_texts.str());
+    }
+
+    // При ручной политике снимок содержит вычисленные значения, а тайл
+    // устаревшей формулы попадает в снимок после пересчета
+    sheet->SetRecalcPolicy(Sheet::RecalcPolicy::Manual);
+    sheet->SetCell("A1"_pos, "6");
+    ASSERT_EQUAL(sheet->Snapshot()->GetCell("CZ200"_pos)->GetValue(), CellInterface::Value(40.0));
+    sheet->Recalculate();
+    ASSERT_EQUAL(sheet->Snapshot()->GetCell("CZ200"_pos)->GetValue(), CellInterface::Value(60.0));
+    sheet->SetRecalcPolicy(Sheet::RecalcPolicy::Lazy);
+
+    // Снимок переживает таблицу
+    sheet.reset();
+    ASSERT_EQUAL(third->GetCell("B1"_pos)->GetValue(), CellInterface::Value(5.0));
+
+    // Читатели проверяют целостность своих версий, пока таблица изменяется:
+    // в каждой версии все числа столбца A равны, а B1 - их сумма
+    constexpr int ROWS = 200;
+    Sheet writer;
+    for (int row = 0; row < ROWS; ++row) {
+        writer.SetCell({ row, 0 }, "0");
+    }
+    writer.SetCell("B1"_pos, "=SUM(A1:A" + std::to_string(ROWS) + ")");
+
+    std::mutex latest_mutex;
+    std::shared_ptr<const SheetSnapshot> latest = writer.Snapshot();
+    std::atomic<bool> done = false;
+    std::atomic<int> mismatches = 0;
+    std::vector<std::thread> readers;
+    for (int thread = 0; thread < 3; ++thread) {
+        readers.emplace_back([&] {
+            uint64_t last_version = 0;
+            while (!done.load()) {
+                std::shared_ptr<const SheetSnapshot> snapshot;
+                {
+                    std::lock_guard guard(latest_mutex);
+                    snapshot = latest;
+                }
+                const double value = std::get<double>(snapshot->GetCell("A1"_pos)->GetNumericValue());
+                for (int row = 1; row < ROWS; ++row) {
+                    mismatches += snapshot->GetCell({ row, 0 })->GetNumericValue()
+                                  == CellInterface::NumericValue(value) ? 0 : 1;
+                }
+                mismatches += snapshot->GetCell("B1"_pos)->GetValue()
+                              == CellInterface::Value(value * ROWS) ? 0 : 1;
+                mismatches += snapshot->GetVersion() < last_version ? 1 : 0;
+                last_version = snapshot->GetVersion();
+            }
+        });
+    }
+    for (int value = 1; value <= 50; ++value) {
+        writer.BeginTransaction();
+        for (int row = 0; row < ROWS; ++row) {
+            writer.SetCell({ row, 0 }, std::to_string(value));
+        }
+        writer.Commit();
+        std::shared_ptr<const SheetSnapshot> snapshot = writer.Snapshot();
+        std::lock_guard guard(latest_mutex);
+        latest = std::move(snapshot);
+    }
+    done = true;
+    for (std::thread& thread : readers) {
+        thread.join();
+    }
+    ASSERT_EQUAL(mismatches.load(), 0);
+    ASSERT_EQUAL(latest->GetCell("B1"_pos)->GetValue(), CellInterface::Value(50.0 * ROWS));
+
+    // Снимки берутся, пока другой поток записывает числа: сумма в каждом
+    // снимке согласована с его числами
+    constexpr int TILE_ROWS = CellTable::TILE_SIZE;
+    Sheet ingest;
+    for (int row = 0; row < TILE_ROWS; ++row) {
+        ingest.SetCell({ row, 0 }, "0");
+    }
+    ingest.SetCell("B1"_pos, "=SUM(A1:A" + std::to_string(TILE_ROWS) + ")");
+    done = false;
+    std::thread ingestion([&ingest, &done] {
+        for (int i = 0; !done.load(); ++i) {
+            ingest.SetCell({ i % TILE_ROWS, 0 }, std::to_string(i % 100));
+        }
+    });
+    for (int i = 0; i < 200; ++i) {
+        const std::shared_ptr<const SheetSnapshot> snapshot = ingest.Snapshot();
+        double sum = 0;
+        for (int row = 0; row < TILE_ROWS; ++row) {
+            sum += std::get<double>(snapshot->GetCell({ row, 0 })->GetNumericValue());
+        }
+        mismatches += snapshot->GetCell("B1"_pos)->GetValue() == CellInterface::Value(sum) ? 0 : 1;
+    }
+    done = true;
+    ingestion.join();
+    ASSERT_EQUAL(mismatches.load(), 0);
+}
+
+void TestConcurrentWrites() {
+    constexpr int THREADS = 4;
+    constexpr int ROWS = 128;
+    constexpr int REGION_COLS = 32; // Потоки 0 и 1, 2 и 3 пишут в общие тайлы
+    constexpr int OPERATIONS = 3000;
+    constexpr int TOTAL_COL = 200;
+
+    // Позиции потоков не пересекаются; формулы за их областями зависят от
+    // всех потоков - по ссылкам и через диапазон
+    const auto fill = [](Sheet& sheet) {
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = 0; row < ROWS; ++row) {
+            const std::string index = std::to_string(row + 1);
+            for (int col = 0; col < THREADS * REGION_COLS; col += 3) {
+                cells.push_back({ Position{ row, col }, std::to_string(row + col) });
+            }
+            cells.push_back({ Position{ row, TOTAL_COL },
+                              "=SUM(A" + index + ":" + Position{ row, THREADS * REGION_COLS - 1 }.ToString() + ")" });
+            cells.push_back({ Position{ row, TOTAL_COL + 1 },
+                              "=A" + index + "+AG" + index + "+BM" + index + "+CS" + index });
+        }
+        sheet.SetCells(std::move(cells));
+    };
+    // Операции потока: числа, очистка, текст и формулы, ссылающиеся на
+    // столбец левее в той же области
+    const auto run = [](Sheet& sheet, int thread) {
+        std::mt19937 random(thread);
+        for (int i = 0; i < OPERATIONS; ++i) {
+            const int row = static_cast<int>(random() % ROWS);
+            const int offset = static_cast<int>(random() % REGION_COLS);
+            const Position pos{ row, thread * REGION_COLS + offset };
+            const unsigned kind = random() % 20;
+            if (kind < 15) {
+                sheet.SetCell(pos, std::to_string(random() % 1000));
+            }
+            else if (kind < 18) {
+                sheet.ClearCell(pos);
+            }
+            else if (kind < 19 || offset == 0) {
+                sheet.SetCell(pos, "text");
+            }
+            else {
+                sheet.SetCell(pos, "=" + Position{ row, pos.col - 1 }.ToString() + "+1");
+            }
+        }
+    };
+
+    Sheet sheet;
+    Sheet expected;
+    fill(sheet);
+    fill(expected);
+    sheet.GetCell({ 0, TOTAL_COL })->GetValue();
+    sheet.Snapshot();
+
+    // Политика и транзакции меняются одновременно с записями; пустые
+    // транзакции лишь откладывают инвалидацию до подтверждения
+    std::atomic<bool> done = false;
+    std::thread switcher([&sheet, &done] {
+        while (!done) {
+            sheet.SetRecalcPolicy(Sheet::RecalcPolicy::Manual);
+            sheet.BeginTransaction();
+            sheet.Commit();
+            sheet.SetRecalcPolicy(Sheet::RecalcPolicy::Lazy);
+        }
+    });
+    std::vector<std::thread> threads;
+    for (int thread = 0; thread < THREADS; ++thread) {
+        threads.emplace_back(run, std::ref(sheet), thread);
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    done = true;
+    switcher.join();
+    for (int thread = 0; thread < THREADS; ++thread) {
+        run(expected, thread);
+    }
+
+    ASSERT_EQUAL(sheet.GetPrintableSize(), expected.GetPrintableSize());
+    std::ostringstream texts, expected_texts, values, expected_values, snapshot_values;
+    sheet.PrintTexts(texts);
+    expected.PrintTexts(expected_texts);
+    ASSERT_EQUAL(texts.str(), expected_texts.str());
+    sheet.Snapshot()->PrintValues(snapshot_values);
+    sheet.PrintValues(values);
+    expected.PrintValues(expected_values);
+    ASSERT_EQUAL(values.str(), expected_values.str());
+    ASSERT_EQUAL(snapshot_values.str(), expected_values.str());
+}
+
+// Время выполнения func в миллисекундах
+template <typename Func>
+double MeasureMilliseconds(Func func) {
+    const auto start = std::chrono::steady_clock::now();
+    func();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Вычисление таблицы, в которой каждая формула дает ошибку, в сравнении
+// с такой же таблицей без ошибок. Столбец A - текст или числа, столбцы B-D -
+// формулы над ним; кэши сбрасываются перед каждым проходом
+void BenchErrorPropagation() {
+    constexpr int ROWS = 10000;
+    constexpr int ROUNDS = 20;
+
+    const auto measure = [](bool errors) {
+        Sheet sheet;
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = 0; row < ROWS; ++row) {
+            const std::string index = std::to_string(row + 1);
+            cells.push_back({ Position{ row, 0 }, errors ? "n/a" : index });
+            cells.push_back({ Position{ row, 1 }, "=A" + index + "*2+1" });
+            cells.push_back({ Position{ row, 2 }, "=B" + index + "/A" + index });
+            cells.push_back({ Position{ row, 3 }, "=C" + index + "-B" + index + "*3" });
+        }
+        sheet.SetCells(std::move(cells));
+
+        return MeasureMilliseconds([&sheet] {
+            for (int round = 0; round < ROUNDS; ++round) {
+                for (int row = 0; row < ROWS; ++row) {
+                    static_cast<Cell*>(sheet.GetCell({ row, 1 }))->InvalidateCache();
+                    sheet.GetCell({ row, 3 })->GetValue();
+                }
+            }
+        });
+    };
+
+    const double numbers_time = measure(false);
+    const double errors_time = measure(true);
+
+    std::cout << "Error propagation, " << ROWS * 3 << " formulas x " << ROUNDS << " rounds:\n"
+              << "  without errors:          " << numbers_time << " ms\n"
+              << "  every formula an error:  " << errors_time << " ms\n";
+}
+
+// Чтение всех значений текстовой таблицы через GetValue() и через
+// GetValueView(), а также вывод ее значений
+void BenchValueView() {
+    constexpr int ROWS = 10000;
+    constexpr int COLS = 10;
+    constexpr int ROUNDS = 50;
+
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < ROWS; ++row) {
+        for (int col = 0; col < COLS; ++col) {
+            cells.push_back({ Position{ row, col }, "customer name #" + std::to_string(row * COLS + col) });
+        }
+    }
+    sheet.SetCells(std::move(cells));
+
+    size_t copied = 0;
+    const double copy_time = MeasureMilliseconds([&] {
+        for (int round = 0; round < ROUNDS; ++round) {
+            for (int row = 0; row < ROWS; ++row) {
+                for (int col = 0; col < COLS; ++col) {
+                    copied += std::get<std::string>(sheet.GetCell({ row, col })->GetValue()).size();
+                }
+            }
+        }
+    });
+    size_t viewed = 0;
+    const double view_time = MeasureMilliseconds([&] {
+        for (int round = 0; round < ROUNDS; ++round) {
+            for (int row = 0; row < ROWS; ++row) {
+                for (int col = 0; col < COLS; ++col) {
+                    viewed += std::get<std::string_view>(sheet.GetCell({ row, col })->GetValueView()).size();
+                }
+            }
+        }
+    });
+    const double print_time = MeasureMilliseconds([&sheet] {
+        std::ostringstream out;
+        sheet.PrintValues(out);
+    });
+
+    std::cout << "Value reads, " << ROWS * COLS << " text cells x " << ROUNDS << " rounds:\n"
+              << "  GetValue:      " << copy_time << " ms (" << copied << " chars)\n"
+              << "  GetValueView:  " << view_time << " ms (" << viewed << " chars)\n"
+              << "  PrintValues:   " << print_time << " ms\n";
+}
+
+// Таблица около миллиона ссылок: загрузка, память графа зависимостей и
+// инвалидация зависимых при изменении каждого числа
+void BenchDependencyGraph() {
+    constexpr int ROWS = Position::MAX_ROWS;
+    constexpr int COLS = 16;
+
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < ROWS; ++row) {
+        const std::string index = std::to_string(row + 1);
+        const std::string next = std::to_string(row == ROWS - 1 ? 1 : row + 2);
+        cells.push_back({ Position{ row, 0 }, std::to_string(row) });
+        for (int col = 1; col <= COLS; ++col) {
+            const std::string prev = Position{ 0, col - 1 }.ToString();
+            const std::string prev_col = prev.substr(0, prev.size() - 1);
+            cells.push_back({ Position{ row, col },
+                "=A" + index + "+A" + next + "+" + prev_col + index + "+" + prev_col + next });
+        }
+    }
+
+    const double load_time = MeasureMilliseconds([&] {
+        sheet.SetCells(std::move(cells));
+    });
+    const DependencyGraph& graph = sheet.GetDependencyGraph();
+    const size_t edges = graph.GetEdgeCount();
+    const size_t memory = graph.GetMemoryUsage();
+
+    const Range all = { { 0, 0 }, { ROWS - 1, COLS } };
+    sheet.EvaluateRange(all);
+    const double invalidate_time = MeasureMilliseconds([&] {
+        for (int row = 0; row < ROWS; ++row) {
+            sheet.SetCell({ row, 0 }, std::to_string(row + 1));
+        }
+    });
+    const double evaluate_time = MeasureMilliseconds([&] {
+        sheet.EvaluateRange(all);
+    });
+
+    std::cout << "Dependency graph, " << ROWS * COLS << " formulas, " << edges << " edges:\n"
+              << "  load:                " << load_time << " ms\n"
+              << "  graph memory:        " << memory / 1024 << " KiB ("
+              << static_cast<double>(memory) / edges << " bytes per edge)\n"
+              << "  invalidate per edit: " << invalidate_time << " ms for " << ROWS << " edits\n"
+              << "  recalculate:         " << evaluate_time << " ms\n";
+}
+
+// Правки формулы в конце длинной цепочки зависимостей: проверка циклов
+// обходит только часть графа между ячейкой и ее ссылками
+void BenchCycleCheck() {
+    constexpr int ROWS = Position::MAX_ROWS;
+    constexpr int EDITS = 10000;
+
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells;
+    cells.push_back({ "A1"_pos, "1" });
+    for (int row = 1; row < ROWS; ++row) {
+        cells.push_back({ Position{ row, 0 }, "=A" + std::to_string(row) + "+1" });
+    }
+    sheet.SetCells(std::move(cells));
+
+    const Position bottom = { ROWS - 1, 0 };
+    const double edit_time = MeasureMilliseconds([&] {
+        for (int i = 0; i < EDITS; ++i) {
+            sheet.SetCell(bottom, "=A" + std::to_string(ROWS - 1 - i % 100) + "*2");
+        }
+    });
+
+    std::cout << "Cycle check, " << EDITS << " edits at the end of a " << ROWS << "-cell chain: "
+              << edit_time << " ms\n";
+}
+
+// Цепочка из миллиона ячеек нарастающим итогом: первое чтение последней
+// ячейки вычисляет всю цепочку, изменение первой инвалидирует всю цепочку
+void BenchDeepChain() {
+    constexpr int LENGTH = 1000000;
+    const Position last = { (LENGTH - 1) % Position::MAX_ROWS, (LENGTH - 1) / Position::MAX_ROWS };
+
+    Sheet sheet;
+    const double load_time = MeasureMilliseconds([&sheet] {
+        sheet.SetCells(MakeChain(LENGTH));
+    });
+    double value = 0.0;
+    const double read_time = MeasureMilliseconds([&] {
+        value = std::get<double>(sheet.GetCell(last)->GetValue());
+    });
+    const double edit_time = MeasureMilliseconds([&sheet] {
+        sheet.SetCell("A1"_pos, "2");
+    });
+    const double reread_time = MeasureMilliseconds([&] {
+        value += std::get<double>(sheet.GetCell(last)->GetValue());
+    });
+
+    std::cout << "Chain of " << LENGTH << " cells (checksum " << value << "):\n"
+              << "  load:                " << load_time << " ms\n"
+              << "  first read:          " << read_time << " ms\n"
+              << "  edit first cell:     " << edit_time << " ms\n"
+              << "  read after edit:     " << reread_time << " ms\n";
+}
+
+// Пересчет широкой модели: 16 столбцов формул над столбцом чисел, каждая
+// формула ссылается на четыре соседние ячейки предыдущего столбца. Перед
+// каждым замером все числа изменяются, инвалидируя все формулы
+void BenchParallelRecalculation() {
+    constexpr int ROWS = Position::MAX_ROWS;
+    constexpr int COLS = 16;
+
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < ROWS; ++row) {
+        cells.push_back({ Position{ row, 0 }, std::to_string(row % 100) });
+        for (int col = 1; col <= COLS; ++col) {
+            const auto ref = [row, col](int offset) {
+                return Position{ (row + offset) % ROWS, col - 1 }.ToString();
+            };
+            cells.push_back({ Position{ row, col },
+                "=(" + ref(0) + "*4+" + ref(1) + "*3+" + ref(2) + "*2+" + ref(3) + ")/10+1" });
+        }
+    }
+    sheet.SetCells(std::move(cells));
+
+    int round = 0;
+    const auto invalidate = [&] {
+        ++round;
+        for (int row = 0; row < ROWS; ++row) {
+            sheet.SetCell({ row, 0 }, std::to_string((row + round) % 100));
+        }
+    };
+
+    invalidate();
+    const double sequential_time = MeasureMilliseconds([&sheet] {
+        sheet.EvaluateRange({ { 0, 0 }, { ROWS - 1, COLS } });
+    });
+
+    std::cout << "Parallel recalculation, " << ROWS * COLS << " formulas ("
+              << std::thread::hardware_concurrency() << " hardware threads):\n"
+              << "  EvaluateRange:       " << sequential_time << " ms\n";
+    double single_time = 0.0;
+    for (size_t threads : { 1, 2, 4, 8, 16 }) {
+        invalidate();
+        const double time = MeasureMilliseconds([&sheet, threads] {
+            sheet.RecalculateAll(threads);
+        });
+        if (threads == 1) {
+            single_time = time;
+        }
+        std::cout << "  RecalculateAll(" << threads << "):" << std::string(threads < 10 ? 3 : 2, ' ')
+                  << time << " ms (speedup " << single_time / time << ")\n";
+    }
+}
+
+// Политики пересчета на двух нагрузках над моделью из 1000 строк формул
+// и итога по ним: "панель" читает итог после каждого изменения,
+// "загрузка" изменяет все числа подряд и читает итог один раз
+void BenchRecalcPolicies() {
+    constexpr int ROWS = 1000;
+    constexpr int EDITS = 20000;
+
+    const auto make_sheet = [](Sheet::RecalcPolicy policy) {
+        auto sheet = std::make_unique<Sheet>();
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = 0; row < ROWS; ++row) {
+            const std::string index = std::to_string(row + 1);
+            cells.push_back({ Position{ row, 0 }, index });
+            cells.push_back({ Position{ row, 1 }, "=A" + index + "*1.1" });
+            cells.push_back({ Position{ row, 2 }, "=B" + index + "+A" + index });
+            cells.push_back({ Position{ row, 3 }, "=C" + index + "/2" });
+        }
+        cells.push_back({ "E1"_pos, "=SUM(D1:D" + std::to_string(ROWS) + ")" });
+        sheet->SetCells(std::move(cells));
+        sheet->GetCell("E1"_pos)->GetValue();
+        sheet->SetRecalcPolicy(policy);
+        return sheet;
+    };
+
+    const std::pair<const char*, Sheet::RecalcPolicy> policies[] = {
+        { "lazy:    ", Sheet::RecalcPolicy::Lazy },
+        { "eager:   ", Sheet::RecalcPolicy::Eager },
+        { "adaptive:", Sheet::RecalcPolicy::Adaptive },
+    };
+    std::cout << "Recalculation policies, " << EDITS << " edits of a " << ROWS << "-row model:\n";
+    for (const auto& [name, policy] : policies) {
+        double total = 0.0;
+        double read_time = 0.0;
+        {
+            auto sheet = make_sheet(policy);
+            total = MeasureMilliseconds([&] {
+                for (int i = 0; i < EDITS; ++i) {
+                    sheet->SetCell({ i % ROWS, 0 }, std::to_string(i));
+                    read_time += MeasureMilliseconds([&] {
+                        sheet->GetCell("E1"_pos)->GetValue();
+                    });
+                }
+            });
+        }
+        auto sheet = make_sheet(policy);
+        const double ingest_time = MeasureMilliseconds([&] {
+            for (int i = 0; i < EDITS; ++i) {
+                sheet->SetCell({ i % ROWS, 0 }, std::to_string(i));
+            }
+            sheet->GetCell("E1"_pos)->GetValue();
+        });
+
+        std::cout << "  " << name << " dashboard " << total << " ms (reads " << read_time
+                  << " ms), ingestion " << ingest_time << " ms\n";
+    }
+}
+
+// Одновременное чтение всех ячеек таблицы 16384 x 9 из нескольких потоков:
+// уже вычисленных значений и после инвалидации всех формул. После
+// инвалидации потоки читают свои части строк, и время сравнивается с
+// чтением всей таблицы одним потоком
+void BenchConcurrentReads() {
+    constexpr int ROWS = Position::MAX_ROWS;
+    constexpr int COLS = 8;
+    constexpr int ROUNDS = 10;
+
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < ROWS; ++row) {
+        cells.push_back({ Position{ row, 0 }, std::to_string(row % 100) });
+        for (int col = 1; col <= COLS; ++col) {
+            const std::string prev = Position{ row, col - 1 }.ToString();
+            cells.push_back({ Position{ row, col }, "=" + prev + "*1.5+" + prev + "/3" });
+        }
+    }
+    sheet.SetCells(std::move(cells));
+    sheet.EvaluateRange({ { 0, 0 }, { ROWS - 1, COLS } });
+
+    const auto read_all = [&sheet](size_t thread_count, int rounds) {
+        std::vector<std::thread> threads;
+        std::atomic<size_t> checksum = 0;
+        for (size_t thread = 0; thread < thread_count; ++thread) {
+            threads.emplace_back([&, thread] {
+                const Sheet& reader = sheet;
+                size_t local = 0;
+                for (int round = 0; round < rounds; ++round) {
+                    for (int i = 0; i < ROWS; ++i) {
+                        const int row = (i + static_cast<int>(thread) * ROWS / 8) % ROWS;
+                        for (int col = 0; col <= COLS; ++col) {
+                            local += reader.GetCell({ row, col })->GetValueView().index();
+                        }
+                    }
+                }
+                checksum += local;
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        return checksum.load();
+    };
+
+    // Каждый из thread_count потоков читает свою часть строк
+    const auto read_slices = [&sheet](size_t thread_count) {
+        std::vector<std::thread> threads;
+        std::atomic<size_t> checksum = 0;
+        for (size_t thread = 0; thread < thread_count; ++thread) {
+            threads.emplace_back([&, thread] {
+                const Sheet& reader = sheet;
+                size_t local = 0;
+                const int begin = static_cast<int>(ROWS * thread / thread_count);
+                const int end = static_cast<int>(ROWS * (thread + 1) / thread_count);
+                for (int row = begin; row < end; ++row) {
+                    for (int col = 0; col <= COLS; ++col) {
+                        local += reader.GetCell({ row, col })->GetValueView().index();
+                    }
+                }
+                checksum += local;
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        return checksum.load();
+    };
+
+    std::cout << "Concurrent reads, " << ROWS * (COLS + 1) << " cells ("
+              << std::thread::hardware_concurrency() << " hardware threads):\n";
+    double single_cold_time = 0;
+    for (size_t threads : { 1, 2, 4, 8 }) {
+        const double warm_time = MeasureMilliseconds([&] {
+            read_all(threads, ROUNDS);
+        });
+        for (int row = 0; row < ROWS; ++row) {
+            sheet.SetCell({ row, 0 }, std::to_string((row + static_cast<int>(threads)) % 100));
+        }
+        const double cold_time = MeasureMilliseconds([&] {
+            read_slices(threads);
+        });
+        if (threads == 1) {
+            single_cold_time = cold_time;
+        }
+
+        const double reads = static_cast<double>(ROWS) * (COLS + 1) * ROUNDS * threads;
+        std::cout << "  " << threads << " threads: computed values " << reads / warm_time / 1000.0
+                  << " M reads/s, after invalidation " << cold_time << " ms ("
+                  << single_cold_time / cold_time << "x one thread)\n";
+    }
+}
+
+// Снимки таблицы: полный снимок, снимок после нескольких изменений и
+// изменения таблицы, пока другой поток выводит снимок
+void BenchSnapshots() {
+    constexpr int ROWS = Position::MAX_ROWS;
+    constexpr int COLS = 16;
+    constexpr int EDITS = 100;
+
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < ROWS; ++row) {
+        cells.push_back({ Position{ row, 0 }, std::to_string(row % 100) });
+        for (int col = 1; col < COLS; ++col) {
+            cells.push_back({ Position{ row, col }, "=" + Position{ row, col - 1 }.ToString() + "+1" });
+        }
+    }
+    sheet.SetCells(std::move(cells));
+    sheet.Recalculate();
+
+    std::shared_ptr<const SheetSnapshot> snapshot;
+    const double full_time = MeasureMilliseconds([&] {
+        snapshot = sheet.Snapshot();
+    });
+
+    std::mt19937 random(42);
+    double edit_time = 0.0;
+    const double incremental_time = MeasureMilliseconds([&] {
+        for (int i = 0; i < EDITS; ++i) {
+            edit_time += MeasureMilliseconds([&] {
+                sheet.SetCell({ static_cast<int>(random() % ROWS), 0 }, std::to_string(i));
+            });
+            snapshot = sheet.Snapshot();
+        }
+    }) - edit_time;
+
+    // Вывод снимка в другом потоке не блокирует изменения таблицы
+    std::atomic<bool> done = false;
+    size_t exported = 0;
+    std::thread exporter([&, snapshot] {
+        while (!done.load()) {
+            std::ostringstream output;
+            snapshot->PrintValues(output);
+            exported += output.str().size();
+        }
+    });
+    const double concurrent_time = MeasureMilliseconds([&] {
+        for (int i = 0; i < EDITS; ++i) {
+            sheet.SetCell({ static_cast<int>(random() % ROWS), 0 }, std::to_string(i));
+            sheet.Snapshot();
+        }
+    });
+    done = true;
+    exporter.join();
+
+    std::cout << "Snapshots, " << ROWS * COLS << " cells:\n"
+              << "  full snapshot " << full_time << " ms\n"
+              << "  snapshot after one edit " << incremental_time / EDITS << " ms\n"
+              << "  edit + snapshot while exporting " << concurrent_time / EDITS << " ms ("
+              << exported << " bytes exported)\n";
+}
+
+// Потоки-обработчики обновляют числа в своих группах столбцов; за каждой
+// группой - формула суммы ее столбцов в строке. Изменения под общей блокировкой в
+// сравнении с одновременными SetCell() с блокировками тайлов. Параллельны
+// только такие числовые изменения, формулы и текст записываются по одному
+void BenchConcurrentNumericUpdates() {
+    constexpr int ROWS = Position::MAX_ROWS;
+    constexpr int GROUP_COLS = 8;
+    constexpr int MAX_THREADS = 8;
+    constexpr int UPDATES = 200000;
+
+    const auto group_col = [](int group) {
+        return group * CellTable::TILE_SIZE;
+    };
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < ROWS; ++row) {
+        for (int group = 0; group < MAX_THREADS; ++group) {
+            for (int col = 0; col < GROUP_COLS - 1; ++col) {
+                cells.push_back({ Position{ row, group_col(group) + col }, "1" });
+            }
+            std::string sum = "=" + Position{ row, group_col(group) }.ToString();
+            for (int col = 1; col < GROUP_COLS - 1; ++col) {
+                sum += "+" + Position{ row, group_col(group) + col }.ToString();
+            }
+            cells.push_back({ Position{ row, group_col(group) + GROUP_COLS - 1 }, std::move(sum) });
+        }
+    }
+    sheet.SetCells(std::move(cells));
+
+    std::mutex sheet_mutex;
+    const auto update = [&](size_t thread_count, bool single_lock) {
+        std::vector<std::thread> threads;
+        for (size_t thread = 0; thread < thread_count; ++thread) {
+            threads.emplace_back([&, thread] {
+                std::mt19937 random(static_cast<unsigned>(thread));
+                const int base = group_col(static_cast<int>(thread));
+                for (int i = 0; i < UPDATES; ++i) {
+                    const Position pos{ static_cast<int>(random() % ROWS),
+                                        base + static_cast<int>(random() % (GROUP_COLS - 1)) };
+                    std::string text = std::to_string(i % 1000);
+                    if (single_lock) {
+                        std::lock_guard guard(sheet_mutex);
+                        sheet.SetCell(pos, std::move(text));
+                    }
+                    else {
+                        sheet.SetCell(pos, std::move(text));
+                    }
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    };
+
+    std::cout << "Concurrent numeric updates to disjoint column groups ("
+              << std::thread::hardware_concurrency() << " hardware threads):\n";
+    for (size_t threads : { 1, 2, 4, 8 }) {
+        const double single_time = MeasureMilliseconds([&] {
+            update(threads, true);
+        });
+        const double sharded_time = MeasureMilliseconds([&] {
+            update(threads, false);
+        });
+        const double updates = static_cast<double>(UPDATES) * threads;
+        std::cout << "  " << threads << " threads: single lock " << updates / single_time / 1000.0
+                  << " M updates/s, tile locks " << updates / sharded_time / 1000.0 << " M updates/s\n";
+    }
+}
 }  // namespace
 
-int main() {
+int main(int argc, char* argv[]) {
+    // Замеры производительности вместо тестов
+    if (argc > 1 && std::string_view(argv[1]) == "--bench") {
+        BenchErrorPropagation();
+        BenchValueView();
+        BenchDependencyGraph();
+        BenchCycleCheck();
+        BenchDeepChain();
+        BenchParallelRecalculation();
+        BenchRecalcPolicies();
+        BenchConcurrentReads();
+        BenchSnapshots();
+        BenchConcurrentNumericUpdates();
+        return 0;
+    }
+
     TestRunner tr;
     RUN_TEST(tr, TestPositionAndStringConversion);
     RUN_TEST(tr, TestPositionToStringInvalid);
@@ -368,6 +2364,32 @@ int main() {
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestSparseStorage);
+    RUN_TEST(tr, TestNumericCells);
+    RUN_TEST(tr, TestCellPointerStability);
+    RUN_TEST(tr, TestPooledAllocation);
+    RUN_TEST(tr, TestInternedText);
+    RUN_TEST(tr, TestPrintableSizeOnClear);
+    RUN_TEST(tr, TestInvalidationFromEmptyCell);
+    RUN_TEST(tr, TestBulkLoad);
+    RUN_TEST(tr, TestTransactions);
+    RUN_TEST(tr, TestFormulaDeepNesting);
+    RUN_TEST(tr, TestFormulaOptimization);
+    RUN_TEST(tr, TestNativeParserMatchesAntlr);
+    RUN_TEST(tr, TestFormulaCache);
+    RUN_TEST(tr, TestRangeFunctions);
+    RUN_TEST(tr, TestBatchEvaluation);
+    RUN_TEST(tr, TestErrorPropagation);
+    RUN_TEST(tr, TestNumericText);
+    RUN_TEST(tr, TestValueView);
+    RUN_TEST(tr, TestDependencyGraph);
+    RUN_TEST(tr, TestTopologicalOrder);
+    RUN_TEST(tr, TestDeepChain);
+    RUN_TEST(tr, TestParallelRecalculation);
+    RUN_TEST(tr, TestRecalcPolicies);
+    RUN_TEST(tr, TestConcurrentReads);
+    RUN_TEST(tr, TestSnapshots);
+    RUN_TEST(tr, TestConcurrentWrites);
 
     {
         auto sheet = CreateSheet();
@@ -0,0 +1,128 @@
+#include "range_index.h"
+
+#include <algorithm>
+
+/**
+ * Возвращает без повторов блоки, которые пересекают диапазоны, или пустой
+ * список, если их больше WIDE_TILES
+*/
+std::vector<uint32_t> RangeIndex::CollectTiles(const std::vector<Range>& ranges) {
+    size_t count = 0;
+    for (const Range& range : ranges) {
+        const size_t rows = range.last.row / TILE_SIZE - range.first.row / TILE_SIZE + 1;
+        const size_t cols = range.last.col / TILE_SIZE - range.first.col / TILE_SIZE + 1;
+        count += rows * cols;
+    }
+    if (count > WIDE_TILES) {
+        return {};
+    }
+
+    std::vector<uint32_t> tiles;
+    tiles.reserve(count);
+    for (const Range& range : ranges) {
+        for (int row = range.first.row / TILE_SIZE; row <= range.last.row / TILE_SIZE; ++row) {
+            for (int col = range.first.col / TILE_SIZE; col <= range.last.col / TILE_SIZE; ++col) {
+                tiles.push_back(TileOf(row * TILE_SIZE, col * TILE_SIZE));
+            }
+        }
+    }
+    std::sort(tiles.begin(), tiles.end());
+    tiles.erase(std::unique(tiles.begin(), tiles.end()), tiles.end());
+    return tiles;
+}
+
+/**
+ * Заменяет диапазоны формулы id
+*/
+void RangeIndex::Set(Id id, std::vector<Range> ranges) {
+    Remove(id);
+    if (ranges.empty()) {
+        return;
+    }
+
+    const std::vector<uint32_t> tiles = CollectTiles(ranges);
+    if (tiles.empty()) {
+        Append(wide_, id, ranges);
+    }
+    for (const uint32_t tile : tiles) {
+        Append(tiles_[tile], id, ranges);
+    }
+    ranges_.emplace(id, std::move(ranges));
+}
+/**
+ * Удаляет формулу id из списков блоков ее прежних диапазонов
+*/
+void RangeIndex::Remove(Id id) {
+    const auto it = ranges_.find(id);
+    if (it == ranges_.end()) {
+        return;
+    }
+
+    const std::vector<uint32_t> tiles = CollectTiles(it->second);
+    if (tiles.empty()) {
+        Erase(wide_, id);
+    }
+    for (const uint32_t tile : tiles) {
+        const auto bucket = tiles_.find(tile);
+        Erase(bucket->second, id);
+        if (bucket->second.empty()) {
+            tiles_.erase(bucket);
+        }
+    }
+    ranges_.erase(it);
+}
+
+/**
+ * Удаляет диапазоны формулы id из списка, сохраняя порядок остальных
+*/
+void RangeIndex::Erase(std::vector<Entry>& entries, Id id) {
+    entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                 [id](const Entry& entry) { return entry.id == id; }),
+                  entries.end());
+}
+/**
+ * Добавляет диапазоны формулы id в конец списка
+*/
+void RangeIndex::Append(std::vector<Entry>& entries, Id id, const std::vector<Range>& ranges) {
+    for (const Range& range : ranges) {
+        entries.push_back({ id, range });
+    }
+}
+/**
+ * Добавляет в ids формулы списка, диапазоны которых содержат pos. Диапазоны
+ * формулы идут подряд, поэтому повтор формулы виден по последнему элементу
+*/
+void RangeIndex::Match(const std::vector<Entry>& entries, Position pos, std::vector<Id>& ids) {
+    const size_t first = ids.size();
+    for (const Entry& entry : entries) {
+        if (entry.range.Contains(pos) && (ids.size() == first || ids.back() != entry.id)) {
+            ids.push_back(entry.id);
+        }
+    }
+}
+
+/**
+ * Возвращает формулы, диапазоны которых содержат позицию pos: проверяются
+ * диапазоны из списка ее блока и широкие диапазоны
+*/
+std::vector<RangeIndex::Id> RangeIndex::Find(Position pos) const {
+    std::vector<Id> dependents;
+    if (ranges_.empty()) {
+        return dependents;
+    }
+
+    if (const auto bucket = tiles_.find(TileOf(pos.row, pos.col)); bucket != tiles_.end()) {
+        Match(bucket->second, pos, dependents);
+    }
+    Match(wide_, pos, dependents);
+    return dependents;
+}
+
+bool RangeIndex::IsEmpty() const {
+    return ranges_.empty();
+}
+void RangeIndex::Clear() {
+    ranges_.clear();
+    tiles_.clear();
+    wide_.clear();
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "common.h"
+#include "dependency_graph.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Индекс зависимостей формул от диапазонов.
+// Для каждого блока TILE_SIZE x TILE_SIZE хранится список диапазонов
+// формул, которые его пересекают. Поиск формул, диапазоны которых содержат
+// позицию, просматривает только список ее блока. Формулы, диапазоны которых
+// покрывают больше WIDE_TILES блоков, хранятся в общем списке и
+// проверяются при каждом поиске: так полностолбцовые и полнолистовые
+// диапазоны не раздувают индекс.
+class RangeIndex {
+public:
+    using Id = DependencyGraph::Id;
+
+    static constexpr int TILE_SIZE = 64;
+    static constexpr size_t WIDE_TILES = 1024;
+
+    // Заменяет диапазоны формулы id; пустой список удаляет формулу из индекса
+    void Set(Id id, std::vector<Range> ranges);
+    // Формулы, диапазоны которых содержат позицию pos, без повторов
+    std::vector<Id> Find(Position pos) const;
+
+    bool IsEmpty() const;
+    void Clear();
+
+private:
+    static uint32_t TileOf(int row, int col) {
+        constexpr int TILE_COLS = (Position::MAX_COLS + TILE_SIZE - 1) / TILE_SIZE;
+        return static_cast<uint32_t>(row / TILE_SIZE * TILE_COLS + col / TILE_SIZE);
+    }
+    // Блоки, которые пересекают диапазоны; пустой список - диапазоны широкие
+    static std::vector<uint32_t> CollectTiles(const std::vector<Range>& ranges);
+
+    // Диапазон формулы в списке блока. Диапазоны одной формулы идут подряд
+    struct Entry {
+        Id id;
+        Range range;
+    };
+
+    void Remove(Id id);
+    static void Erase(std::vector<Entry>& entries, Id id);
+    static void Append(std::vector<Entry>& entries, Id id, const std::vector<Range>& ranges);
+    static void Match(const std::vector<Entry>& entries, Position pos, std::vector<Id>& ids);
+
+    std::unordered_map<Id, std::vector<Range>> ranges_; // Диапазоны формул
+    std::unordered_map<uint32_t, std::vector<Entry>> tiles_; // Диапазоны по блокам
+    std::vector<Entry> wide_; // Диапазоны формул с широкими диапазонами
+};
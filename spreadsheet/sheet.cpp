@@ -1,12 +1,76 @@
 #include "sheet.h"
+#include "work_stealing.h"
 
 #include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cmath>
 #include <functional>
 #include <iostream>
 #include <optional>
+#include <thread>
+#include <unordered_set>
 
 using namespace std::literals;
 
+namespace {
+
+/**
+ * Форматирует число кратчайшим представлением, однозначно его задающим
+*/
+std::string FormatNumber(double number) {
+    char buffer[32];
+    const auto result = std::to_chars(std::begin(buffer), std::end(buffer), number);
+    return std::string(buffer, result.ptr);
+}
+
+/**
+ * Возвращает число, если текст является его каноническим представлением
+ * (совпадает с результатом FormatNumber). Только такие значения можно хранить
+ * в колоночном виде без потери исходного текста ячейки
+*/
+std::optional<double> ParseCanonicalNumber(std::string_view text) {
+    if (text.empty()) {
+        return std::nullopt;
+    }
+
+    double number = 0.0;
+    const auto result = std::from_chars(text.data(), text.data() + text.size(), number);
+    if (result.ec != std::errc() || result.ptr != text.data() + text.size()
+        || !std::isfinite(number))
+    {
+        return std::nullopt;
+    }
+
+    char buffer[32];
+    const auto formatted = std::to_chars(std::begin(buffer), std::end(buffer), number);
+    if (std::string_view(buffer, formatted.ptr - buffer) != text) {
+        return std::nullopt;
+    }
+
+    return number;
+}
+
+/**
+ * Возвращает ключ позиции, уникальный в пределах таблицы
+*/
+int PositionKey(Position pos) {
+    return pos.row * Position::MAX_COLS + pos.col;
+}
+
+}  // namespace
+
+/**
+ * Ячейка, ожидающая установки при пакетной загрузке
+*/
+struct Sheet::PendingCell {
+    Position pos;
+    std::string text;
+    FormulaCache::AnchoredFormula formula; // Разобранная формула, если text - формула
+    std::vector<Position> references; // Ячейки, на которые ссылается формула
+    std::vector<Range> ranges; // Диапазоны, на которые ссылается формула
+};
+
 /**
  * Задает значение ячейке по адресу pos
 */
@@ -16,36 +80,413 @@ void Sheet::SetCell(Position pos, std::string text) {
         throw InvalidPositionException("Invalid set position");
     }
 
+    if (const std::optional<double> number = ParseCanonicalNumber(text);
+        number && TryWriteInTile(pos, number))
+    {
+        return;
+    }
+    std::unique_lock guard(write_mutex_);
+
+    RecordEdit(pos);
+
+    try {
+        SetCellContent(pos, std::move(text));
+    }
+    catch (const FormulaException&) {
+        AbortTransaction();
+        throw;
+    }
+    catch (const CircularDependencyException&) {
+        AbortTransaction();
+        throw;
+    }
+
+    OnEdit();
+}
+/**
+ * Задает значение ячейке по адресу pos, позиция должна быть валидной
+*/
+void Sheet::SetCellContent(Position pos, std::string text) {
+    MarkChangedTile(pos);
+    const bool was_printable = IsPrintable(pos);
+    Cell* cell = AdoptProxy(pos);
+    if (cell == nullptr) {
+        cell = table_.Get(pos);
+    }
+
+    // Число храним в колоночном виде без создания объекта Cell: граф
+    // зависимостей адресует позиции, а не объекты ячеек. Существующий
+    // объект мог быть выдан GetCell(), поэтому он сохраняется и хранит число
+    if (const std::optional<double> number = ParseCanonicalNumber(text)) {
+        if (cell != nullptr) {
+            // Удаляем ячейку из списков зависимостей ячеек, на которые она ссылалась
+            cell->Clear();
+            cell->LoadNumber(*number, std::move(text));
+        }
+        else {
+            table_.SetNumber(pos, *number);
+        }
+        if (!transaction_) {
+            InvalidateDependents(pos);
+        }
+
+        UpdatePrintableArea(pos, was_printable, true);
+        return;
+    }
+
     // Если ячейка не была создана - создаем ее
-    if (GetCell(pos) == nullptr) {
-        // Обновляем размер таблицы и саму таблицу при необходимости
-        if (static_cast<int>(table_.size()) < pos.row + 1) {
-            table_.resize(pos.row + 1);
+    if (cell == nullptr) {
+        cell = MaterializeNumber(pos);
+    }
+    if (cell == nullptr) {
+        cell = table_.Set(pos, MakePooled<Cell>(&pool_, *this, pos));
+    }
+
+    cell->Set(text);
+
+    UpdatePrintableArea(pos, was_printable, !cell->IsEmpty());
+}
+
+/**
+ * Пакетно задает содержимое ячеек
+*/
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+    std::unique_lock guard(write_mutex_);
+    LoadCells(std::move(cells));
+}
+/**
+ * Пакетно задает содержимое ячеек под исключительной блокировкой таблицы
+*/
+void Sheet::LoadCells(std::vector<std::pair<Position, std::string>> cells) {
+    // Проверяем позиции и разбираем формулы до каких-либо изменений таблицы
+    std::unordered_map<int, PendingCell> pending;
+    pending.reserve(cells.size());
+
+    for (auto& [pos, text] : cells) {
+        if (!pos.IsValid()) {
+            throw InvalidPositionException("Invalid set position");
+        }
 
-            for (int i = fact_size_.rows; i < pos.row + 1; ++i) {
-                table_[i].resize(fact_size_.cols);
+        PendingCell item{ pos, std::move(text), {}, {}, {} };
+        if (item.text.size() > 1 && item.text[0] == FORMULA_SIGN) {
+            try {
+                item.formula = formulas_.Acquire(std::string_view(item.text).substr(1), pos);
             }
+            catch (const FormulaException&) {
+                AbortTransaction();
+                throw;
+            }
+            item.references = item.formula.formula->GetReferencedCells(item.formula.anchor);
+            item.ranges = item.formula.formula->GetReferencedRanges(item.formula.anchor);
+        }
+
+        pending[PositionKey(pos)] = std::move(item);
+    }
+
+    if (const std::vector<Position> circular = FindCircularCells(pending); !circular.empty()) {
+        std::string message = "Circular dependency detected:";
+        for (size_t i = 0; i < circular.size(); ++i) {
+            message += (i == 0 ? " " : ", ") + circular[i].ToString();
+        }
+
+        AbortTransaction();
+        throw CircularDependencyException(message);
+    }
+
+    for (const auto& [key, item] : pending) {
+        RecordEdit(item.pos);
+    }
 
-            fact_size_.rows = pos.row + 1;
+    // Устанавливаем содержимое. Обычный текст и числа задаются через SetCell:
+    // для них нет ни разбора, ни проверки циклов
+    struct LoadedCell {
+        Position pos;
+        Cell* cell;
+        bool was_printable;
+    };
+    std::vector<LoadedCell> loaded;
+    for (auto& [key, item] : pending) {
+        if (item.formula.formula == nullptr) {
+            SetCellContent(item.pos, std::move(item.text));
+            continue;
+        }
+
+        MarkChangedTile(item.pos);
+        const bool was_printable = IsPrintable(item.pos);
+        Cell* cell = AdoptProxy(item.pos);
+        if (cell == nullptr) {
+            cell = table_.Get(item.pos);
+        }
+        if (cell == nullptr) {
+            cell = MaterializeNumber(item.pos);
+        }
+        if (cell == nullptr) {
+            cell = table_.Set(item.pos, MakePooled<Cell>(&pool_, *this, item.pos));
         }
-        if (static_cast<int>(table_[0].size()) < pos.col + 1) {
-            for (auto& row : table_) {
-                row.resize(pos.col + 1);
+
+        cell->Load(std::move(item.formula));
+        loaded.push_back({ item.pos, cell, was_printable });
+    }
+
+    // Проходы по загруженным формулам: связи, кэши, печатная область.
+    // Ссылки всех формул вносятся в граф зависимостей одним пакетом
+    std::vector<std::pair<DependencyGraph::Id, std::vector<DependencyGraph::Id>>> precedents;
+    precedents.reserve(loaded.size());
+    for (const LoadedCell& item : loaded) {
+        std::vector<Range> ranges = item.cell->GetReferencedRanges();
+        precedents.emplace_back(DependencyGraph::ToId(item.pos),
+                                CollectPrecedents(item.cell->GetReferencedCells(), ranges));
+        SetRangeDependencies(item.pos, std::move(ranges));
+    }
+    graph_.SetPrecedents(std::move(precedents));
+
+    // Загруженные формулы, попавшие в диапазоны прежних формул
+    if (!range_dependencies_.IsEmpty()) {
+        for (const LoadedCell& item : loaded) {
+            for (const DependencyGraph::Id dependent : FindRangeDependents(item.pos)) {
+                graph_.AddEdge(DependencyGraph::ToId(item.pos), dependent);
             }
-            fact_size_.cols = pos.col + 1;
         }
+    }
+    for (const LoadedCell& item : loaded) {
+        // Внутри транзакции кэши инвалидируются при ее подтверждении
+        if (!transaction_) {
+            item.cell->InvalidateCache();
+        }
+        else {
+            MarkDirty(item.pos);
+        }
+        UpdatePrintableArea(item.pos, item.was_printable, true);
+    }
+
+    OnEdit();
+}
+
+/**
+ * Начинает транзакцию. До вызова Commit() изменения ячеек не инвалидируют
+ * кэши зависимых ячеек, поэтому значения, прочитанные внутри транзакции,
+ * могут не учитывать сделанные в ней изменения
+*/
+void Sheet::BeginTransaction() {
+    std::unique_lock guard(write_mutex_);
+    if (transaction_) {
+        throw std::logic_error("Transaction is already started");
+    }
+
+    transaction_.emplace();
+}
+/**
+ * Подтверждает транзакцию: инвалидирует кэши всех ячеек, зависящих от
+ * измененных, одним проходом. Обход останавливается на уже сброшенных кэшах,
+ * поэтому общие зависимые нескольких измененных ячеек не обходятся повторно
+*/
+void Sheet::Commit() {
+    std::unique_lock guard(write_mutex_);
+    if (!transaction_) {
+        throw std::logic_error("No transaction to commit");
+    }
+
+    const Transaction transaction = std::move(*transaction_);
+    transaction_.reset();
+
+    for (Position pos : transaction.edited) {
+        if (Cell* cell = table_.Get(pos); cell != nullptr) {
+            cell->InvalidateCache();
+        }
+        else {
+            InvalidateDependents(pos);
+        }
+    }
+
+    OnEdit();
+}
+/**
+ * Отменяет транзакцию, восстанавливая прежнее содержимое измененных ячеек
+*/
+void Sheet::Rollback() {
+    std::unique_lock guard(write_mutex_);
+    if (!transaction_) {
+        throw std::logic_error("No transaction to roll back");
+    }
+
+    RollbackTransaction();
+}
+/**
+ * Отменяет начатую транзакцию под исключительной блокировкой таблицы
+*/
+void Sheet::RollbackTransaction() {
+    Transaction transaction = std::move(*transaction_);
+    transaction_.reset();
+
+    // Прежнее содержимое восстанавливается пакетно: поочередное восстановление
+    // формул могло бы временно образовать цикл с еще не восстановленными ячейками
+    std::vector<std::pair<Position, std::string>> restored;
+    restored.reserve(transaction.edited.size());
+    for (Position pos : transaction.edited) {
+        auto& text = transaction.original_texts.at(PositionKey(pos));
+        restored.emplace_back(pos, text ? std::move(*text) : std::string());
+    }
+    LoadCells(std::move(restored));
+
+    // Позиции, которые были свободны до транзакции, освобождаем
+    for (Position pos : transaction.edited) {
+        if (!transaction.original_texts.at(PositionKey(pos))) {
+            ClearCellContent(pos);
+        }
+    }
+}
+/**
+ * Возвращает true, если начата транзакция
+*/
+bool Sheet::IsInTransaction() const {
+    return transaction_.has_value();
+}
+
+/**
+ * Запоминает содержимое позиции перед первым ее изменением в транзакции
+*/
+void Sheet::RecordEdit(Position pos) {
+    if (!transaction_) {
+        return;
+    }
+
+    auto [it, inserted] = transaction_->original_texts.try_emplace(PositionKey(pos));
+    if (!inserted) {
+        return;
+    }
 
-        table_[pos.row][pos.col] = std::make_unique<Cell>(*this);
+    if (const double* number = table_.GetNumber(pos); number != nullptr) {
+        it->second = FormatNumber(*number);
+    }
+    else if (const Cell* cell = table_.Get(pos); cell != nullptr) {
+        it->second = cell->GetText();
+    }
+    transaction_->edited.push_back(pos);
+}
+/**
+ * Откатывает транзакцию, если она начата. Вызывается, когда изменение
+ * внутри транзакции завершилось исключением
+*/
+void Sheet::AbortTransaction() {
+    if (transaction_) {
+        RollbackTransaction();
     }
+}
+
+/**
+ * Возвращает отсортированный список ячеек, входящих в циклы графа, который
+ * получится после установки pending. Алгоритм Тарьяна, итеративный, линейный
+ * по числу ячеек и ссылок, достижимых из новых формул
+*/
+std::vector<Position> Sheet::FindCircularCells(
+    const std::unordered_map<int, PendingCell>& pending) const
+{
+    // Ссылки ячейки с учетом ожидающего содержимого. Из диапазона в граф
+    // попадают только формулы: числа и текст не ссылаются на другие ячейки
+    auto references_of = [&](Position pos) -> std::vector<Position> {
+        std::vector<Position> references;
+        std::vector<Range> ranges;
+        if (auto it = pending.find(PositionKey(pos)); it != pending.end()) {
+            references = it->second.references;
+            ranges = it->second.ranges;
+        }
+        else if (const Cell* cell = table_.Get(pos); cell != nullptr) {
+            references = cell->GetReferencedCells();
+            ranges = cell->GetReferencedRanges();
+        }
+
+        for (const Range& range : ranges) {
+            for (const auto& [key, item] : pending) {
+                if (item.formula.formula != nullptr && range.Contains(item.pos)) {
+                    references.push_back(item.pos);
+                }
+            }
+            table_.ForEachInRange(range, [](Position, const double*, size_t) {}, [&](const Cell& cell) {
+                if (pending.count(PositionKey(cell.GetPosition())) == 0) {
+                    references.push_back(cell.GetPosition());
+                }
+            });
+        }
+        return references;
+    };
+
+    struct NodeState {
+        int index = 0;
+        int low_link = 0;
+        bool on_stack = false;
+    };
+    struct Frame {
+        Position pos;
+        std::vector<Position> successors;
+        size_t next = 0;
+    };
+
+    std::unordered_map<int, NodeState> states;
+    std::vector<Position> scc_stack;
+    std::vector<Frame> call_stack;
+    std::vector<Position> circular;
+    int next_index = 0;
+
+    auto visit = [&](Position pos) {
+        states[PositionKey(pos)] = { next_index, next_index, true };
+        ++next_index;
+        scc_stack.push_back(pos);
+        call_stack.push_back({ pos, references_of(pos), 0 });
+    };
+
+    for (const auto& [key, item] : pending) {
+        if (item.formula.formula == nullptr || states.count(key) != 0) {
+            continue;
+        }
 
-    table_[pos.row][pos.col].get()->Set(text);
+        visit(item.pos);
+        while (!call_stack.empty()) {
+            Frame& frame = call_stack.back();
+            NodeState& state = states[PositionKey(frame.pos)];
 
-    // Если ячейка непустая и новый размер непустой ячейки 
-    // больше размера печатной области - обновляем размер печатной области
-    if (!table_[pos.row][pos.col].get()->IsEmpty()) {
-        print_size_.rows = std::max(print_size_.rows, pos.row + 1);
-        print_size_.cols = std::max(print_size_.cols, pos.col + 1);
+            if (frame.next < frame.successors.size()) {
+                const Position next = frame.successors[frame.next++];
+                auto it = states.find(PositionKey(next));
+                if (it == states.end()) {
+                    visit(next);
+                }
+                else if (it->second.on_stack) {
+                    state.low_link = std::min(state.low_link, it->second.index);
+                }
+                continue;
+            }
+
+            // Все преемники обработаны: если ячейка - корень компоненты,
+            // извлекаем компоненту из стека
+            if (state.low_link == state.index) {
+                const bool self_loop = std::find(frame.successors.begin(),
+                    frame.successors.end(), frame.pos) != frame.successors.end();
+
+                std::vector<Position> component;
+                Position member;
+                do {
+                    member = scc_stack.back();
+                    scc_stack.pop_back();
+                    states[PositionKey(member)].on_stack = false;
+                    component.push_back(member);
+                } while (!(member == frame.pos));
+
+                if (component.size() > 1 || self_loop) {
+                    circular.insert(circular.end(), component.begin(), component.end());
+                }
+            }
+
+            const int low_link = state.low_link;
+            call_stack.pop_back();
+            if (!call_stack.empty()) {
+                NodeState& parent = states[PositionKey(call_stack.back().pos)];
+                parent.low_link = std::min(parent.low_link, low_link);
+            }
+        }
     }
+
+    std::sort(circular.begin(), circular.end());
+    return circular;
 }
 
 /**
@@ -57,17 +498,15 @@ CellInterface* Sheet::GetCell(Position pos) {
         throw InvalidPositionException("Invalid get position");
     }
 
-    // Если позиция выходит за пределы области таблицы - возвращаем nullptr
-    if (pos.row >= fact_size_.rows || pos.col >= fact_size_.cols) {
-        return nullptr;
+    Cell* cell = table_.Get(pos);
+    if (cell == nullptr) {
+        cell = GetProxy(pos);
     }
 
-    // Если pos указывает на пустую ячейку - возвращаем nullptr
-    if (table_[pos.row][pos.col] == nullptr) {
-        return nullptr;
+    if (recalc_policy_ == RecalcPolicy::Adaptive) {
+        reads_.fetch_add(1, std::memory_order_relaxed);
     }
-
-    return table_[pos.row][pos.col].get();
+    return cell;
 }
 /**
  * Возвращает константный указатель на ячейку
@@ -78,85 +517,684 @@ const CellInterface* Sheet::GetCell(Position pos) const {
         throw InvalidPositionException("Invalid get position");
     }
 
-    // Если позиция выходит за пределы области таблицы - возвращаем nullptr
-    if (pos.row >= fact_size_.rows || pos.col >= fact_size_.cols) {
-        return nullptr;
+    Cell* cell = table_.Get(pos);
+    if (cell == nullptr) {
+        cell = GetProxy(pos);
     }
 
-    // Если pos указывает на пустую ячейку - возвращаем nullptr
-    if (table_[pos.row][pos.col] == nullptr) {
-        return nullptr;
+    if (recalc_policy_ == RecalcPolicy::Adaptive) {
+        reads_.fetch_add(1, std::memory_order_relaxed);
     }
+    return cell;
+}
 
-    return table_[pos.row][pos.col].get();
+/**
+ * Возвращает объект ячейки по адресу pos или nullptr, если позиция пуста
+ * или хранит число. В отличие от GetCell() не создает объектов для чисел
+*/
+Cell* Sheet::FindCell(Position pos) {
+    return table_.Get(pos);
+}
+const Cell* Sheet::FindCell(Position pos) const {
+    return table_.Get(pos);
 }
 
 /**
- * Возвращает указатель на ячейку, а в случае ее отсутствия 
- * - создает пустую и возвращает указатель на нее
- * (Метод необходим для создания корректных списков зависимостей ячеек)
+ * Передает visitor непустые ячейки диапазона. Числа передаются участками
+ * колоночного хранилища без создания объектов ячеек
 */
-CellInterface* Sheet::GetOrCreateCell(Position pos) {
-    // Если позиция невалидная - выбрасываем исключение
-    if (!pos.IsValid()) {
-        throw InvalidPositionException("Invalid get position");
+void Sheet::VisitRange(Range range, RangeVisitor& visitor) const {
+    table_.ForEachInRange(
+        range,
+        [&visitor](Position, const double* values, size_t count) {
+            visitor.VisitNumbers(values, count);
+        },
+        [&visitor](const Cell& cell) {
+            if (!cell.IsEmpty()) {
+                visitor.VisitCell(cell);
+            }
+        }
+    );
+}
+
+/**
+ * Записывает значения ячеек столбца: числа копируются участками колоночного
+ * хранилища, объекты ячеек не создаются
+*/
+void Sheet::GetColumnValues(Position first, size_t count, double* values, bool* numeric) const {
+    std::fill(values, values + count, 0.0);
+    if (count == 0) {
+        return;
     }
 
-    // Создаем ячейку, если она не была создана
-    if (GetCell(pos) == nullptr) {
-        SetCell(pos, "");
+    const Range range = { first, { first.row + static_cast<int>(count) - 1, first.col } };
+    table_.ForEachInRange(
+        range,
+        [&](Position pos, const double* numbers, size_t length) {
+            std::copy(numbers, numbers + length, values + (pos.row - first.row));
+        },
+        [&](const Cell& cell) {
+            const size_t index = cell.GetPosition().row - first.row;
+            const CellInterface::NumericValue value = cell.GetNumericValue();
+            if (std::holds_alternative<double>(value)) {
+                values[index] = std::get<double>(value);
+            }
+            else {
+                numeric[index] = false;
+            }
+        }
+    );
+}
+
+/**
+ * Возвращает значение позиции как операнда формулы. Число читается
+ * из колоночного хранилища, объект ячейки для него не создается
+*/
+CellInterface::NumericValue Sheet::GetNumericValue(Position pos) const {
+    if (const double* number = table_.GetNumber(pos); number != nullptr) {
+        return *number;
     }
 
-    return table_[pos.row][pos.col].get();
+    const Cell* cell = table_.Get(pos);
+    if (cell == nullptr) {
+        return 0.0;
+    }
+    return cell->GetNumericValue();
 }
 
 /**
- * Очищает ячейку по адресу pos
+ * Возвращает количество текстовых ячеек, текст которых является числом
 */
-void Sheet::ClearCell(Position pos) {
-    // Если pos указывает на пустую ячейку - ничего не делаем
-    if (GetCell(pos) == nullptr) {
+size_t Sheet::CountNumericTextCells() const {
+    if (print_size_.rows == 0 || print_size_.cols == 0) {
+        return 0;
+    }
+
+    size_t count = 0;
+    ForEachCellInRange({ { 0, 0 }, { print_size_.rows - 1, print_size_.cols - 1 } },
+        [&count](const Cell& cell) {
+            count += cell.IsNumericText();
+        });
+    return count;
+}
+
+/**
+ * Вычисляет формулы диапазона без кэша, объединяя ячейки столбца
+ * с общей формулой в пакеты. Остальные формулы вычисляются в порядке графа
+*/
+void Sheet::EvaluateRange(Range range) const {
+    // При ручном пересчете вычисляются только формулы без значения, а их
+    // ссылки могут быть устаревшими
+    const bool clean = recalc_policy_ != RecalcPolicy::Manual;
+    std::vector<const Cell*> cells;
+    std::vector<FormulaInterface::Value> results;
+    std::vector<DependencyGraph::Id> singles; // Формулы вне пакетов
+
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        // Формульные ячейки столбца без кэша в порядке строк
+        cells.clear();
+        ForEachCellInRange({ { range.first.row, col }, { range.last.row, col } },
+            [&cells](const Cell& cell) {
+                if (cell.GetFormula().formula != nullptr && cell.NeedsEvaluation()) {
+                    cells.push_back(&cell);
+                }
+            });
+
+        for (size_t begin = 0; begin < cells.size();) {
+            // Пакет - ячейки подряд идущих строк, якоря которых сдвигаются
+            // вместе со строкой, с одной относительной формулой
+            const Cell::FormulaRef first = cells[begin]->GetFormula();
+            size_t end = begin + 1;
+            while (end < cells.size()) {
+                const Cell::FormulaRef next = cells[end]->GetFormula();
+                const int offset = static_cast<int>(end - begin);
+                if (next.formula != first.formula
+                    || !(next.anchor == Position{ first.anchor.row + offset, first.anchor.col })
+                    || !(cells[end]->GetPosition() == Position{ cells[begin]->GetPosition().row + offset, col }))
+                {
+                    break;
+                }
+                ++end;
+            }
+
+            if (end - begin == 1) {
+                singles.push_back(DependencyGraph::ToId(cells[begin]->GetPosition()));
+            }
+            else {
+                results.resize(end - begin);
+                first.formula->EvaluateRows(*this, first.anchor, end - begin, results.data());
+                for (size_t i = begin; i < end; ++i) {
+                    // Ячейка могла быть вычислена как операнд другой ячейки
+                    // пакета или другим потоком
+                    if (cells[i]->ClaimEvaluation()) {
+                        std::visit([cell = cells[i], clean](auto value) { cell->SetCachedValue(value, clean); },
+                                   results[i - begin]);
+                    }
+                }
+            }
+            begin = end;
+        }
+    }
+
+    // Формулы вне пакетов вычисляются в топологическом порядке: к вычислению
+    // формулы ее ссылки из того же диапазона уже вычислены
+    graph_.SortTopologically(singles);
+    for (const DependencyGraph::Id id : singles) {
+        table_.Get(DependencyGraph::ToPosition(id))->GetValue();
+    }
+}
+
+/**
+ * Вычисляет все устаревшие формулы таблицы параллельно. Подграф таких формул
+ * переносится в локальный CSR со счетчиками невычисленных ссылок; формула
+ * со счетчиком 0 готова к вычислению. Поток, вычисливший формулу, уменьшает
+ * счетчики зависимых и ставит ставшие готовыми в свою очередь
+*/
+void Sheet::RecalculateAll(size_t thread_count) const {
+    using Id = DependencyGraph::Id;
+
+    // Устаревшие формулы и их номера в подграфе. Формулы без кэша тоже
+    // отмечены устаревшими
+    const std::vector<Id> ids = TakeDirtyFormulas();
+    if (ids.empty()) {
         return;
     }
+    std::vector<const Cell*> cells;
+    std::unordered_map<Id, uint32_t> index;
+    cells.reserve(ids.size());
+    index.reserve(ids.size());
+    for (const Id id : ids) {
+        index.emplace(id, static_cast<uint32_t>(cells.size()));
+        cells.push_back(table_.Get(DependencyGraph::ToPosition(id)));
+    }
+
+    // Ребра подграфа (ссылка - формула) и списки зависимых формул в CSR
+    std::vector<std::pair<uint32_t, uint32_t>> edges;
+    std::vector<uint32_t> offsets(cells.size() + 1, 0);
+    std::unique_ptr<std::atomic<uint32_t>[]> pending(new std::atomic<uint32_t>[cells.size()]);
+    for (uint32_t i = 0; i < cells.size(); ++i) {
+        uint32_t count = 0;
+        graph_.ForEachPrecedent(DependencyGraph::ToId(cells[i]->GetPosition()), [&](Id precedent) {
+            if (const auto it = index.find(precedent); it != index.end()) {
+                edges.push_back({ it->second, i });
+                ++offsets[it->second + 1];
+                ++count;
+            }
+        });
+        pending[i].store(count, std::memory_order_relaxed);
+    }
+    for (size_t i = 1; i < offsets.size(); ++i) {
+        offsets[i] += offsets[i - 1];
+    }
+    std::vector<uint32_t> dependents(edges.size());
+    {
+        std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+        for (const auto& [from, to] : edges) {
+            dependents[fill[from]++] = to;
+        }
+    }
+
+    if (thread_count == 0) {
+        thread_count = std::thread::hardware_concurrency();
+    }
+    WorkStealingScheduler scheduler(std::min(thread_count, cells.size()));
+
+    // Готовые формулы распределяются по очередям потоков поровну
+    size_t worker = 0;
+    for (uint32_t i = 0; i < cells.size(); ++i) {
+        if (pending[i].load(std::memory_order_relaxed) == 0) {
+            scheduler.Push(worker, i);
+            worker = (worker + 1) % scheduler.GetThreadCount();
+        }
+    }
+
+    scheduler.Run(cells.size(), [&](uint32_t i, size_t worker) {
+        const Cell::FormulaRef formula = cells[i]->GetFormula();
+        std::visit([cell = cells[i]](auto value) { cell->SetCachedValue(value); },
+                   formula.formula->Evaluate(*this, formula.anchor));
+
+        // Запись кэша видна потоку, который обнулит счетчик зависимой формулы
+        for (uint32_t edge = offsets[i]; edge < offsets[i + 1]; ++edge) {
+            if (pending[dependents[edge]].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                scheduler.Push(worker, dependents[edge]);
+            }
+        }
+    });
+}
 
-    table_[pos.row][pos.col].get()->Clear();
+/**
+ * Задает политику пересчета. При переходе к немедленному пересчету
+ * устаревшие формулы пересчитываются сразу
+*/
+void Sheet::SetRecalcPolicy(RecalcPolicy policy) {
+    std::unique_lock guard(write_mutex_);
+    recalc_policy_ = policy;
+    if (policy == RecalcPolicy::Eager) {
+        Recalculate();
+    }
+}
+/**
+ * Возвращает политику пересчета таблицы
+*/
+Sheet::RecalcPolicy Sheet::GetRecalcPolicy() const {
+    return recalc_policy_;
+}
+/**
+ * Пересчитывает устаревшие формулы в одном потоке. В топологическом
+ * порядке ссылки формулы пересчитаны раньше нее, поэтому каждая
+ * формула вычисляется ровно один раз
+*/
+void Sheet::Recalculate() const {
+    std::vector<DependencyGraph::Id> ids = TakeDirtyFormulas();
+    graph_.SortTopologically(ids);
+    for (const DependencyGraph::Id id : ids) {
+        const Cell* cell = table_.Get(DependencyGraph::ToPosition(id));
+        const Cell::FormulaRef formula = cell->GetFormula();
+        std::visit([cell](auto value) { cell->SetCachedValue(value); },
+                   formula.formula->Evaluate(*this, formula.anchor));
+    }
+}
+/**
+ * Возвращает количество формул, отмеченных устаревшими
+*/
+size_t Sheet::GetDirtyCount() const {
+    std::unordered_set<DependencyGraph::Id> ids;
+    for (const DependencyGraph::Id id : dirty_) {
+        if (const Cell* cell = table_.Get(DependencyGraph::ToPosition(id)); cell != nullptr && cell->IsDirty()) {
+            ids.insert(id);
+        }
+    }
+    return ids.size();
+}
+/**
+ * Учитывает изменение таблицы. Адаптивная политика пересчитывает формулы
+ * сразу, если за последнее время ячейки читались не реже, чем изменялись:
+ * тогда пересчет все равно понадобится первому чтению
+*/
+void Sheet::OnEdit() {
+    if (transaction_) {
+        return;
+    }
 
-    // Если ячейка не входит ни в один список зависимостей - удаляем ее
-    if (!table_[pos.row][pos.col].get()->HasDependencies()) {
-        table_[pos.row][pos.col] = nullptr;
+    size_t reads = reads_.load(std::memory_order_relaxed);
+    if (++writes_ + reads >= ADAPTIVE_WINDOW) {
+        writes_ /= 2;
+        reads /= 2;
+        reads_.store(reads, std::memory_order_relaxed);
+    }
+    if (recalc_policy_ == RecalcPolicy::Eager
+        || (recalc_policy_ == RecalcPolicy::Adaptive && reads >= writes_))
+    {
+        Recalculate();
     }
+}
 
-    // Итерируемся по строкам, пока не найдем непустую строку
-    for (; print_size_.rows > 0; --print_size_.rows) {
-        bool is_found = false;
+/**
+ * Возвращает граф ссылок формул на отдельные ячейки
+*/
+DependencyGraph& Sheet::GetDependencyGraph() {
+    return graph_;
+}
+const DependencyGraph& Sheet::GetDependencyGraph() const {
+    return graph_;
+}
 
-        for (int i = 0; i < print_size_.cols; ++i) {
-            if (GetCell({ print_size_.rows - 1, i }) != nullptr) {
-                is_found = true;
-                break;
+/**
+ * Задает диапазоны, от значений ячеек которых зависит формула в позиции pos
+*/
+void Sheet::SetRangeDependencies(Position pos, std::vector<Range> ranges) {
+    range_dependencies_.Set(DependencyGraph::ToId(pos), std::move(ranges));
+}
+/**
+ * Возвращает формулы, диапазоны которых содержат позицию pos
+*/
+std::vector<DependencyGraph::Id> Sheet::FindRangeDependents(Position pos) const {
+    return range_dependencies_.Find(pos);
+}
+/**
+ * Возвращает вершины, на которые ссылается формула: отдельные ячейки
+ * и формульные ячейки диапазонов. Числа и текст диапазонов ни на что
+ * не ссылаются, поэтому в граф не попадают
+*/
+std::vector<DependencyGraph::Id> Sheet::CollectPrecedents(const std::vector<Position>& cells,
+                                                          const std::vector<Range>& ranges) const
+{
+    std::vector<DependencyGraph::Id> precedents;
+    precedents.reserve(cells.size());
+    for (Position pos : cells) {
+        precedents.push_back(DependencyGraph::ToId(pos));
+    }
+    for (const Range& range : ranges) {
+        ForEachCellInRange(range, [&precedents](const Cell& cell) {
+            if (cell.GetFormula().formula != nullptr) {
+                precedents.push_back(DependencyGraph::ToId(cell.GetPosition()));
             }
+        });
+    }
+    return precedents;
+}
+
+/**
+ * Отмечает устаревшими формулы, которые ссылаются на позицию pos
+ * или на содержащий ее диапазон, и их зависимых. Обход останавливается
+ * на уже устаревших формулах: их зависимые устарели вместе с ними.
+ * Граф и диапазоны только читаются, поэтому обходы из записей в разные
+ * тайлы могут идти одновременно; отметки ячеек атомарны
+*/
+template <typename OnMarked>
+void Sheet::MarkDependentsDirty(Position pos, OnMarked on_marked) {
+    std::vector<DependencyGraph::Id> stack;
+    const auto push_dependents = [this, &stack](Position from) {
+        graph_.ForEachDependent(DependencyGraph::ToId(from), [&stack](DependencyGraph::Id id) {
+            stack.push_back(id);
+        });
+        for (const DependencyGraph::Id id : FindRangeDependents(from)) {
+            stack.push_back(id);
+        }
+    };
+    const auto mark = [this, &on_marked](Position target) {
+        Cell* cell = table_.Get(target);
+        if (cell == nullptr || !cell->MarkDirty()) {
+            return false;
+        }
+        on_marked(target, cell);
+        return true;
+    };
+
+    // Зависимые обходятся, даже если сама формула уже была устаревшей:
+    // изменилось ее содержимое
+    mark(pos);
+    push_dependents(pos);
+    while (!stack.empty()) {
+        const Position dependent = DependencyGraph::ToPosition(stack.back());
+        stack.pop_back();
+
+        if (mark(dependent)) {
+            push_dependents(dependent);
         }
+    }
+}
+/**
+ * Инвалидирует кэши формул, зависящих от позиции pos, и вносит их
+ * в список устаревших
+*/
+void Sheet::InvalidateDependents(Position pos) {
+    MarkDependentsDirty(pos, [this](Position marked, Cell* cell) {
+        ListDirty(marked, cell);
+    });
+}
+/**
+ * Отмечает устаревшей формулу в позиции pos и вносит ее в список устаревших,
+ * если ее там еще нет
+*/
+bool Sheet::MarkDirty(Position pos) {
+    Cell* cell = table_.Get(pos);
+    if (cell == nullptr || !cell->MarkDirty()) {
+        return false;
+    }
 
-        if (is_found) {
-            break;
+    ListDirty(pos, cell);
+    return true;
+}
+/**
+ * Вносит формулу, отмеченную устаревшей, в список устаревших, если ее
+ * там еще нет, а ее тайл - в измененные с последнего снимка
+*/
+void Sheet::ListDirty(Position pos, Cell* cell) {
+    MarkChangedTile(pos);
+    if (cell->SetListed(true)) {
+        dirty_.push_back(DependencyGraph::ToId(pos));
+        if (dirty_.size() >= dirty_limit_) {
+            CompactDirty();
         }
     }
+}
+/**
+ * Оставляет в списке устаревших формул те, что еще отмечены. Ячейка,
+ * пересозданная в той же позиции, могла попасть в список повторно:
+ * повторы отсеиваются по отметке о внесении. Следующее прореживание -
+ * когда список вырастет вдвое
+*/
+void Sheet::CompactDirty() {
+    dirty_ = TakeDirtyFormulas();
+    for (const DependencyGraph::Id id : dirty_) {
+        table_.Get(DependencyGraph::ToPosition(id))->SetListed(true);
+    }
+
+    dirty_limit_ = std::max(MIN_DIRTY_LIMIT, dirty_.size() * 2);
+}
+/**
+ * Возвращает без повторов формулы, которые еще отмечены устаревшими,
+ * и очищает список, снимая отметки о внесении
+*/
+std::vector<DependencyGraph::Id> Sheet::TakeDirtyFormulas() const {
+    std::vector<DependencyGraph::Id> ids = std::move(dirty_);
+    dirty_.clear();
 
-    // Итерируемся по столбцам, пока не найдем непустой столбец
-    for (; print_size_.cols > 0; --print_size_.cols) {
-        bool is_found = false;
+    // Первое вхождение ячейки снимает отметку, повторные уже ее не видят
+    ids.erase(std::remove_if(ids.begin(), ids.end(), [this](DependencyGraph::Id id) {
+        Cell* cell = table_.Get(DependencyGraph::ToPosition(id));
+        return cell == nullptr || !cell->SetListed(false) || !cell->IsDirty();
+    }), ids.end());
+    return ids;
+}
+/**
+ * Вычисляет формулы без кэша, от которых зависит формула в позиции pos,
+ * и ее саму. Обход в глубину по графу с явным стеком: вершина вычисляется,
+ * когда сняты со стека все ее ссылки. Вершина может лечь в стек несколько
+ * раз, раскрывается только первая снятая копия. Потоки обходят граф
+ * независимо и вычисляют каждую вершину, захватив ее: проигравший поток
+ * ждет значения, не держа захватов
+*/
+void Sheet::EvaluateFormulas(Position pos) const {
+    using Id = DependencyGraph::Id;
+
+    struct Frame {
+        Id id;
+        bool expanded; // Ссылки вершины уже положены в стек
+    };
+
+    // Формула, которую нужно вычислить, или nullptr
+    const auto pending_formula = [this](Id id) -> const Cell* {
+        const Cell* cell = table_.Get(DependencyGraph::ToPosition(id));
+        if (cell == nullptr || cell->GetFormula().formula == nullptr || !cell->NeedsEvaluation()) {
+            return nullptr;
+        }
+        return cell;
+    };
+    const bool clean = recalc_policy_ != RecalcPolicy::Manual;
+
+    std::vector<Frame> stack = { { DependencyGraph::ToId(pos), false } };
+    std::unordered_set<Id> expanded;
+    while (!stack.empty()) {
+        const Frame frame = stack.back();
+        stack.pop_back();
 
-        for (int i = 0; i < print_size_.rows; ++i) {
-            if (GetCell({ i, print_size_.cols - 1 }) != nullptr) {
-                is_found = true;
-                break;
+        if (frame.expanded) {
+            if (const Cell* cell = pending_formula(frame.id); cell != nullptr && cell->ClaimEvaluation()) {
+                const Cell::FormulaRef formula = cell->GetFormula();
+                std::visit([cell, clean](auto value) { cell->SetCachedValue(value, clean); },
+                           formula.formula->Evaluate(*this, formula.anchor));
             }
+            continue;
+        }
+        if (!expanded.insert(frame.id).second || pending_formula(frame.id) == nullptr) {
+            continue;
+        }
+
+        stack.push_back({ frame.id, true });
+        graph_.ForEachPrecedent(frame.id, [&](Id precedent) {
+            if (expanded.count(precedent) == 0 && pending_formula(precedent) != nullptr) {
+                stack.push_back({ precedent, false });
+            }
+        });
+    }
+}
+
+/**
+ * Создает объект Cell для числа, хранящегося в колоночном виде по адресу pos.
+ * Возвращает nullptr, если позиция не хранит число
+*/
+Cell* Sheet::MaterializeNumber(Position pos) const {
+    const double* number = table_.GetNumber(pos);
+    if (number == nullptr) {
+        return nullptr;
+    }
+
+    std::string text = FormatNumber(*number);
+
+    // Ячейка хранит ссылку на изменяемую таблицу, которой и является *this
+    Sheet& sheet = const_cast<Sheet&>(*this);
+    Cell* cell = table_.Set(pos, MakePooled<Cell>(sheet.GetMemoryResource(), sheet, pos));
+    cell->Set(std::move(text));
+
+    return cell;
+}
+
+/**
+ * Возвращает объект-представление числа, хранящегося в колоночном виде,
+ * или пустой позиции, на которую ссылаются формулы, чтобы GetCell()
+ * возвращал для нее объект. Представления создаются при первом обращении
+ * под исключительной блокировкой и не меняют хранилище ячеек, поэтому
+ * безопасны для одновременного чтения
+*/
+Cell* Sheet::GetProxy(Position pos) const {
+    const double* number = table_.GetNumber(pos);
+    const DependencyGraph::Id id = DependencyGraph::ToId(pos);
+    if (number == nullptr && !graph_.HasDependents(id)) {
+        return nullptr;
+    }
+
+    {
+        std::shared_lock guard(proxies_mutex_);
+        if (const auto it = proxies_.find(id); it != proxies_.end()) {
+            return it->second.get();
+        }
+    }
+
+    std::unique_lock guard(proxies_mutex_);
+    PoolPtr<Cell>& proxy = proxies_[id];
+    if (!proxy) {
+        // Ячейка хранит ссылку на изменяемую таблицу, которой и является *this
+        Sheet& sheet = const_cast<Sheet&>(*this);
+        proxy = MakePooled<Cell>(sheet.GetMemoryResource(), sheet, pos);
+        if (number != nullptr) {
+            proxy->LoadNumber(*number, FormatNumber(*number));
+        }
+    }
+    return proxy.get();
+}
+/**
+ * Переносит представление позиции pos, выданное GetCell(), в хранилище
+ * ячеек перед изменением позиции, чтобы полученный читателем указатель
+ * оставался действительным и показывал новое содержимое. Возвращает
+ * nullptr, если представления нет
+*/
+Cell* Sheet::AdoptProxy(Position pos) {
+    if (proxies_.empty()) {
+        return nullptr;
+    }
+    const auto it = proxies_.find(DependencyGraph::ToId(pos));
+    if (it == proxies_.end()) {
+        return nullptr;
+    }
+
+    PoolPtr<Cell> proxy = std::move(it->second);
+    proxies_.erase(it);
+    return table_.Set(pos, std::move(proxy));
+}
+/**
+ * Удаляет представление очищаемой позиции pos
+*/
+void Sheet::DropProxy(Position pos) {
+    if (!proxies_.empty()) {
+        proxies_.erase(DependencyGraph::ToId(pos));
+    }
+}
+
+/**
+ * Очищает ячейку по адресу pos
+*/
+void Sheet::ClearCell(Position pos) {
+    // Если позиция невалидная - выбрасываем исключение
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid clear position");
+    }
+
+    if (TryWriteInTile(pos, std::nullopt)) {
+        return;
+    }
+    std::unique_lock guard(write_mutex_);
+    ClearCellContent(pos);
+}
+/**
+ * Очищает ячейку по адресу pos, позиция должна быть валидной
+*/
+void Sheet::ClearCellContent(Position pos) {
+    // Если pos указывает на пустую ячейку - ничего не делаем
+    DropProxy(pos);
+    if (!table_.Contains(pos)) {
+        return;
+    }
+    RecordEdit(pos);
+    MarkChangedTile(pos);
+    const bool was_printable = IsPrintable(pos);
+
+    // Ячейка очищается, чтобы удалить ее ссылки из графа зависимостей и
+    // инвалидировать зависимые. Ссылки на освобожденную позицию остаются в графе.
+    // Числа удаляются из колоночного хранилища без создания ячейки
+    if (Cell* cell = table_.Get(pos); cell != nullptr) {
+        cell->Clear();
+        table_.Erase(pos);
+    }
+    else {
+        table_.Erase(pos);
+        if (!transaction_) {
+            InvalidateDependents(pos);
         }
+    }
+
+    UpdatePrintableArea(pos, was_printable, false);
+    OnEdit();
+}
+
+/**
+ * Возвращает true, если позиция содержит непустой текст
+ * и потому входит в печатную область
+*/
+bool Sheet::IsPrintable(Position pos) const {
+    if (table_.GetNumber(pos) != nullptr) {
+        return true;
+    }
+
+    const Cell* cell = table_.Get(pos);
+    return cell != nullptr && !cell->IsEmpty();
+}
+/**
+ * Учитывает смену заполненности позиции pos в счетчиках строк и столбцов
+ * и пересчитывает размер печатной области за O(log n)
+*/
+void Sheet::UpdatePrintableArea(Position pos, bool was_printable, bool is_printable) {
+    if (was_printable == is_printable) {
+        return;
+    }
 
-        if (is_found) {
-            break;
+    if (is_printable) {
+        ++row_counts_[pos.row];
+        ++col_counts_[pos.col];
+    }
+    else {
+        if (--row_counts_[pos.row] == 0) {
+            row_counts_.erase(pos.row);
+        }
+        if (--col_counts_[pos.col] == 0) {
+            col_counts_.erase(pos.col);
         }
     }
+
+    // Печатная область ограничена последними непустыми строкой и столбцом
+    print_size_.rows = row_counts_.empty() ? 0 : row_counts_.rbegin()->first + 1;
+    print_size_.cols = col_counts_.empty() ? 0 : col_counts_.rbegin()->first + 1;
 }
 
 /**
@@ -166,6 +1204,59 @@ Size Sheet::GetPrintableSize() const {
     return print_size_;
 }
 
+/**
+ * Удаляет все ячейки таблицы. Объекты ячеек разрушаются по одному, так
+ * как их формулы и строки освобождают свои ресурсы, а память пула затем
+ * возвращается вышестоящему ресурсу разом
+*/
+void Sheet::Clear() {
+    std::unique_lock guard(write_mutex_);
+    transaction_.reset();
+    proxies_.clear();
+    graph_.Clear();
+    range_dependencies_.Clear();
+    table_.Clear();
+    pool_.release();
+    row_counts_.clear();
+    col_counts_.clear();
+    print_size_ = { 0, 0 };
+    dirty_.clear();
+    dirty_limit_ = MIN_DIRTY_LIMIT;
+    snapshot_.reset();
+    changed_tile_flags_.assign(changed_tile_flags_.size(), false);
+    changed_tiles_.clear();
+}
+
+/**
+ * Возвращает ресурс памяти, в котором размещаются ячейки и формулы таблицы
+*/
+std::pmr::memory_resource* Sheet::GetMemoryResource() {
+    return &pool_;
+}
+/**
+ * Возвращает статистику обращений таблицы к системному распределителю памяти
+*/
+const AllocationStats& Sheet::GetAllocationStats() const {
+    return memory_.GetStats();
+}
+
+/**
+ * Возвращает пул значений текстовых ячеек таблицы
+*/
+StringPool& Sheet::GetStringPool() {
+    return strings_;
+}
+const StringPool& Sheet::GetStringPool() const {
+    return strings_;
+}
+
+FormulaCache& Sheet::GetFormulaCache() {
+    return formulas_;
+}
+const FormulaCache& Sheet::GetFormulaCache() const {
+    return formulas_;
+}
+
 std::ostream& operator<<(std::ostream& os, const CellInterface::Value& val) {
     if (std::holds_alternative<std::string>(val)) {
         os << std::get<std::string>(val);
@@ -179,45 +1270,241 @@ std::ostream& operator<<(std::ostream& os, const CellInterface::Value& val) {
 
     return os;
 }
+std::ostream& operator<<(std::ostream& os, const CellInterface::ValueView& val) {
+    std::visit([&os](const auto& value) { os << value; }, val);
+
+    return os;
+}
 /**
- * Выводит значения ячеек таблицы
+ * Выводит печатную область таблицы построчно, вызывая print_cell
+ * только для занятых позиций. Пустые тайлы пропускаются целиком
 */
-void Sheet::PrintValues(std::ostream& output) const {
+template <typename Printer>
+void Sheet::PrintCells(std::ostream& output, Printer print_cell) const {
     for (int y = 0; y < print_size_.rows; ++y) {
-        for (int x = 0; x < print_size_.cols; ++x) {
-            // Выводим табуляцию перед всеми элементами, кроме первого
-            if (x != 0) {
+        // Количество табуляций, выведенных в текущей строке
+        int tabs = 0;
+
+        table_.ForEachInRow(y, print_size_.cols, [&](int x, const Cell* cell, const double* number) {
+            for (; tabs < x; ++tabs) {
                 output << '\t';
             }
 
-            // Если ячейка имеет ненулевой указатель - выводим значение
-            if (table_[y][x] != nullptr) {
-                output << table_[y][x]->GetValue();
+            // Число из колоночного хранилища является и значением, и текстом ячейки
+            if (cell == nullptr) {
+                output << FormatNumber(*number);
+            }
+            else {
+                print_cell(*cell);
             }
+        });
+
+        // Дополняем строку табуляциями до ширины печатной области
+        for (; tabs < print_size_.cols - 1; ++tabs) {
+            output << '\t';
         }
 
         output << '\n';
     }
 }
+/**
+ * Выводит значения ячеек таблицы
+*/
+void Sheet::PrintValues(std::ostream& output) const {
+    if (recalc_policy_ == RecalcPolicy::Adaptive) {
+        reads_.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (print_size_.rows > 0 && print_size_.cols > 0) {
+        EvaluateRange({ { 0, 0 }, { print_size_.rows - 1, print_size_.cols - 1 } });
+    }
+    PrintCells(output, [&output](const Cell& cell) {
+        output << cell.GetValueView();
+    });
+}
 /**
  * Выводит содержимое ячеек таблицы
 */
 void Sheet::PrintTexts(std::ostream& output) const {
-    for (int y = 0; y < print_size_.rows; ++y) {
-        for (int x = 0; x < print_size_.cols; ++x) {
-            // Выводим табуляцию перед всеми элементами, кроме первого
-            if (x != 0) {
-                output << '\t';
-            }
+    PrintCells(output, [&output](const Cell& cell) {
+        output << cell.GetText();
+    });
+}
+
+/**
+ * Записывает число в позицию pos или удаляет его без исключительной
+ * блокировки таблицы. Под блокировкой тайла меняется только его
+ * содержимое; печатная область и списки изменений обновляются под
+ * edit_mutex_. Зависимые формулы отмечаются после снятия блокировки тайла:
+ * одновременные записи, затрагивающие общие формулы, лишь повторно
+ * отмечают их, и результат не зависит от порядка записей
+*/
+bool Sheet::TryWriteInTile(Position pos, std::optional<double> number) {
+    std::shared_lock structure_guard(write_mutex_);
+
+    // Транзакция и немедленный пересчет требуют исключительного доступа.
+    // Они начинаются под исключительной блокировкой, поэтому читаются под
+    // разделяемой
+    if (transaction_ || recalc_policy_ == RecalcPolicy::Eager
+        || recalc_policy_ == RecalcPolicy::Adaptive)
+    {
+        return false;
+    }
 
-            // Если ячейка имеет ненулевой указатель - выводим содержимое
-            if (table_[y][x] != nullptr) {
-                output << table_[y][x]->GetText();
+    bool occupied = false;
+    {
+        std::lock_guard tile_guard(GetTileMutex(pos));
+
+        // Объект ячейки - формула или текст - связан с графом зависимостей.
+        // Тайлы создаются и освобождаются только под исключительной блокировкой
+        const int count = table_.CountInTile(pos);
+        occupied = table_.Contains(pos);
+        if (count == 0 || table_.Get(pos) != nullptr || (!number && occupied && count == 1)) {
+            return false;
+        }
+
+        // Выданное представление переносится в хранилище ячеек, что меняет
+        // его структуру
+        {
+            std::shared_lock proxies_guard(proxies_mutex_);
+            if (!proxies_.empty() && proxies_.count(DependencyGraph::ToId(pos)) != 0) {
+                return false;
             }
         }
 
-        output << '\n';
+        if (number) {
+            table_.SetNumber(pos, *number);
+        }
+        else if (occupied) {
+            table_.Erase(pos);
+        }
+        else {
+            return true;
+        }
+
+        std::lock_guard edit_guard(edit_mutex_);
+        MarkChangedTile(pos);
+        UpdatePrintableArea(pos, occupied, number.has_value());
+    }
+
+    std::vector<std::pair<Position, Cell*>> marked;
+    MarkDependentsDirty(pos, [&marked](Position dependent, Cell* cell) {
+        marked.emplace_back(dependent, cell);
+    });
+    if (!marked.empty()) {
+        std::lock_guard edit_guard(edit_mutex_);
+        for (const auto& [dependent, cell] : marked) {
+            ListDirty(dependent, cell);
+        }
+    }
+    return true;
+}
+/**
+ * Возвращает блокировку тайла позиции pos. Номер тайла перемешивается
+ * мультипликативным хешем, чтобы соседние тайлы строки и столбца
+ * попадали на разные блокировки
+*/
+std::mutex& Sheet::GetTileMutex(Position pos) {
+    const uint32_t tile = static_cast<uint32_t>(pos.row / CellTable::TILE_SIZE * CellTable::TILE_COLS
+                                                + pos.col / CellTable::TILE_SIZE);
+    return tile_mutexes_[(tile * 2654435761u) >> 24].mutex;
+}
+
+/**
+ * Отмечает тайл позиции pos измененным с последнего снимка
+*/
+void Sheet::MarkChangedTile(Position pos) {
+    const uint32_t tile = static_cast<uint32_t>(pos.row / CellTable::TILE_SIZE * CellTable::TILE_COLS
+                                                + pos.col / CellTable::TILE_SIZE);
+    if (!changed_tile_flags_[tile]) {
+        changed_tile_flags_[tile] = true;
+        changed_tiles_.push_back(tile);
+    }
+}
+/**
+ * Строит новую версию снимка. Страницы измененных тайлов строятся заново,
+ * строки страниц с ними копируются, остальные строки разделяются с
+ * прежним снимком
+*/
+std::shared_ptr<const SheetSnapshot> Sheet::Snapshot() {
+    std::unique_lock guard(write_mutex_);
+    if (recalc_policy_ != RecalcPolicy::Manual) {
+        Recalculate();
+    }
+    if (snapshot_ && changed_tiles_.empty()
+        && snapshot_->GetPrintableSize() == print_size_)
+    {
+        return snapshot_;
+    }
+
+    std::vector<uint32_t> tiles = std::move(changed_tiles_);
+    changed_tiles_.clear();
+    for (const uint32_t tile : tiles) {
+        changed_tile_flags_[tile] = false;
+    }
+    std::sort(tiles.begin(), tiles.end());
+
+    SheetSnapshot::PageRows rows;
+    if (snapshot_) {
+        rows = snapshot_->GetPageRows();
+    }
+
+    // Измененные тайлы одной строки идут подряд: строка копируется один раз
+    std::shared_ptr<SnapshotPageRow> row;
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        const int tile_row = static_cast<int>(tiles[i] / CellTable::TILE_COLS);
+        const int tile_col = static_cast<int>(tiles[i] % CellTable::TILE_COLS);
+        if (i == 0 || tiles[i - 1] / CellTable::TILE_COLS != tiles[i] / CellTable::TILE_COLS) {
+            row = rows[tile_row] ? std::make_shared<SnapshotPageRow>(*rows[tile_row])
+                                 : std::make_shared<SnapshotPageRow>();
+            rows[tile_row] = row;
+        }
+        row->pages[tile_col] = BuildSnapshotPage(tile_row, tile_col);
+    }
+
+    snapshot_ = std::make_shared<const SheetSnapshot>(++snapshot_version_, std::move(rows), print_size_);
+    return snapshot_;
+}
+/**
+ * Копирует ячейки тайла в страницу снимка. Тайл с формулами, оставшимися
+ * устаревшими (ручная политика), остается отмеченным измененным: их
+ * значения попадут в снимок после пересчета
+*/
+std::shared_ptr<const SnapshotPage> Sheet::BuildSnapshotPage(int tile_row, int tile_col) {
+    const Position first{ tile_row * CellTable::TILE_SIZE, tile_col * CellTable::TILE_SIZE };
+    const Range range{ first, { first.row + CellTable::TILE_SIZE - 1, first.col + CellTable::TILE_SIZE - 1 } };
+
+    std::vector<std::pair<uint16_t, SnapshotCell>> entries;
+    bool stale = false;
+    table_.ForEachInRange(range, [&entries](Position pos, const double* values, size_t count) {
+        for (size_t i = 0; i < count; ++i, ++pos.row) {
+            std::string text = FormatNumber(values[i]);
+            entries.emplace_back(SnapshotPage::IndexInTile(pos),
+                                 SnapshotCell(text, text, values[i], {}));
+        }
+    }, [&entries, &stale](const Cell& cell) {
+        stale = stale || cell.IsDirty();
+        entries.emplace_back(SnapshotPage::IndexInTile(cell.GetPosition()),
+                             SnapshotCell(cell.GetText(), cell.GetValue(), cell.GetNumericValue(),
+                                          cell.GetReferencedCells()));
+    });
+    if (stale) {
+        MarkChangedTile(first);
+    }
+    if (entries.empty()) {
+        return nullptr;
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first < rhs.first;
+    });
+    auto page = std::make_shared<SnapshotPage>();
+    page->indices.reserve(entries.size());
+    page->cells.reserve(entries.size());
+    for (auto& [index, cell] : entries) {
+        page->indices.push_back(index);
+        page->cells.push_back(std::move(cell));
     }
+    return page;
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
@@ -1,23 +1,157 @@
 #pragma once
 
+#include "arena.h"
 #include "cell.h"
+#include "cell_table.h"
 #include "common.h"
+#include "dependency_graph.h"
+#include "formula_cache.h"
+#include "range_index.h"
+#include "snapshot.h"
+#include "string_pool.h"
 
+#include <array>
+#include <atomic>
 #include <functional>
+#include <map>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 class Cell;
 
 class Sheet : public SheetInterface {
 public:
+    // Политика пересчета формул, зависящих от измененных ячеек
+    enum class RecalcPolicy {
+        Lazy, // При чтении устаревшей формулы (по умолчанию)
+        Eager, // Сразу после каждого изменения вне транзакции и после Commit()
+        Manual, // Только в Recalculate(); чтение возвращает последнее вычисленное значение
+        Adaptive, // Как Eager, пока чтений ячеек не меньше изменений, иначе как Lazy
+    };
+
+    Sheet() = default;
+    Sheet(const Sheet&) = delete;
+    Sheet& operator=(const Sheet&) = delete;
     ~Sheet() {}
 
+    // SetCell() и ClearCell() можно вызывать из нескольких потоков
+    // одновременно, в том числе вместе с SetCells(), транзакциями,
+    // SetRecalcPolicy(), Clear() и Snapshot(). Параллельно выполняются
+    // только числовые изменения: запись и удаление числа в уже созданном
+    // тайле вне транзакции при политиках Lazy и Manual блокируют один тайл,
+    // а зависимые формулы отмечаются устаревшими без блокировки других
+    // тайлов. Формулы, текст, создание и освобождение тайлов, как и снимок,
+    // выполняются по одному под исключительной блокировкой таблицы.
+    // Порядок блокировок: таблица, тайл, представления ячеек, списки
+    // изменений
     void SetCell(Position pos, std::string text) override;
 
+    // Пакетно задает содержимое ячеек. Сначала разбираются все формулы,
+    // затем одним линейным проходом (алгоритм Тарьяна) по итоговому графу
+    // ищутся циклы, после чего содержимое устанавливается без поячеечных
+    // проверок, а зависимости и кэши обновляются одним проходом.
+    // Если позиция повторяется, действует последнее значение.
+    // При некорректной позиции, формуле или циклической зависимости
+    // бросается соответствующее исключение и таблица не изменяется;
+    // сообщение CircularDependencyException перечисляет все ячейки циклов.
+    void SetCells(std::vector<std::pair<Position, std::string>> cells);
+
+    // Транзакция изменений. Внутри транзакции изменения не инвалидируют кэши
+    // сразу: при Commit() объединение зависимых ячеек инвалидируется одним
+    // проходом. Rollback() возвращает измененным ячейкам прежнее содержимое.
+    // Если изменение внутри транзакции бросает FormulaException или
+    // CircularDependencyException, транзакция откатывается целиком,
+    // после чего исключение пробрасывается дальше.
+    void BeginTransaction();
+    void Commit();
+    void Rollback();
+    bool IsInTransaction() const;
+
+    // Чтение таблицы - GetCell(), значения и тексты ячеек, EvaluateRange(),
+    // PrintValues() и PrintTexts() - можно выполнять из нескольких потоков
+    // одновременно, пока таблицу никто не изменяет. Вычисленные значения
+    // читаются без блокировок; формулу без актуального кэша вычисляет
+    // захвативший ее поток, а остальные, которым она нужна, ждут только
+    // ее. Изменения, Recalculate() и RecalculateAll() требуют
+    // исключительного доступа к таблице (одновременные SetCell() и
+    // ClearCell() - см. выше).
+    // Для числа и для пустой позиции, на которую ссылаются формулы,
+    // возвращается объект-представление. Как и объект любой ячейки, он
+    // остается действительным и показывает текущее содержимое позиции,
+    // пока она не очищена ClearCell() или Clear()
     CellInterface* GetCell(Position pos) override;
     const CellInterface* GetCell(Position pos) const override;
 
-    CellInterface* GetOrCreateCell(Position pos);
+    void VisitRange(Range range, RangeVisitor& visitor) const override;
+    void GetColumnValues(Position first, size_t count,
+                         double* values, bool* numeric) const override;
+    CellInterface::NumericValue GetNumericValue(Position pos) const override;
+
+    // Количество текстовых ячеек, текст которых является записью числа
+    // (например, импортированных из CSV). Линейно по числу ячеек
+    size_t CountNumericTextCells() const;
+
+    // Вычисляет устаревшие формулы диапазона. Подряд идущие ячейки
+    // столбца с общей относительной формулой (заполненные копированием)
+    // вычисляются одним пакетом над массивами значений операндов, остальные -
+    // в топологическом порядке графа зависимостей.
+    // Значения сохраняются в кэшах ячеек
+    void EvaluateRange(Range range) const;
+
+    // Пересчитывает все устаревшие формулы в thread_count потоках (0 - по числу
+    // ядер). Формула ставится в очередь готовых, когда вычислены все
+    // формулы, на которые она ссылается; очереди потоков балансируются
+    // кражей работы. Кэш каждой формулы пишет ровно один поток, а читают
+    // его только зависимые формулы, запущенные после записи
+    void RecalculateAll(size_t thread_count = 0) const;
+
+    void SetRecalcPolicy(RecalcPolicy policy);
+    RecalcPolicy GetRecalcPolicy() const;
+    // Пересчитывает все устаревшие формулы в топологическом порядке
+    void Recalculate() const;
+    // Количество формул, отмеченных устаревшими
+    size_t GetDirtyCount() const;
+
+    // Объект ячейки без создания его для числовой позиции (nullptr для чисел)
+    Cell* FindCell(Position pos);
+    const Cell* FindCell(Position pos) const;
+    // Вызывает func(const Cell&) для всех объектов ячеек диапазона
+    template <typename Func>
+    void ForEachCellInRange(Range range, Func func) const;
+
+    // Граф зависимостей формул. Кроме ссылок на отдельные ячейки он содержит
+    // ссылки на формулы, лежащие в диапазонах: только они задают порядок
+    // вычисления и могут замкнуть цикл
+    DependencyGraph& GetDependencyGraph();
+    const DependencyGraph& GetDependencyGraph() const;
+    // Вершины графа, на которые ссылается формула с такими ссылками
+    std::vector<DependencyGraph::Id> CollectPrecedents(const std::vector<Position>& cells,
+                                                       const std::vector<Range>& ranges) const;
+
+    // Зависимости формул от диапазонов. Ячейки диапазонов не связываются
+    // с зависимыми формулами поштучно: таблица хранит диапазоны каждой формулы
+    // и при изменении позиции инвалидирует формулы, диапазоны которых ее
+    // содержат. Поиск просматривает формулы блока позиции, см. RangeIndex.
+    void SetRangeDependencies(Position pos, std::vector<Range> ranges);
+    // Формулы, диапазоны которых содержат позицию pos
+    std::vector<DependencyGraph::Id> FindRangeDependents(Position pos) const;
+
+    // Отмечает устаревшими формулу в позиции pos и формулы, зависящие от
+    // нее по ссылке или через диапазон. Обход итеративный и не заходит
+    // в уже устаревшие формулы: их зависимые устарели вместе с ними
+    void InvalidateDependents(Position pos);
+    // Отмечает устаревшей формулу в позиции pos без обхода зависимых.
+    // Возвращает false, если она уже отмечена или позиция не хранит формулу
+    bool MarkDirty(Position pos);
+    // Вычисляет формулу в позиции pos и все формулы без кэша, от которых
+    // она зависит, в порядке зависимостей и без рекурсии
+    void EvaluateFormulas(Position pos) const;
 
     void ClearCell(Position pos) override;
 
@@ -26,9 +160,155 @@ public:
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    // Неизменяемое представление таблицы на момент вызова. Устаревшие
+    // формулы перед этим пересчитываются; при ручной политике снимок
+    // содержит последние вычисленные значения. Снимок разделяет страницы
+    // тайлов, не изменявшихся с прошлого снимка, поэтому его стоимость
+    // пропорциональна числу измененных тайлов. Без изменений возвращается
+    // прежний снимок. Снимок берется под исключительной блокировкой
+    // таблицы, поэтому его можно вызывать одновременно с SetCell() и
+    // ClearCell(). Снимок читается из любых потоков, пока таблица
+    // изменяется, и может пережить таблицу
+    std::shared_ptr<const SheetSnapshot> Snapshot();
+
+    // Удаляет все ячейки таблицы и возвращает память пула целиком
+    void Clear();
+
+    // Ресурс памяти, в котором размещаются ячейки и формулы таблицы
+    std::pmr::memory_resource* GetMemoryResource();
+    // Статистика обращений таблицы к системному распределителю памяти
+    const AllocationStats& GetAllocationStats() const;
+
+    // Пул значений текстовых ячеек таблицы
+    StringPool& GetStringPool();
+    const StringPool& GetStringPool() const;
+
+    // Кэш формул таблицы: одинаковые формулы разбираются и хранятся один раз
+    FormulaCache& GetFormulaCache();
+    const FormulaCache& GetFormulaCache() const;
+
 private:
+    struct PendingCell;
+
+    struct Transaction {
+        // Содержимое позиций до транзакции; nullopt - позиция была свободна
+        std::unordered_map<int, std::optional<std::string>> original_texts;
+        std::vector<Position> edited; // Измененные позиции в порядке первого изменения
+    };
+
+    void SetCellContent(Position pos, std::string text);
+    void ClearCellContent(Position pos);
+    // Учитывает изменение вне транзакции и пересчитывает устаревшие
+    // формулы, если этого требует политика пересчета
+    void OnEdit();
+    // Устаревшие формулы списка без повторов; список очищается
+    std::vector<DependencyGraph::Id> TakeDirtyFormulas() const;
+    // Удаляет из списка устаревших повторы и уже пересчитанные формулы
+    void CompactDirty();
+
+    // SetCells() и Rollback() без блокировки: вызываются из изменений,
+    // уже держащих исключительную блокировку таблицы
+    void LoadCells(std::vector<std::pair<Position, std::string>> cells);
+    void RollbackTransaction();
+    void RecordEdit(Position pos);
+    void AbortTransaction();
+
+    Cell* MaterializeNumber(Position pos) const;
+    // Объект-представление числа или пустой позиции со ссылками на нее;
+    // nullptr, если позиция свободна и на нее не ссылаются
+    Cell* GetProxy(Position pos) const;
+    // Делает выданное представление позиции ячейкой таблицы перед ее
+    // изменением; nullptr, если представления нет
+    Cell* AdoptProxy(Position pos);
+    // Удаляет представление позиции при ее очистке
+    void DropProxy(Position pos);
+
+    // Записывает число в позицию pos, а при nullopt удаляет из нее число,
+    // под блокировкой ее тайла. Возвращает false, не изменяя таблицу, если
+    // изменение требует исключительной блокировки таблицы
+    bool TryWriteInTile(Position pos, std::optional<double> number);
+    std::mutex& GetTileMutex(Position pos);
+    // Отмечает устаревшими формулу в позиции pos и зависящие от нее формулы
+    // и вызывает on_marked(Position, Cell*) для каждой вновь отмеченной
+    template <typename OnMarked>
+    void MarkDependentsDirty(Position pos, OnMarked on_marked);
+    // Вносит отмеченную устаревшей формулу в список устаревших
+    void ListDirty(Position pos, Cell* cell);
+
+    // Отмечает тайл позиции измененным с последнего снимка
+    void MarkChangedTile(Position pos);
+    // Страница снимка с ячейками тайла; nullptr, если тайл пуст
+    std::shared_ptr<const SnapshotPage> BuildSnapshotPage(int tile_row, int tile_col);
+
+    std::vector<Position> FindCircularCells(
+        const std::unordered_map<int, PendingCell>& pending) const;
+
+    bool IsPrintable(Position pos) const;
+    void UpdatePrintableArea(Position pos, bool was_printable, bool is_printable);
+
+    template <typename Printer>
+    void PrintCells(std::ostream& output, Printer print_cell) const;
+
+    CountingResource memory_; // Источник блоков памяти пула со счетчиками
+    std::pmr::unsynchronized_pool_resource pool_{ &memory_ }; // Пул объектов таблицы
+    StringPool strings_; // Пул значений текстовых ячеек
+    FormulaCache formulas_{ &pool_ }; // Кэш разобранных формул
+
     Size print_size_ = { 0, 0 }; // Размер печатной области таблицы. По умолчанию (0, 0)
-    Size fact_size_ = { 0, 0 }; // Фактический размер таблицы. По умолчанию (0, 0)
+    std::map<int, int> row_counts_; // Количество непустых ячеек в каждой непустой строке
+    std::map<int, int> col_counts_; // Количество непустых ячеек в каждом непустом столбце
+
+    std::optional<Transaction> transaction_; // Текущая транзакция
+
+    DependencyGraph graph_; // Ссылки формул на отдельные ячейки
+    // Диапазоны, от которых зависят формулы, по идентификаторам их позиций
+    RangeIndex range_dependencies_;
+
+    RecalcPolicy recalc_policy_ = RecalcPolicy::Lazy; // Политика пересчета
+    // Формулы, отмеченные устаревшими. Формула, вычисленная при чтении,
+    // остается в списке, а отмеченная заново попадает в него повторно:
+    // список прореживается, когда его размер достигает dirty_limit_
+    mutable std::vector<DependencyGraph::Id> dirty_;
+    size_t dirty_limit_ = MIN_DIRTY_LIMIT;
+    static constexpr size_t MIN_DIRTY_LIMIT = 1024;
+    // Счетчики чтений и изменений для адаптивной политики. Когда их сумма
+    // достигает ADAPTIVE_WINDOW, оба делятся пополам, чтобы решение
+    // следовало за недавней нагрузкой
+    mutable std::atomic<size_t> reads_{ 0 };
+    size_t writes_ = 0;
+    static constexpr size_t ADAPTIVE_WINDOW = 1024;
+
+    // Представления чисел и пустых позиций, выданные GetCell(). Хранятся
+    // отдельно от table_, чтобы чтение не изменяло хранилище ячеек
+    mutable std::shared_mutex proxies_mutex_;
+    mutable std::unordered_map<DependencyGraph::Id, PoolPtr<Cell>> proxies_;
+
+    // Блокировки одновременных изменений. Запись числа в тайл держит
+    // write_mutex_ на чтение и блокировку тайла, остальные изменения -
+    // write_mutex_ на запись. Тайлы распределены по TILE_MUTEXES блокировкам
+    // хешем номера. edit_mutex_ защищает при записях в тайлы списки
+    // устаревших формул и измененных тайлов и печатную область
+    struct alignas(64) TileMutex {
+        std::mutex mutex;
+    };
+    static constexpr size_t TILE_MUTEXES = 256;
+    std::shared_mutex write_mutex_;
+    std::array<TileMutex, TILE_MUTEXES> tile_mutexes_;
+    std::mutex edit_mutex_;
+
+    // Последний снимок и тайлы, измененные после него: текст, значение
+    // или устаревание формулы. Номер тайла - tile_row * TILE_COLS + tile_col
+    std::shared_ptr<const SheetSnapshot> snapshot_;
+    uint64_t snapshot_version_ = 0;
+    std::vector<bool> changed_tile_flags_ = std::vector<bool>(CellTable::TILE_ROWS * CellTable::TILE_COLS);
+    std::vector<uint32_t> changed_tiles_;
+
+    // Разреженное хранилище ячеек. Изменяемо из константных методов, так как
+    // константные методы возвращают изменяемые объекты Cell
+    mutable CellTable table_;
+};
 
-    std::vector<std::vector<std::unique_ptr<Cell>>> table_; // Таблица
-};
\ No newline at end of file
+template <typename Func>
+void Sheet::ForEachCellInRange(Range range, Func func) const {
+    table_.ForEachInRange(range, [](Position, const double*, size_t) {}, func);
+}
@@ -0,0 +1,132 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+SnapshotCell::SnapshotCell(std::string text, Value value, NumericValue numeric,
+                           std::vector<Position> referenced)
+    : text_(std::move(text))
+    , value_(std::move(value))
+    , numeric_(numeric)
+    , referenced_(std::move(referenced))
+{}
+
+CellInterface::Value SnapshotCell::GetValue() const {
+    return value_;
+}
+std::string SnapshotCell::GetText() const {
+    return text_;
+}
+std::vector<Position> SnapshotCell::GetReferencedCells() const {
+    return referenced_;
+}
+/**
+ * Возвращает значение без копирования; представление действительно,
+ * пока жив снимок
+*/
+CellInterface::ValueView SnapshotCell::GetValueView() const {
+    return std::visit([](const auto& value) -> ValueView { return value; }, value_);
+}
+CellInterface::NumericValue SnapshotCell::GetNumericValue() const {
+    return numeric_;
+}
+
+/**
+ * Возвращает ячейку страницы в позиции pos или nullptr, если позиция пуста
+*/
+const SnapshotCell* SnapshotPage::Find(Position pos) const {
+    const uint16_t index = IndexInTile(pos);
+    const auto it = std::lower_bound(indices.begin(), indices.end(), index);
+    if (it == indices.end() || *it != index) {
+        return nullptr;
+    }
+    return &cells[it - indices.begin()];
+}
+
+SheetSnapshot::SheetSnapshot(uint64_t version, PageRows rows, Size size)
+    : version_(version)
+    , rows_(std::move(rows))
+    , size_(size)
+{}
+
+uint64_t SheetSnapshot::GetVersion() const {
+    return version_;
+}
+/**
+ * Возвращает строки страниц снимка, из которых таблица строит следующую версию
+*/
+const SheetSnapshot::PageRows& SheetSnapshot::GetPageRows() const {
+    return rows_;
+}
+
+void SheetSnapshot::SetCell(Position /*pos*/, std::string /*text*/) {
+    throw std::logic_error("Snapshot is read-only");
+}
+void SheetSnapshot::ClearCell(Position /*pos*/) {
+    throw std::logic_error("Snapshot is read-only");
+}
+
+/**
+ * Возвращает ячейку снимка по адресу pos или nullptr для пустой позиции
+*/
+const CellInterface* SheetSnapshot::GetCell(Position pos) const {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid get position");
+    }
+    return FindCell(pos);
+}
+/**
+ * Ячейки снимка неизменяемы: все методы CellInterface константны
+*/
+CellInterface* SheetSnapshot::GetCell(Position pos) {
+    return const_cast<CellInterface*>(std::as_const(*this).GetCell(pos));
+}
+
+const SnapshotCell* SheetSnapshot::FindCell(Position pos) const {
+    const SnapshotPageRow* row = rows_[pos.row / CellTable::TILE_SIZE].get();
+    if (row == nullptr) {
+        return nullptr;
+    }
+    const SnapshotPage* page = row->pages[pos.col / CellTable::TILE_SIZE].get();
+    return page != nullptr ? page->Find(pos) : nullptr;
+}
+
+Size SheetSnapshot::GetPrintableSize() const {
+    return size_;
+}
+
+/**
+ * Выводит печатную область снимка построчно, вызывая print_cell для
+ * занятых позиций
+*/
+template <typename Printer>
+void SheetSnapshot::PrintCells(std::ostream& output, Printer print_cell) const {
+    for (int row = 0; row < size_.rows; ++row) {
+        for (int col = 0; col < size_.cols; ++col) {
+            if (col > 0) {
+                output << '\t';
+            }
+            if (const SnapshotCell* cell = FindCell({ row, col })) {
+                print_cell(*cell);
+            }
+        }
+        output << '\n';
+    }
+}
+/**
+ * Выводит значения ячеек снимка
+*/
+void SheetSnapshot::PrintValues(std::ostream& output) const {
+    PrintCells(output, [&output](const SnapshotCell& cell) {
+        std::visit([&output](const auto& value) { output << value; }, cell.GetValueView());
+    });
+}
+/**
+ * Выводит содержимое ячеек снимка
+*/
+void SheetSnapshot::PrintTexts(std::ostream& output) const {
+    PrintCells(output, [&output](const SnapshotCell& cell) {
+        output << cell.GetText();
+    });
+}
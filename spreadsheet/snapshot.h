@@ -0,0 +1,89 @@
+#pragma once
+
+#include "cell_table.h"
+#include "common.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Неизменяемая копия ячейки таблицы: текст, значение и ссылки на момент
+// создания снимка
+class SnapshotCell : public CellInterface {
+public:
+    SnapshotCell(std::string text, Value value, NumericValue numeric,
+                 std::vector<Position> referenced);
+
+    Value GetValue() const override;
+    std::string GetText() const override;
+    std::vector<Position> GetReferencedCells() const override;
+    ValueView GetValueView() const override;
+    NumericValue GetNumericValue() const override;
+
+private:
+    std::string text_;
+    Value value_;
+    NumericValue numeric_; // Значение как операнд формулы
+    std::vector<Position> referenced_;
+};
+
+// Страница снимка - ячейки одного тайла таблицы в порядке позиций внутри
+// тайла. Страница неизменяема и разделяется всеми версиями, между которыми
+// тайл не менялся
+struct SnapshotPage {
+    std::vector<uint16_t> indices; // Номера позиций в тайле по возрастанию
+    std::vector<SnapshotCell> cells;
+
+    static uint16_t IndexInTile(Position pos) {
+        return static_cast<uint16_t>((pos.row % CellTable::TILE_SIZE) * CellTable::TILE_SIZE
+                                     + pos.col % CellTable::TILE_SIZE);
+    }
+
+    const SnapshotCell* Find(Position pos) const;
+};
+
+// Страницы одной строки тайлов
+struct SnapshotPageRow {
+    std::array<std::shared_ptr<const SnapshotPage>, CellTable::TILE_COLS> pages;
+};
+
+// Снимок таблицы: неизменяемое версионное представление только для чтения.
+// Страницы хранятся двухуровневым деревом с копированием при записи:
+// новая версия копирует только строки страниц с измененными тайлами, а
+// остальные разделяет с предыдущей. Страницы освобождаются вместе с
+// последней версией, которая на них ссылается. Снимок не ссылается на
+// таблицу и читается из любых потоков, пока таблица изменяется
+class SheetSnapshot : public SheetInterface {
+public:
+    using PageRows = std::array<std::shared_ptr<const SnapshotPageRow>, CellTable::TILE_ROWS>;
+
+    SheetSnapshot(uint64_t version, PageRows rows, Size size);
+
+    // Номер версии таблицы; растет с каждым снимком, отражающим изменения
+    uint64_t GetVersion() const;
+    const PageRows& GetPageRows() const;
+
+    // Снимок нельзя изменить: бросается std::logic_error
+    void SetCell(Position pos, std::string text) override;
+    void ClearCell(Position pos) override;
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+private:
+    const SnapshotCell* FindCell(Position pos) const;
+
+    template <typename Printer>
+    void PrintCells(std::ostream& output, Printer print_cell) const;
+
+    uint64_t version_;
+    PageRows rows_; // Строки страниц; nullptr - строка тайлов пуста
+    Size size_; // Печатная область на момент снимка
+};
@@ -0,0 +1,47 @@
+#include "string_pool.h"
+
+#include <cassert>
+
+/**
+ * Возвращает идентификатор строки text, добавляя ее в пул при необходимости
+*/
+StringPool::Id StringPool::Intern(std::string_view text) {
+    if (auto it = index_.find(text); it != index_.end()) {
+        ++entries_[it->second].ref_count;
+        return it->second;
+    }
+
+    // Переиспользуем освобожденный идентификатор, если он есть
+    Id id = 0;
+    if (!free_ids_.empty()) {
+        id = free_ids_.back();
+        free_ids_.pop_back();
+    }
+    else {
+        id = static_cast<Id>(entries_.size());
+        entries_.emplace_back();
+    }
+
+    Entry& entry = entries_[id];
+    entry.text = std::string(text);
+    entry.ref_count = 1;
+    index_.emplace(entry.text, id);
+
+    return id;
+}
+
+/**
+ * Освобождает ссылку на строку. Строка без ссылок удаляется из пула
+*/
+void StringPool::Release(Id id) {
+    Entry& entry = entries_[id];
+    assert(entry.ref_count > 0);
+
+    if (--entry.ref_count > 0) {
+        return;
+    }
+
+    index_.erase(entry.text);
+    entry.text = std::string();
+    free_ids_.push_back(id);
+}
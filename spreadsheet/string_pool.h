@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Пул строк таблицы со счетчиками ссылок.
+// Каждая уникальная строка хранится один раз и адресуется 32-битным
+// идентификатором, поэтому равенство строк из пула проверяется сравнением
+// идентификаторов. Строка удаляется, когда освобождена последняя ссылка на нее.
+class StringPool {
+public:
+    using Id = uint32_t;
+
+    // Возвращает идентификатор строки text, увеличивая счетчик ссылок на нее
+    Id Intern(std::string_view text);
+    // Уменьшает счетчик ссылок на строку
+    void Release(Id id);
+
+    // Представление действительно, пока на строку есть хотя бы одна ссылка
+    std::string_view Get(Id id) const {
+        return entries_[id].text;
+    }
+
+    // Количество уникальных строк в пуле
+    size_t GetSize() const {
+        return index_.size();
+    }
+
+private:
+    struct Entry {
+        std::string text;
+        uint32_t ref_count = 0;
+    };
+
+    std::deque<Entry> entries_; // Строки пула; deque сохраняет их адреса при росте
+    std::vector<Id> free_ids_; // Идентификаторы освобожденных строк
+    std::unordered_map<std::string_view, Id> index_; // Поиск идентификатора по строке
+};
@@ -1,8 +1,10 @@
 #include "common.h"
 
+#include <algorithm>
 #include <cctype>
+#include <cerrno>
 #include <cmath>
-#include <regex>
+#include <cstdlib>
 #include <sstream>
 
 const int LETTERS = 26;
@@ -18,6 +20,45 @@ bool Size::operator==(Size rhs) const {
     return std::tie(rows, cols) == std::tie(rhs.rows, rhs.cols);
 }
 
+/**
+ * Возвращает true, если диапазоны совпадают
+*/
+bool Range::operator==(Range rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+/**
+ * Возвращает true, если углы диапазона валидны и упорядочены
+*/
+bool Range::IsValid() const {
+    return first.IsValid() && last.IsValid()
+        && first.row <= last.row && first.col <= last.col;
+}
+/**
+ * Возвращает true, если позиция входит в диапазон
+*/
+bool Range::Contains(Position pos) const {
+    return first.row <= pos.row && pos.row <= last.row
+        && first.col <= pos.col && pos.col <= last.col;
+}
+/**
+ * Преобразует диапазон в строку вида A1:B10, диапазон из одной ячейки - в A1
+*/
+std::string Range::ToString() const {
+    if (first == last) {
+        return first.ToString();
+    }
+    return first.ToString() + ':' + last.ToString();
+}
+/**
+ * Возвращает диапазон с углами a и b
+*/
+Range Range::FromCorners(Position a, Position b) {
+    return {
+        { std::min(a.row, b.row), std::min(a.col, b.col) },
+        { std::max(a.row, b.row), std::max(a.col, b.col) },
+    };
+}
+
 /**
  * Возвращает true, если позиции указывают на одну ячейку
 */
@@ -73,8 +114,8 @@ static int ConvertColumnLiteralsToNums(std::string_view col_chars) {
 
     // Итерируемся по символам, преобразуем при помощи 
     // стандартной формулы приведения систем исчисления
-    for (int i = 0; i < static_cast<int>(col_chars.size()); ++i) {
-        result += (col_chars[i] - 'A' + 1) * pow(LETTERS, col_chars.size() - i - 1);
+    for (char c : col_chars) {
+        result = result * LETTERS + (c - 'A' + 1);
     }
 
     return result;
@@ -88,34 +129,38 @@ Position Position::FromString(std::string_view str) {
         return Position::NONE;
     }
 
-    int row = -1; // Номер строки
-    int col = -1; // Номер столбца
+    // Строка должна иметь вид [A-Z]{1,3}[0-9]{1,5}
+    size_t letters = 0;
+    while (letters < str.size() && str[letters] >= 'A' && str[letters] <= 'Z') {
+        ++letters;
+    }
 
-    // Регулярное выражение номера ячейки
-    static std::regex pos_reg("([A-Z]{1,3})([0-9]{1,5})");
-    std::smatch m;
-    std::string text = std::string(str);
+    // Если количество символов столбца больше MAX_POS_LETTER_COUNT - возвращаем невалидную позицию
+    if (letters == 0 || letters > MAX_POS_LETTER_COUNT) {
+        return Position::NONE;
+    }
 
-    // Если строка не соответствует регулярному выражению - возвращаем невалидную позицию
-    if (!std::regex_match(text, m, pos_reg)) {
+    const size_t digits = str.size() - letters;
+    if (digits == 0 || digits > 5) {
         return Position::NONE;
     }
 
     // Преобразуем номер строки в int
-    row = std::stoi(m[2].str());
+    int row = 0;
+    for (size_t i = letters; i < str.size(); ++i) {
+        if (str[i] < '0' || str[i] > '9') {
+            return Position::NONE;
+        }
+        row = row * 10 + (str[i] - '0');
+    }
     // Если номер строки нулевой или превышает максимально допустимое значение 
     // - возвращаем невалидную позицию
     if (0 >= row || row > MAX_ROWS) {
         return Position::NONE;
     }
 
-    // Если количество символов столбца больше MAX_POS_LETTER_COUNT - возвращаем невалидную позицию
-    if (m[1].str().size() > MAX_POS_LETTER_COUNT) {
-        return Position::NONE;
-    }
-
     // Преобразуем номер столбца в int
-    col = ConvertColumnLiteralsToNums(m[1].str());
+    const int col = ConvertColumnLiteralsToNums(str.substr(0, letters));
     // Если номер столбца нулевой или превышает максимально допустимое значение 
     // - возвращаем невалидную позицию
     if (0 >= col || col > MAX_COLS) {
@@ -123,4 +168,106 @@ Position Position::FromString(std::string_view str) {
     }
 
     return { row - 1, col - 1 };
-}
\ No newline at end of file
+}
+
+/**
+ * Передает visitor непустые ячейки диапазона, обращаясь к ним по одной
+*/
+void SheetInterface::VisitRange(Range range, RangeVisitor& visitor) const {
+    for (int row = range.first.row; row <= range.last.row; ++row) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            const CellInterface* cell = GetCell({ row, col });
+            if (cell != nullptr && !cell->GetText().empty()) {
+                visitor.VisitCell(*cell);
+            }
+        }
+    }
+}
+/**
+ * Записывает числовые значения ячеек столбца, обращаясь к ним по одной
+*/
+void SheetInterface::GetColumnValues(Position first, size_t count,
+                                     double* values, bool* numeric) const {
+    for (size_t i = 0; i < count; ++i) {
+        values[i] = 0.0;
+
+        const CellInterface* cell = GetCell({ first.row + static_cast<int>(i), first.col });
+        if (cell == nullptr) {
+            continue;
+        }
+
+        const CellInterface::NumericValue value = cell->GetNumericValue();
+        if (std::holds_alternative<double>(value)) {
+            values[i] = std::get<double>(value);
+        } else {
+            numeric[i] = false;
+        }
+    }
+}
+
+/**
+ * Возвращает значение ячейки как операнда формулы через GetCell()
+*/
+CellInterface::NumericValue SheetInterface::GetNumericValue(Position pos) const {
+    const CellInterface* cell = GetCell(pos);
+    if (cell == nullptr) {
+        return 0.0;
+    }
+    return cell->GetNumericValue();
+}
+
+/**
+ * Возвращает число, которым является текст целиком, без исключений.
+ * strtod нужна строка с завершающим нулем: короткий текст копируется
+ * в буфер на стеке, длинный - в std::string
+*/
+std::optional<double> ParseCellText(std::string_view text) {
+    char buffer[64];
+    std::string long_text;
+    const char* begin = buffer;
+    if (text.size() < sizeof(buffer)) {
+        text.copy(buffer, text.size());
+        buffer[text.size()] = '\0';
+    } else {
+        long_text = text;
+        begin = long_text.c_str();
+    }
+
+    char* end = nullptr;
+    errno = 0;
+    const double result = std::strtod(begin, &end);
+    if (end == begin
+        || end != begin + text.size()
+        || errno == ERANGE
+        || std::isnan(result))
+    {
+        return std::nullopt;
+    }
+
+    return result;
+}
+
+/**
+ * Возвращает значение ячейки как операнда формулы, разбирая текст значения
+*/
+CellInterface::NumericValue CellInterface::GetNumericValue() const {
+    const ValueView value = GetValueView();
+
+    if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    }
+    if (std::holds_alternative<FormulaError>(value)) {
+        return FormulaError(FormulaError::Category::Value);
+    }
+
+    // Пустой текст значения бывает у пустой ячейки (ноль) и у текста из
+    // одного экранирующего символа (ошибка)
+    const std::string_view text = std::get<std::string_view>(value);
+    if (text.empty() && GetText().empty()) {
+        return 0.0;
+    }
+    if (const std::optional<double> number = ParseCellText(text)) {
+        return *number;
+    }
+    return FormulaError(FormulaError::Category::Value);
+}
@@ -0,0 +1,49 @@
+#include "work_stealing.h"
+
+#include <algorithm>
+
+WorkStealingScheduler::WorkStealingScheduler(size_t thread_count)
+    : thread_count_(std::max<size_t>(thread_count, 1))
+    , queues_(std::make_unique<Queue[]>(thread_count_))
+{}
+
+size_t WorkStealingScheduler::GetThreadCount() const {
+    return thread_count_;
+}
+
+/**
+ * Помещает задачу в конец очереди потока worker
+*/
+void WorkStealingScheduler::Push(size_t worker, Task task) {
+    Queue& queue = queues_[worker];
+    std::lock_guard guard(queue.mutex);
+    queue.tasks.push_back(task);
+}
+
+/**
+ * Берет последнюю задачу своей очереди. Если очередь пуста, обходит
+ * очереди остальных потоков, начиная со следующего, и забирает первую
+ * задачу непустой из них. Возвращает false, если задач нет нигде
+*/
+bool WorkStealingScheduler::Pop(size_t worker, Task& task) {
+    {
+        Queue& own = queues_[worker];
+        std::lock_guard guard(own.mutex);
+        if (!own.tasks.empty()) {
+            task = own.tasks.back();
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+
+    for (size_t step = 1; step < thread_count_; ++step) {
+        Queue& victim = queues_[(worker + step) % thread_count_];
+        std::lock_guard guard(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
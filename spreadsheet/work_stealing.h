@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Планировщик графа задач с кражей работы.
+// У каждого потока своя очередь задач: поток берет задачи с ее конца
+// (последние порожденные, чьи данные еще в кэше процессора), а поток без
+// работы забирает задачу из начала очереди другого потока. Задачи - номера
+// вершин графа; задача может порождать новые через Push()
+class WorkStealingScheduler {
+public:
+    using Task = uint32_t;
+
+    explicit WorkStealingScheduler(size_t thread_count);
+
+    size_t GetThreadCount() const;
+
+    // Помещает задачу в очередь потока worker
+    void Push(size_t worker, Task task);
+
+    // Выполняет func(Task, size_t worker) для задач очередей и порожденных
+    // ими, пока не будет выполнено total задач. Вызывающий поток работает
+    // как поток 0, остальные создаются на время вызова. Исключение задачи
+    // останавливает все потоки и пробрасывается из Run()
+    template <typename Func>
+    void Run(size_t total, Func func);
+
+private:
+    // Очередь потока на отдельной кэш-линии, чтобы блокировки соседних
+    // очередей не мешали друг другу
+    struct alignas(64) Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    // Берет задачу из своей очереди, а если она пуста - крадет у других
+    bool Pop(size_t worker, Task& task);
+
+    size_t thread_count_;
+    std::unique_ptr<Queue[]> queues_;
+};
+
+template <typename Func>
+void WorkStealingScheduler::Run(size_t total, Func func) {
+    std::atomic<size_t> completed{ 0 };
+    std::atomic<bool> failed{ false };
+    std::mutex error_mutex;
+    std::exception_ptr error;
+
+    const auto fail = [&] {
+        std::lock_guard guard(error_mutex);
+        if (!error) {
+            error = std::current_exception();
+        }
+        failed.store(true, std::memory_order_relaxed);
+    };
+
+    const auto work = [&](size_t worker) {
+        try {
+            Task task;
+            while (completed.load(std::memory_order_acquire) < total
+                   && !failed.load(std::memory_order_relaxed))
+            {
+                if (Pop(worker, task)) {
+                    func(task, worker);
+                    completed.fetch_add(1, std::memory_order_release);
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        } catch (...) {
+            fail();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count_ - 1);
+    try {
+        for (size_t worker = 1; worker < thread_count_; ++worker) {
+            threads.emplace_back(work, worker);
+        }
+    } catch (...) {
+        fail();
+    }
+    work(0);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}